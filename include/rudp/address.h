@@ -64,6 +64,18 @@
 extern "C" {
 #endif
 
+/**
+   @this is a resolver-less socket address, large enough for any
+   IPv4 or IPv6 address.  It is used where a full @ref rudp_address
+   is not needed, e.g. for remote peers of a server.
+ */
+union rudp_sockaddr_inet
+{
+    struct sockaddr sa;
+    struct sockaddr_in sin;
+    struct sockaddr_in6 sin6;
+};
+
 /**
    @this is an abstract representation of an address.
 
@@ -236,6 +248,18 @@ RUDP_EXPORT
 int rudp_address_compare(const struct rudp_address *address,
                          const struct sockaddr_storage *addr);
 
+/**
+   @this compares two system addresses.  Only family, port and host
+   address are taken into account.
+
+   @param left System address to compare
+   @param right System address to compare to
+   @returns 0 if they match, another value otherwise
+ */
+RUDP_EXPORT
+int rudp_sockaddr_compare(const struct sockaddr *left,
+                          const struct sockaddr_storage *right);
+
 #ifdef __cplusplus
 }
 #endif
@@ -40,6 +40,19 @@
    handshake with the server, the @ref rudp_client_handler::connected
    handler is called back.
 
+   Data may be sent as soon as @ref rudp_client_connect returns.
+   Messages sent before the handshake completes follow the connection
+   request on the wire, and the server gets them right after its @ref
+   rudp_server_handler::peer_new handler, without waiting for a round
+   trip.  Until then, they are neither compressed nor bundled, and
+   the ones sent on channels the server does not have are dropped.
+
+   A client context remembers the last connection it had.  When the
+   server supports it, @ref rudp_client_connect presents the
+   resumption token the server gave, which spares the cookie round
+   trip, and starts with the former round-trip estimates instead of
+   the default timeouts.
+
    Either because of a connection timeout or because of server
    disconnection the @ref rudp_client_handler::server_lost handler
    is called back.
@@ -163,6 +176,12 @@ struct rudp_client
     struct rudp_address address;
     struct rudp_base *rudp;
     char connected;
+    struct {
+        uint8_t token[RUDP_TOKEN_SIZE];
+        uint8_t token_valid;
+        rudp_time_t srtt;
+        rudp_time_t rttvar;
+    } session;
 };
 
 struct rudp_peer;
@@ -286,7 +305,8 @@ rudp_error_t rudp_client_set_ipv6(
     const uint16_t port) RUDP_DEPRECATED;
 
 /**
-   @this sends data to remote server
+   @this sends data to remote server.  Client may still be
+   connecting.
 
    @param client Source client
    @param reliable Whether to send the payload reliably
@@ -301,6 +321,95 @@ rudp_error_t rudp_client_send(struct rudp_client *client,
                               int reliable, int command,
                               const void *data, const size_t size);
 
+/**
+   @this sends data to remote server on a given channel.  Messages of
+   a channel are delivered in order, independently of other
+   channels.  @ref rudp_client_send uses channel 0.
+
+   @param client Source client
+   @param channel Channel number, lower than the count agreed on
+          with the server
+   @param reliable Whether to send the payload reliably
+   @param command User command code. It may be between 0 and RUDP_CMD_APP_MAX.
+   @param data Payload
+   @param size Total payload size
+
+   @returns An error level
+ */
+RUDP_EXPORT
+rudp_error_t rudp_client_send_channel(struct rudp_client *client,
+                                      unsigned int channel,
+                                      int reliable, int command,
+                                      const void *data, const size_t size);
+
+/**
+   @this sends a partially reliable message to remote server.  See
+   @ref rudp_peer_send_partial.
+
+   @param client Source client
+   @param channel Channel number
+   @param command User command code. It may be between 0 and RUDP_CMD_APP_MAX.
+   @param data Payload
+   @param size Total payload size
+   @param ttl Time to live, 0 for none
+   @param max_retransmits Retransmission count limit, 0 for none
+
+   @returns An error level
+ */
+RUDP_EXPORT
+rudp_error_t rudp_client_send_partial(struct rudp_client *client,
+                                      unsigned int channel, int command,
+                                      const void *data, const size_t size,
+                                      rudp_time_t ttl,
+                                      unsigned int max_retransmits);
+
+/**
+   @this sets the send priority of a channel.  See @ref
+   rudp_peer_set_channel_priority.  This must be called after @ref
+   rudp_client_connect, which resets all priorities to 0.
+
+   @param client Client context
+   @param channel Channel number
+   @param priority Channel priority, higher is sent first
+
+   @returns An error level
+ */
+RUDP_EXPORT
+rudp_error_t rudp_client_set_channel_priority(struct rudp_client *client,
+                                              unsigned int channel,
+                                              uint8_t priority);
+
+/**
+   @this sets how unreliable messages of a channel are delivered.  See
+   @ref rudp_peer_set_channel_delivery.  This must be called after
+   @ref rudp_client_connect, which resets all channels to @ref
+   RUDP_DELIVERY_ORDERED.
+
+   @param client Client context
+   @param channel Channel number
+   @param delivery Delivery mode
+
+   @returns An error level
+ */
+RUDP_EXPORT
+rudp_error_t rudp_client_set_channel_delivery(struct rudp_client *client,
+                                              unsigned int channel,
+                                              enum rudp_delivery delivery);
+
+/**
+   @this pauses or resumes reading from the server.  See @ref
+   rudp_peer_pause_reading.  Reading is resumed by @ref
+   rudp_client_connect.
+
+   @param client Client context
+   @param paused Whether reading is paused
+
+   @returns An error level
+ */
+RUDP_EXPORT
+rudp_error_t rudp_client_pause_reading(struct rudp_client *client,
+                                       int paused);
+
 #ifdef __cplusplus
 }
 #endif
@@ -176,6 +176,9 @@ void rudp_endpoint_set_ipv6(
 /**
    @this open and binds an endpoint to its address
 
+   Outgoing datagrams are sent with the don't fragment bit where the
+   system allows it, peers discover the path MTU by themselves.
+
    @param endpoint Endpoint to bind
  */
 RUDP_EXPORT
@@ -203,6 +206,56 @@ rudp_error_t rudp_endpoint_send(struct rudp_endpoint *endpoint,
                                 const struct rudp_address *addr,
                                 const void *data, size_t len);
 
+/**
+   @this sends data from the endpoint to a raw socket address.  This
+   is the same as @ref rudp_endpoint_send for callers not holding a
+   @ref rudp_address.
+
+   @param endpoint Enpoint to use as source
+   @param addr Destination address
+   @param addrlen Size of the address structure
+   @param data Data pointer
+   @param len Length of data
+   @returns a possible error
+ */
+RUDP_EXPORT
+rudp_error_t rudp_endpoint_sendto(struct rudp_endpoint *endpoint,
+                                  const struct sockaddr *addr,
+                                  socklen_t addrlen,
+                                  const void *data, size_t len);
+
+/**
+   @this describes one part of a datagram sent with @ref
+   rudp_endpoint_sendtov.
+ */
+struct rudp_endpoint_buffer
+{
+    const void *data;
+    size_t len;
+};
+
+/** Maximum count of buffers for @ref rudp_endpoint_sendtov */
+#define RUDP_ENDPOINT_MAX_BUFFERS 8
+
+/**
+   @this sends a datagram gathered from several buffers from the
+   endpoint to a raw socket address, without copying them together
+   first.
+
+   @param endpoint Enpoint to use as source
+   @param addr Destination address
+   @param addrlen Size of the address structure
+   @param buffers Datagram parts, in order
+   @param count Count of parts, at most @ref #RUDP_ENDPOINT_MAX_BUFFERS
+   @returns a possible error
+ */
+RUDP_EXPORT
+rudp_error_t rudp_endpoint_sendtov(struct rudp_endpoint *endpoint,
+                                   const struct sockaddr *addr,
+                                   socklen_t addrlen,
+                                   const struct rudp_endpoint_buffer *buffers,
+                                   size_t count);
+
 /**
    @this receives data from the associated socket.
 
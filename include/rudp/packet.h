@@ -34,12 +34,19 @@
 
    As the 1-byte command code is under-used, user can use any code
    equal or above @ref RUDP_CMD_APP.
+
+   The first byte of the header is a format version.  Version @ref
+   RUDP_VERSION is the original header with 16-bit sequence numbers,
+   always used for the connection request.  Peers then switch to the
+   format of the features they agreed on, see @ref
+   #RUDP_FEATURE_SEQ32 and @ref #RUDP_FEATURE_COMPACT.
  */
 
 #include <stdint.h>
 #include <stdlib.h>
 #include <rudp/list.h>
 #include <rudp/compiler.h>
+#include <rudp/time.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -117,6 +124,129 @@ enum rudp_command
      */
     RUDP_CMD_PONG = 5,
 
+    /**
+       @table 2
+       @item @item
+       @item Relevant field @item pmtu.
+       @item Semantic @item Path MTU probe, padded to @tt size bytes
+             on the wire
+       @item Expected answer @item PMTU_ACK with same size
+       @item Notes @item Must not be RELIABLE. Only sent when
+             @ref #RUDP_FEATURE_PMTUD is agreed on. Does not take a
+             sequence number.
+       @end table
+     */
+    RUDP_CMD_PMTU_PROBE = 6,
+
+    /**
+       @table 2
+       @item @item
+       @item Relevant field @item pmtu.
+       @item Semantic @item A probe of @tt size bytes was received
+       @item Expected answer @item None
+       @item Notes @item Must not be RELIABLE. Does not take a
+             sequence number.
+       @end table
+     */
+    RUDP_CMD_PMTU_ACK = 7,
+
+    /**
+       @table 2
+       @item @item
+       @item Relevant field @item data, a sequence of @ref
+             rudp_packet_bundle_item
+       @item Semantic @item Several small application messages in a
+             single packet
+       @item Expected answer @item None
+       @item Notes @item May be RELIABLE or not, applies to all the
+             messages.  Never segmented.  Only sent when @ref
+             #RUDP_FEATURE_BUNDLE is agreed on.
+       @end table
+     */
+    RUDP_CMD_BUNDLE = 8,
+
+    /**
+       @table 2
+       @item @item
+       @item Relevant field @item fec.
+       @item Semantic @item XOR parity of a group of segments of a
+             message, lets the receiver rebuild one lost segment of
+             the group
+       @item Expected answer @item None
+       @item Notes @item Must not be RELIABLE. Only sent when @ref
+             #RUDP_FEATURE_FEC is agreed on. Handled whatever its
+             sequence numbers.
+       @end table
+     */
+    RUDP_CMD_FEC = 9,
+
+    /**
+       @table 2
+       @item @item
+       @item Relevant field @item skip.
+       @item Semantic @item The sender gave up on the @tt count
+             reliable sequence numbers ending with this packet's
+             one, receiver takes them as received
+       @item Expected answer @item Ack
+       @item Notes @item Must be RELIABLE.  Only sent when @ref
+             #RUDP_FEATURE_SKIP is agreed on.
+       @end table
+     */
+    RUDP_CMD_SKIP = 10,
+
+    /**
+       @table 2
+       @item @item
+       @item Relevant field @item cookie
+       @item Semantic @item Server asks the client to repeat its
+             connection request with this cookie appended
+       @item Expected answer @item Conn req
+       @item Notes @item Never reliable, sent by a server keeping no
+             state for the client.  Only sent to clients offering
+             @ref #RUDP_FEATURE_COOKIE.
+       @end table
+     */
+    RUDP_CMD_COOKIE = 11,
+
+    /**
+       @table 2
+       @item @item
+       @item Relevant field @item token
+       @item Semantic @item Server gives the client a token to resume
+             a later connection with
+       @item Expected answer @item Ack
+       @item Notes @item Must be RELIABLE.  Only sent when @ref
+             #RUDP_FEATURE_RESUME is agreed on.
+       @end table
+     */
+    RUDP_CMD_TOKEN = 12,
+
+    /**
+       @table 2
+       @item @item
+       @item Relevant field @item path
+       @item Semantic @item Server checks the client is reachable at
+             the new address this is sent to
+       @item Expected answer @item PATH_RESPONSE with same data
+       @item Notes @item Never reliable, does not take a sequence
+             number.  Only sent when @ref #RUDP_FEATURE_CONN_ID is
+             agreed on.
+       @end table
+     */
+    RUDP_CMD_PATH_CHALLENGE = 13,
+
+    /**
+       @table 2
+       @item @item
+       @item Relevant field @item path
+       @item Semantic @item Answer to a PATH_CHALLENGE, with its data
+       @item Expected answer @item None
+       @item Notes @item Never reliable, does not take a sequence
+             number.
+       @end table
+     */
+    RUDP_CMD_PATH_RESPONSE = 14,
+
     /**
        @table 2
        @item @item
@@ -143,11 +273,170 @@ enum rudp_command
     Packet was retransmitted at least once. */
 #define RUDP_OPT_RETRANSMITTED 4
 
+/** @mgroup{Flags}
+    Message is compressed, see @ref #RUDP_FEATURE_COMPRESS.  Set on
+    all the segments of the message. */
+#define RUDP_OPT_COMPRESSED 8
+
+/** @mgroup{Flags}
+    Unreliable packet is taken if newer than the last unreliable one,
+    whatever the reliable packets received, see @ref
+    #RUDP_FEATURE_DELIVERY. */
+#define RUDP_OPT_SEQUENCED 0x10
+
+/** @mgroup{Flags}
+    Unreliable packet is taken once, in whatever order it comes, see
+    @ref #RUDP_FEATURE_DELIVERY. */
+#define RUDP_OPT_UNORDERED 0x20
+
 #define RUDP_CMD_APP_MAX (0xff - RUDP_CMD_APP)
 
+/** @mgroup{Features}
+    32-bit sequence numbers.  Once agreed, peers send headers of the
+    @ref rudp_packet_header_seq32 format. */
+#define RUDP_FEATURE_SEQ32 0x1
+
+/** @mgroup{Features}
+    Path MTU discovery.  Peer answers @ref RUDP_CMD_PMTU_PROBE
+    packets. */
+#define RUDP_FEATURE_PMTUD 0x2
+
+/** @mgroup{Features}
+    Peer understands @ref RUDP_CMD_BUNDLE packets. */
+#define RUDP_FEATURE_BUNDLE 0x4
+
+/** @mgroup{Features}
+    Peer understands messages marked @ref #RUDP_OPT_COMPRESSED.  Such
+    a message starts with its uncompressed size (32-bit, network
+    endian), followed by an LZ77 block. */
+#define RUDP_FEATURE_COMPRESS 0x8
+
+/** @mgroup{Features}
+    Peer handles @ref RUDP_CMD_FEC packets. */
+#define RUDP_FEATURE_FEC 0x10
+
+/** @mgroup{Features}
+    Peer handles @ref RUDP_CMD_SKIP packets, messages with a deadline
+    may expire. */
+#define RUDP_FEATURE_SKIP 0x20
+
+/** @mgroup{Features}
+    Unreliable packets are not ordered after reliable ones.  Their
+    reliable sequence number is the last one acknowledged by the
+    peer, their unreliable one is never reset.  A reliable packet
+    waiting for retransmission does not hold them back. */
+#define RUDP_FEATURE_FAST_LANE 0x40
+
+/** @mgroup{Features}
+    Peer honours @ref #RUDP_OPT_SEQUENCED and @ref
+    #RUDP_OPT_UNORDERED.  As with @ref #RUDP_FEATURE_FAST_LANE,
+    unreliable sequence numbers of a channel are never reset, they
+    tell packets apart. */
+#define RUDP_FEATURE_DELIVERY 0x80
+
+/** @mgroup{Features}
+    Client understands @ref RUDP_CMD_COOKIE packets.  A server may
+    answer its first connection request with a cookie, and only
+    create a peer once the request comes back with it. */
+#define RUDP_FEATURE_COOKIE 0x100
+
+/** @mgroup{Features}
+    Server gives the client a connection id in its connection
+    response, client sends it in the header of all its following
+    packets, see @ref #RUDP_VERSION_CONN_ID.  Server finds the peer
+    from it instead of the source address, which may change.  Client
+    answers @ref RUDP_CMD_PATH_CHALLENGE packets. */
+#define RUDP_FEATURE_CONN_ID 0x200
+
+/** @mgroup{Features}
+    Server sends @ref RUDP_CMD_TOKEN packets.  Client may append the
+    last token it got to its next connection request, server then
+    takes its former round-trip time estimates back, and needs no
+    cookie from it. */
+#define RUDP_FEATURE_RESUME 0x400
+
+/** @mgroup{Features}
+    Peer sends and echoes timestamps in the header of its sequenced
+    packets, see @ref #RUDP_VERSION_TIMESTAMP.  Acknowledges of
+    retransmitted packets then yield round-trip time samples too. */
+#define RUDP_FEATURE_TIMESTAMP 0x800
+
+/** @mgroup{Features}
+    Peer advertises the room it has left for reliable packets in the
+    header of its acknowledges, see @ref #RUDP_VERSION_WINDOW, and
+    does not send more than the other side advertises. */
+#define RUDP_FEATURE_WINDOW 0x1000
+
+/** @mgroup{Features}
+    Once agreed, peers send headers of the compact format, see @ref
+    #RUDP_VERSION_COMPACT. */
+#define RUDP_FEATURE_COMPACT 0x2000
+
+/** @mgroup{Features}
+    Upper byte of feature masks holds the count of channels minus one,
+    see @ref rudp_set_channels.  Older implementations send 0, meaning
+    a single channel. */
+#define RUDP_FEATURE_CHANNELS_SHIFT 24
+
+/** @mgroup{Features} */
+#define RUDP_FEATURE_CHANNELS_MASK 0xff000000
+
+/** @mgroup{Features}
+    All the features this implementation knows. */
+#define RUDP_FEATURE_ALL (RUDP_FEATURE_SEQ32 | RUDP_FEATURE_PMTUD \
+                          | RUDP_FEATURE_BUNDLE | RUDP_FEATURE_COMPRESS \
+                          | RUDP_FEATURE_FEC | RUDP_FEATURE_SKIP \
+                          | RUDP_FEATURE_FAST_LANE | RUDP_FEATURE_DELIVERY \
+                          | RUDP_FEATURE_COOKIE | RUDP_FEATURE_CONN_ID \
+                          | RUDP_FEATURE_RESUME | RUDP_FEATURE_TIMESTAMP \
+                          | RUDP_FEATURE_WINDOW | RUDP_FEATURE_COMPACT)
+
+/**
+   Header format version of @ref rudp_packet_header_seq32.
+ */
+#define RUDP_VERSION_SEQ32 0x02
+
+/**
+   Header format version of the compact header.  It has no fixed
+   layout: the version, command and opt bytes are followed by a
+   layout byte telling which fields come next, and their width.
+   Reliable sequence number is truncated to 8, 16 or 32 bits,
+   unreliable one is exact on 0 (for a value of 0), 8, 16 or 32 bits,
+   acknowledge is there along @ref #RUDP_OPT_ACK only, channel if not
+   0, segment fields if the message has more than one.
+ */
+#define RUDP_VERSION_COMPACT 0x03
+
+/**
+   Flag of the header version byte.  When set, header is followed by
+   the 32-bit connection id (network order) the server gave, see @ref
+   #RUDP_FEATURE_CONN_ID.
+ */
+#define RUDP_VERSION_CONN_ID 0x80
+
+/**
+   Flag of the header version byte.  When set, header and connection
+   id are followed by two 32-bit timestamps (network order), in ms:
+   the time the packet was sent at, and the first one of the last new
+   reliable or parity packet received on the channel, 0 if none yet.
+   See @ref #RUDP_FEATURE_TIMESTAMP.
+ */
+#define RUDP_VERSION_TIMESTAMP 0x40
+
+/**
+   Flag of the header version byte, only set along @ref
+   RUDP_OPT_ACK.  When set, header, connection id and timestamps are
+   followed by a 32-bit receive window (network order): the count of
+   bytes of reliable packets, all channels together, the sender of
+   the header accepts beyond the ones it acknowledged.  See @ref
+   #RUDP_FEATURE_WINDOW.
+ */
+#define RUDP_VERSION_WINDOW 0x20
+
 /**
    Packet header structure. All fields in this structure should be
-   transmitted in network order.
+   transmitted in network order.  Sequence numbers and acknowledge are
+   relative to the channel of the packet.
  */
 RUDP_PACKED(
 struct rudp_packet_header
@@ -155,7 +444,7 @@ struct rudp_packet_header
     uint8_t version;
     uint8_t command;
     uint8_t opt;
-    uint8_t dummy;
+    uint8_t channel;
     uint16_t reliable_ack;
     uint16_t reliable;
     uint16_t unreliable;
@@ -165,7 +454,41 @@ struct rudp_packet_header
 );
 
 /**
-   Connection request packet (@xref {protocol}).
+   Packet header structure with 32-bit sequence numbers, sent once
+   @ref #RUDP_FEATURE_SEQ32 is agreed on.  Fields have the same
+   meaning as in @ref rudp_packet_header, all of them should be
+   transmitted in network order.
+ */
+RUDP_PACKED(
+struct rudp_packet_header_seq32
+{
+    uint8_t version;
+    uint8_t command;
+    uint8_t opt;
+    uint8_t channel;
+    uint32_t reliable_ack;
+    uint32_t reliable;
+    uint32_t unreliable;
+    uint16_t segments_size;
+    uint16_t segment_index;
+}
+);
+
+/** Size of the cookie of @ref rudp_packet_cookie */
+#define RUDP_COOKIE_SIZE 12
+
+/** Size of the token of @ref rudp_packet_token */
+#define RUDP_TOKEN_SIZE 16
+
+/** Size of the data of @ref rudp_packet_path */
+#define RUDP_PATH_DATA_SIZE 8
+
+/**
+   Connection request packet (@xref {protocol}).  @tt data holds the
+   mask of features the sender offers.  A request answering a @ref
+   RUDP_CMD_COOKIE packet is followed by the @ref #RUDP_COOKIE_SIZE
+   bytes of the cookie.  A request resuming a connection is followed
+   by the @ref #RUDP_TOKEN_SIZE bytes of a token instead.
  */
 RUDP_PACKED(
 struct rudp_packet_conn_req
@@ -176,13 +499,105 @@ struct rudp_packet_conn_req
 );
 
 /**
-   Connection response packet (@xref {protocol}).
+   Connection response packet (@xref {protocol}).  @tt features holds
+   the mask of offered features the responder agreed on.  It is absent
+   from responses of older implementations, which means none.  When
+   @ref #RUDP_FEATURE_CONN_ID is agreed on, it is followed by the
+   32-bit connection id (network order) of the client.
  */
 RUDP_PACKED(
 struct rudp_packet_conn_rsp
 {
     struct rudp_packet_header header;
     uint32_t accepted;
+    uint32_t features;
+}
+);
+
+/**
+   Path MTU probe and acknowledge packet (@xref {protocol}).  @tt
+   size is the probed datagram size.
+ */
+RUDP_PACKED(
+struct rudp_packet_pmtu
+{
+    struct rudp_packet_header header;
+    uint32_t size;
+}
+);
+
+/**
+   Parity packet (@xref {protocol}).  Header segment fields hold the
+   index of the first segment of the group and the segment count of
+   the message.  @tt base is the sequence number of segment 0, the
+   reliable one if @tt reliable is set, the unreliable one otherwise.
+   @tt data is the XOR of the @tt count segments of the group,
+   shorter ones padded with zeros, @tt size_xor the XOR of their
+   sizes.
+ */
+RUDP_PACKED(
+struct rudp_packet_fec
+{
+    struct rudp_packet_header header;
+    uint32_t base;
+    uint16_t size_xor;
+    uint8_t count;
+    uint8_t reliable;
+    uint8_t data[0];
+}
+);
+
+/**
+   Skip packet (@xref {protocol}).  Reliable sequence numbers from the
+   header one minus @tt count plus one up to the header one are not
+   sent anymore.
+ */
+RUDP_PACKED(
+struct rudp_packet_skip
+{
+    struct rudp_packet_header header;
+    uint32_t count;
+}
+);
+
+/**
+   Cookie packet (@xref {protocol}).  @tt cookie is opaque to the
+   client, it holds the issue time and a MAC of the client address
+   under a key only known to the server.
+ */
+RUDP_PACKED(
+struct rudp_packet_cookie
+{
+    struct rudp_packet_header header;
+    uint8_t cookie[RUDP_COOKIE_SIZE];
+}
+);
+
+/**
+   Resumption token packet (@xref {protocol}).  @tt token is opaque to
+   the client, it holds the issue time and the round-trip time
+   estimates of the server, with a MAC of them and of the client
+   address under a key only known to the server.
+ */
+RUDP_PACKED(
+struct rudp_packet_token
+{
+    struct rudp_packet_header header;
+    uint8_t token[RUDP_TOKEN_SIZE];
+}
+);
+
+/**
+   Message of a bundle packet.  @tt command is the message command,
+   at least @ref RUDP_CMD_APP, @tt size is the length of @tt data
+   (network endian).
+ */
+RUDP_PACKED(
+struct rudp_packet_bundle_item
+{
+    uint8_t command;
+    uint16_t size;
+    uint8_t data[0];
 }
 );
 
@@ -197,6 +612,18 @@ struct rudp_packet_data
 }
 );
 
+/**
+   Path challenge and response packet (@xref {protocol}).  @tt data
+   is random, response echoes the one of the challenge.
+ */
+RUDP_PACKED(
+struct rudp_packet_path
+{
+    struct rudp_packet_header header;
+    uint8_t data[RUDP_PATH_DATA_SIZE];
+}
+);
+
 /**
    Structure factoring all the possible packet types.
  */
@@ -207,13 +634,34 @@ struct rudp_packet
         struct rudp_packet_header header;
         struct rudp_packet_conn_req conn_req;
         struct rudp_packet_conn_rsp conn_rsp;
+        struct rudp_packet_pmtu pmtu;
+        struct rudp_packet_fec fec;
+        struct rudp_packet_skip skip;
+        struct rudp_packet_cookie cookie;
+        struct rudp_packet_token token;
+        struct rudp_packet_path path;
         struct rudp_packet_data data;
     };
 }
 );
 
+struct rudp_payload;
+
 /**
    Packet chain structure
+
+   An outgoing chain may reference a slice of a shared, reference
+   counted payload buffer.  In such case @tt packet only holds the
+   header (@tt len bytes) and the slice is sent right after it.
+
+   Whatever the format used on the wire, @tt packet always starts with
+   a @ref rudp_packet_header.  Its sequence number fields are not
+   meaningful, full sequence numbers are kept in @tt seq_reliable and
+   @tt seq_unreliable, and the wire header is built on transmission.
+
+   A reliable outgoing chain expires when @tt deadline, if not 0, is
+   past, or when it was retransmitted @tt retransmit_max times, if
+   not 0.
  */
 struct rudp_packet_chain
 {
@@ -221,6 +669,17 @@ struct rudp_packet_chain
     struct rudp_packet *packet;
     size_t alloc_size;
     size_t len;
+    struct rudp_payload *payload;
+    size_t payload_offset;
+    size_t payload_len;
+    uint32_t seq_reliable;
+    uint32_t seq_unreliable;
+    rudp_time_t deadline;
+    uint16_t retransmit_max;
+    uint16_t retransmits;
+    uint16_t timeouts;
+    rudp_time_t sent_time;
+    uint8_t lost;
 };
 
 /**
@@ -38,6 +38,7 @@
 #include <rudp/list.h>
 #include <rudp/address.h>
 #include <rudp/compiler.h>
+#include <rudp/packet.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -51,7 +52,7 @@ struct rudp_packet_chain;
 
 struct rudp_link_info
 {
-    uint16_t acked;
+    uint32_t acked;
 };
 
 /**
@@ -95,6 +96,74 @@ struct rudp_peer_handler
     void (*dropped)(struct rudp_peer *peer);
 };
 
+/**
+   @this specifies how unreliable messages of a channel are
+   delivered, see @ref rudp_peer_set_channel_delivery.
+ */
+enum rudp_delivery
+{
+    /** Newer than the last unreliable one, after the reliable
+        messages sent before them */
+    RUDP_DELIVERY_ORDERED,
+    /** As soon as they come, newer than the last unreliable one */
+    RUDP_DELIVERY_SEQUENCED,
+    /** As soon as they come, once */
+    RUDP_DELIVERY_UNORDERED,
+};
+
+/**
+   @this is the protocol state of a channel of a peer.  Channels of a
+   peer have their own sequence numbers, send queue and ordering, a
+   packet lost on a channel does not delay the other ones.
+
+   @hidecontent
+ */
+struct rudp_peer_channel
+{
+    /* Sequence numbers are kept 32-bit wide, whatever the header
+       format in use */
+    uint32_t in_seq_reliable;
+    uint32_t in_seq_unreliable;
+    uint32_t out_seq_reliable;
+    uint32_t out_seq_unreliable;
+    uint32_t out_seq_acked;
+    /** Unreliable packets received, bit n is in_seq_unreliable - 1 -
+        n, when unreliable sequence numbers are not restarted */
+    uint32_t in_seq_window;
+    /** Timestamp of the last new reliable or parity packet, echoed
+        back, see @ref #RUDP_FEATURE_TIMESTAMP */
+    uint32_t ts_recent;
+    uint8_t must_ack;
+    /** Sent packets were found lost, they go out on next service */
+    uint8_t lost;
+    /** Tail loss probe sent since packets were last acknowledged */
+    uint8_t probed;
+    /** New packets wait for the peer window to open */
+    uint8_t blocked;
+    /** Unreliable delivery, see @ref rudp_peer_set_channel_delivery */
+    uint8_t delivery;
+    /** Send priority, see @ref rudp_peer_set_channel_priority */
+    uint8_t priority;
+    struct rudp_list sendq;
+    /** Unreliable packets, sent whatever the state of sendq, when
+        @ref #RUDP_FEATURE_FAST_LANE is agreed on */
+    struct rudp_list unreliable_sendq;
+    /** Item in the peer's list of channels, by decreasing priority */
+    struct rudp_list sched_item;
+    /** Message being reassembled.  Segment i is at offset i *
+        RUDP_RECV_BUFFER_SIZE, segment sizes and a bitmap of received
+        segments follow them. */
+    struct rudp_packet_chain *segments;
+    /** Sequence number of segment 0, reliable or unreliable one */
+    uint32_t segments_base;
+    uint16_t segments_count;
+    uint16_t segments_received;
+    uint8_t segments_reliable;
+    uint8_t bundle_reliable;
+    /** Bundle being filled, not in sendq yet */
+    struct rudp_packet_chain *bundle;
+};
+
 /**
    @this is a peer context structure.  User must not use its fields
    directly.
@@ -112,37 +181,126 @@ struct rudp_peer_handler
  */
 struct rudp_peer
 {
-    struct rudp_peer_handler handler;
-    struct rudp_address address;
+    /* Per-packet state, kept together at the head of the structure */
+    struct rudp_peer_channel *channels;
+    /** Channels usable with the peer, agreed on at connection */
+    uint16_t channel_count;
+    /** Channels allocated */
+    uint16_t channel_max;
+    /** Features agreed on at connection, RUDP_FEATURE_* */
+    uint32_t features;
+    /** Smoothed round-trip time. */
+    rudp_time_t srtt;
+    /** Retransmission timeout. */
+    rudp_time_t rto;
+    /** Channel 0, the only one when no other is configured.  Its
+        sequence numbers are in the first cache line. */
+    struct rudp_peer_channel default_channel;
+
+    /* Timers */
+    struct event *ev;
+    rudp_time_t abs_timeout_deadline;
+    rudp_time_t last_out_time;
+    /** Time a new packet was last received at */
+    rudp_time_t last_in_time;
+    /** Time the last ping was sent at */
+    rudp_time_t ping_time;
+    /** Time pending bundles must be sent at, 0 if none */
+    rudp_time_t bundle_deadline;
+    /** Time a packet goes out whatever the window, when none is in
+        flight, 0 if not set */
+    rudp_time_t window_probe;
+    /** Round-trip time variation. */
+    rudp_time_t rttvar;
+
+    /** Bytes of reliable packets sent and not acknowledged yet */
+    uint32_t flight;
+    /** Bytes the peer accepts beyond the ones it acknowledged, see
+        @ref #RUDP_FEATURE_WINDOW, 64 KiB for peers not agreeing on
+        it */
+    uint32_t send_window;
+    /** Window we advertise when reading */
+    uint32_t receive_window;
+    /** Bytes of the messages in held */
+    uint32_t held_size;
+    /** Connection id the peer knows us by, sent in our headers, 0
+        if none */
+    uint32_t out_conn_id;
+    /** Connection id we gave to the peer, 0 if none */
+    uint32_t in_conn_id;
+    rudp_error_t sendto_err;
+    /** Largest datagram known to reach the peer, segments are sized
+        after it. */
+    uint16_t mtu;
+
+    /* Small fields, grouped to avoid padding */
+    uint8_t ev_embedded:1;
+    uint8_t channels_embedded:1;
+    uint8_t state;
+    /** Retransmission timeouts since last round-trip sample, rto
+        is doubled for each */
+    uint8_t backoff;
+    /** Random shortening of idle intervals, in 1/1024 */
+    uint8_t keepalive_spread;
+    /** Whether reading is paused, messages go to held */
+    uint8_t paused;
+    /** Segments per parity packet, 0 for none */
+    uint8_t fec_group;
+    /** Whether @tt token is set */
+    uint8_t token_valid;
+    /* Compression bypass, messages left to send uncompressed and
+       the count to skip after next failure */
+    struct {
+        uint8_t skip;
+        uint8_t backoff;
+    } compress;
+
+    /** Messages received while reading is paused */
+    struct rudp_list held;
+    /** Channels, by decreasing priority */
+    struct rudp_list sched;
     struct rudp_endpoint *endpoint;
+    struct rudp_base *rudp;
+    /** Remote address, no resolver state is kept for peers. */
+    union rudp_sockaddr_inet address;
+    /** Last resumption token received, see @ref #RUDP_FEATURE_RESUME */
+    uint8_t token[RUDP_TOKEN_SIZE];
+    /* Address migration, new address being checked, AF_UNSPEC if
+       none, data of the challenge and time it was last sent at */
+    struct {
+        union rudp_sockaddr_inet address;
+        uint8_t data[RUDP_PATH_DATA_SIZE];
+        rudp_time_t time;
+    } path;
+
+    /* Configuration, seldom read */
     struct {
         /** Minimum retransmission timeout. */
         rudp_time_t min_rto;
         /** Maximum retransmission timeout. */
         rudp_time_t max_rto;
+        /** Least silence of the peer before it is pinged */
         rudp_time_t action;
         rudp_time_t drop;
+        /** Longest time without sending anything, 0 for no limit */
+        rudp_time_t keepalive;
+        /** Retransmission timeouts of a packet before it fails, 0
+            for none */
+        uint16_t retries;
+        /** Backed off rto reduction range, in percent */
+        uint8_t jitter;
     } timeout;
-    rudp_time_t abs_timeout_deadline;
-    rudp_time_t last_out_time;
-    /** Smoothed round-trip time. */
-    rudp_time_t srtt;
-    /** Round-trip time variation. */
-    rudp_time_t rttvar;
-    /** Retransmission timeout. */
-    rudp_time_t rto;
-    uint16_t in_seq_reliable;
-    uint16_t in_seq_unreliable;
-    uint16_t out_seq_reliable;
-    uint16_t out_seq_unreliable;
-    uint16_t out_seq_acked;
-    uint8_t must_ack:1;
-    uint8_t state;
-    struct rudp_list sendq;
-    struct rudp_packet_chain *segments;
-    struct rudp_base *rudp;
-    struct event *ev;
-    rudp_error_t sendto_err;
+    /* Path MTU search, datagram sizes in [low, high] are untested */
+    struct {
+        /** Next search step, 0 if no search */
+        rudp_time_t deadline;
+        uint16_t low;
+        uint16_t high;
+        /** Size being probed, 0 if search is done */
+        uint16_t probe;
+        uint8_t probe_count;
+    } pmtu;
+    struct rudp_peer_handler handler;
 };
 
 /**
@@ -153,9 +311,12 @@ struct rudp_peer
    @param handler A peer handler descriptor
    @param endpoint Associated endpoint to send the outgoing packets
                    through
+   @returns 0, or ENOMEM if the channels set with @ref
+            rudp_set_channels could not be allocated, the peer then
+            needs no deinitialization
  */
 RUDP_EXPORT
-void rudp_peer_init(
+rudp_error_t rudp_peer_init(
     struct rudp_peer *peer,
     struct rudp_base *rudp,
     const struct rudp_peer_handler *handler,
@@ -177,15 +338,28 @@ struct rudp_peer *rudp_peer_new(struct rudp_base *rudp,
    @param handler A peer handler descriptor
    @param endpoint Associated endpoint to send the outgoing packets
                    through
+   @returns 0, or ENOMEM as @ref rudp_peer_init
  */
 RUDP_EXPORT
-void rudp_peer_from_sockaddr(
+rudp_error_t rudp_peer_from_sockaddr(
     struct rudp_peer *peer,
     struct rudp_base *rudp,
     const struct sockaddr_storage *addr,
     const struct rudp_peer_handler *handler,
     struct rudp_endpoint *endpoint);
 
+/**
+   @this retrieves the largest datagram size known to reach the peer.
+   Until path MTU discovery validates a larger size, this is a
+   conservative 1200 bytes.  Messages are split in segments fitting in
+   this size.
+
+   @param peer Peer context
+   @returns a size in bytes, UDP payload
+ */
+RUDP_EXPORT
+size_t rudp_peer_get_mtu(const struct rudp_peer *peer);
+
 /**
    @this frees all data associated to a peer structure
 
@@ -211,7 +385,7 @@ void rudp_peer_reset(struct rudp_peer *peer);
 
 /**
    @this compares the peer address against another address. @see
-   rudp_address_compare.
+   rudp_sockaddr_compare.
 
    @param peer Peer to compare
    @param addr Address to compare
@@ -240,6 +414,140 @@ rudp_error_t rudp_peer_send(
         int reliable, int command,
         const void *data, const size_t size);
 
+/**
+   @this sends a message on a given channel of a peer.  Messages of a
+   channel are delivered in order, independently of other channels.
+   @ref rudp_peer_send uses channel 0.
+
+   @param peer Destination peer
+   @param channel Channel number, lower than the count agreed on with
+          the peer (see @ref rudp_set_channels)
+   @param reliable Whether message must be retransmitted until
+          acknowledged
+   @param command Application command, added to @ref RUDP_CMD_APP
+   @param data Message
+   @param size Message size
+   @returns 0, EINVAL if channel does not exist, or a send error
+ */
+RUDP_EXPORT
+rudp_error_t rudp_peer_send_channel(
+        struct rudp_peer *peer,
+        unsigned int channel,
+        int reliable, int command,
+        const void *data, const size_t size);
+
+/**
+   @this pauses or resumes reading from a peer.  While paused, the
+   handler is not given any message.  Reliable ones are held, and
+   delivered in order on resume, unreliable ones are dropped.  The
+   window advertised to the peer shrinks as messages are held, until
+   it stops sending.  Then, it only probes the window about once per
+   retransmission timeout.  Once held messages fill the receive
+   window, new reliable packets are refused and left for the peer to
+   send again, whether it agrees on @ref #RUDP_FEATURE_WINDOW or not.
+
+   Handler may be called from here, on resume.  This must be called
+   on a connected peer, reset makes it read again.
+
+   @param peer Peer to pause or resume
+   @param paused Whether reading is paused
+ */
+RUDP_EXPORT
+void rudp_peer_pause_reading(struct rudp_peer *peer, int paused);
+
+/**
+   @this sends a partially reliable message on a given channel.  It
+   is retransmitted until acknowledged, as a reliable one, unless it
+   expires first: @tt ttl milliseconds after this call, or when it
+   would be retransmitted more than @tt max_retransmits times.  An
+   expired message is dropped from the send queue and the peer is
+   told to skip it, following messages of the channel are not held
+   back anymore.
+
+   Only peers that agreed on @ref #RUDP_FEATURE_SKIP can be told to
+   skip a message, others always get it.
+
+   @param peer Destination peer
+   @param channel Channel number
+   @param command Application command, added to @ref RUDP_CMD_APP
+   @param data Message
+   @param size Message size
+   @param ttl Time to live, 0 for none
+   @param max_retransmits Retransmission count limit, 0 for none
+   @returns 0, EINVAL if channel does not exist, or a send error
+ */
+RUDP_EXPORT
+rudp_error_t rudp_peer_send_partial(
+        struct rudp_peer *peer,
+        unsigned int channel,
+        int command,
+        const void *data, const size_t size,
+        rudp_time_t ttl, unsigned int max_retransmits);
+
+/**
+   @this sets the forward error correction ratio of a peer.  When the
+   peer agreed on @ref #RUDP_FEATURE_FEC, a parity packet is sent
+   after each @tt group segments of a message, reliable or not, and
+   after its last segment.  Receiver can rebuild a lost segment of
+   each group without waiting for a retransmit.
+
+   @param peer Peer to configure
+   @param group Segments per parity packet, 0 to disable
+ */
+RUDP_EXPORT
+void rudp_peer_set_fec(
+        struct rudp_peer *peer,
+        uint8_t group);
+
+/**
+   @this sets the send priority of a channel of a peer.  Whenever
+   packets are pending on several channels, all the packets of a
+   channel are sent before the ones of channels with a lower
+   priority, and a control channel can overtake bulk transfers on
+   other channels segment by segment.  Channels with the same
+   priority are served in channel number order.  All channels have
+   priority 0 initially.
+
+   Priorities are local to the sender, and are kept across
+   reconnections.  Packets of a given channel always stay in order.
+
+   @param peer Peer to configure
+   @param channel Channel number, lower than the channel count
+          set with @ref rudp_set_channels
+   @param priority Channel priority, higher is sent first
+   @returns 0, or EINVAL if channel does not exist
+ */
+RUDP_EXPORT
+rudp_error_t rudp_peer_set_channel_priority(
+        struct rudp_peer *peer,
+        unsigned int channel,
+        uint8_t priority);
+
+/**
+   @this sets how unreliable messages of a channel of a peer are
+   delivered.  @ref RUDP_DELIVERY_ORDERED is the default: the peer
+   drops an unreliable message when it has not received all the
+   reliable ones sent before it, or a newer unreliable one.  @ref
+   RUDP_DELIVERY_SEQUENCED only drops the older ones, and @ref
+   RUDP_DELIVERY_UNORDERED only the duplicates.
+
+   Other modes than the default one take effect with peers agreeing
+   on @ref #RUDP_FEATURE_DELIVERY.  With @ref
+   #RUDP_FEATURE_FAST_LANE, ordered messages only wait for the
+   reliable ones acknowledged when they were sent.
+
+   @param peer Peer to configure
+   @param channel Channel number, lower than the channel count
+          set with @ref rudp_set_channels
+   @param delivery Delivery mode
+   @returns 0, or EINVAL if channel or mode does not exist
+ */
+RUDP_EXPORT
+rudp_error_t rudp_peer_set_channel_delivery(
+        struct rudp_peer *peer,
+        unsigned int channel,
+        enum rudp_delivery delivery);
+
 /**
    @this sends unreliable data to a peer.
 
@@ -326,18 +634,97 @@ rudp_error_t rudp_peer_send_connect(struct rudp_peer *peer);
 RUDP_EXPORT
 rudp_error_t rudp_peer_send_close_noqueue(struct rudp_peer *peer);
 
+/**
+   @this sets the lower bound of the retransmission timeout of a peer.
+   The timeout is derived from the measured round-trip time, and is
+   @tt min_rto until a first measurement is done.
+
+   @param peer Peer to configure
+   @param min_rto Minimum retransmission timeout, in milliseconds
+ */
 RUDP_EXPORT
 void rudp_peer_set_timeout_min_rto(struct rudp_peer *peer, rudp_time_t min_rto);
 
+/**
+   @this sets the upper bound of the retransmission timeout of a peer.
+   The timeout doubles each time it expires without any acknowledge,
+   up to @tt max_rto.  It is computed again from the round-trip time
+   on the next measurement.
+
+   @param peer Peer to configure
+   @param max_rto Maximum retransmission timeout, in milliseconds
+ */
 RUDP_EXPORT
 void rudp_peer_set_timeout_max_rto(struct rudp_peer *peer, rudp_time_t max_rto);
 
 RUDP_EXPORT
 void rudp_peer_set_timeout_drop(struct rudp_peer *peer, rudp_time_t drop);
 
+/**
+   @this sets how long a peer may stay silent, at least, before it
+   is pinged.  Any new packet from the peer counts, keepalives
+   included, so there is no ping while data or keepalives flow.  A
+   silent peer is pinged once within a quarter of the drop timeout,
+   or after @tt action if that is later.  The ping is reliable, its
+   acknowledge and answer tell the peer is alive, and measure the
+   round-trip time.
+
+   @param peer Peer to configure
+   @param action Least silence before a ping, in milliseconds
+ */
 RUDP_EXPORT
 void rudp_peer_set_timeout_action(struct rudp_peer *peer, rudp_time_t action);
 
+/**
+   @this sets the longest time a peer may go without us sending it
+   anything.  It should be under the lifetime of UDP bindings of the
+   NATs on the way.  The keepalive going out then is an unreliable
+   @ref RUDP_CMD_NOOP, or a ping if there is no fresh round-trip time
+   estimate.  When it is under three quarters of the drop timeout of
+   both peers, an idle link carries keepalives only, pings are only
+   for lost ones.  Idle intervals of each peer are shortened by up to
+   a quarter at random, so that peers connected together do not wake
+   up together.  Default is 25 seconds.
+
+   @param peer Peer to configure
+   @param keepalive Longest idle time, in milliseconds, 0 for no limit
+ */
+RUDP_EXPORT
+void rudp_peer_set_timeout_keepalive(struct rudp_peer *peer,
+                                     rudp_time_t keepalive);
+
+/**
+   @this sets the jitter of backed off retransmission timeouts of a
+   peer.  Each time the timeout doubles, it is shortened by a random
+   amount, up to @tt percent of its value, but not under the minimum
+   timeout.  Peers losing the same path then do not retransmit in
+   lockstep.  Default is 0, no jitter.
+
+   @param peer Peer to configure
+   @param percent Reduction range, 100 at most
+ */
+RUDP_EXPORT
+void rudp_peer_set_timeout_jitter(struct rudp_peer *peer, unsigned int percent);
+
+/**
+   @this sets how many times the retransmission timer may expire for
+   a reliable packet before its message fails.  As the timeout
+   doubles each time, this bounds the time spent on an unreachable
+   peer.  Retransmissions of packets found lost from acknowledges do
+   not count.
+
+   A failed message is skipped, as an expired one, see @ref
+   rudp_peer_send_partial.  When the peer did not agree on @ref
+   #RUDP_FEATURE_SKIP, or for connection management packets, the
+   peer is dropped instead.  Default is 0, no limit.
+
+   @param peer Peer to configure
+   @param retries Retransmission timeout count limit, 0 for none
+ */
+RUDP_EXPORT
+void rudp_peer_set_timeout_retries(struct rudp_peer *peer,
+                                   unsigned int retries);
+
 #ifdef __cplusplus
 }
 #endif
@@ -141,6 +141,62 @@ extern RUDP_EXPORT const struct rudp_handler rudp_handler_default;
  */
 #define RUDP_HANDLER_DEFAULT &rudp_handler_default
 
+/**
+   Count of packet buffer size classes.  Classes are, in order:
+   header-sized buffers, receive-sized buffers, and buffers too large
+   to be pooled.
+ */
+#define RUDP_PACKET_CLASS_COUNT 3
+
+/**
+   @this holds the packet allocator statistics of one size class.
+ */
+struct rudp_packet_class_stats
+{
+    /** Buffer size of the class, 0 for the unpooled class */
+    size_t size;
+    /** Buffers currently handed out */
+    uint32_t in_use;
+    /** Highest value @tt in_use reached */
+    uint32_t peak_in_use;
+    /** Buffers currently kept in the free pool */
+    uint32_t free;
+    /** Maximum count of buffers kept in the free pool */
+    uint32_t max_free;
+    /** Allocations served from the free pool */
+    uint64_t hits;
+    /** Allocations that fell back to @tt mem_alloc */
+    uint64_t misses;
+    /** Bytes currently obtained from @tt mem_alloc, free pool included */
+    uint64_t bytes;
+};
+
+/**
+   @this holds the packet allocator statistics.  @see
+   rudp_packet_stats_get.
+ */
+struct rudp_packet_stats
+{
+    /** Buffers currently handed out, all classes */
+    uint32_t in_use;
+    /** Highest value @tt in_use reached */
+    uint32_t peak_in_use;
+    /** Bytes currently obtained from @tt mem_alloc, all classes */
+    uint64_t bytes;
+    /** Highest value @tt bytes reached */
+    uint64_t peak_bytes;
+    /** Per size class details */
+    struct rudp_packet_class_stats classes[RUDP_PACKET_CLASS_COUNT];
+    /** Size of the packet memory region, 0 if none */
+    uint64_t region_bytes;
+    /** Count of buffers carved in the packet memory region */
+    uint32_t region_slots;
+    /** Count of region buffers not handed out */
+    uint32_t region_free;
+    /** Whether the region is backed by huge pages */
+    uint8_t region_hugepages;
+};
+
 /**
    @this is a rudp context
 
@@ -155,17 +211,40 @@ struct rudp_base
 {
     struct rudp_handler handler;
     struct event_base *eb;
-    struct rudp_list free_packet_list;
-    uint16_t allocated_packets;
-    uint16_t free_packets;
+    struct rudp_list free_packet_list[RUDP_PACKET_CLASS_COUNT];
+    struct rudp_packet_stats packet_stats;
+    void *packet_region;
+    struct rudp_list free_region_list;
     struct {
         /** Minimum retransmission timeout. */
         rudp_time_t min_rto;
         /** Maximum retransmission timeout. */
         rudp_time_t max_rto;
+        /** Least silence of a peer before it is pinged. */
         rudp_time_t action;
         rudp_time_t drop;
+        /** Longest time without sending to a peer, 0 for no limit. */
+        rudp_time_t keepalive;
+        /** Backed off rto reduction range, in percent. */
+        uint8_t jitter;
+        /** Retransmission timeouts of a packet before it fails, 0
+            for none. */
+        uint16_t retries;
     } default_timeout;
+    /** Protocol features offered and accepted at connection. */
+    uint32_t features;
+    /** Channels of new peers. */
+    uint16_t channels;
+    /** Longest time a small message waits for others to share its
+        packet, 0 if bundling is disabled. */
+    rudp_time_t bundle_delay;
+    /** Smallest message size compression is tried on, 0 if
+        compression is disabled. */
+    size_t compress_min;
+    /** Segments per parity packet of new peers, 0 for none. */
+    uint8_t fec_group;
+    /** Receive window of new peers, in bytes. */
+    uint32_t receive_window;
 };
 
 /**
@@ -198,6 +277,152 @@ struct rudp_base *rudp_new(
 RUDP_EXPORT
 void rudp_free(struct rudp_base *rudp);
 
+/**
+   @this retrieves a snapshot of the packet allocator statistics.
+
+   @param rudp Rudp context
+   @param stats (out) Statistics
+ */
+RUDP_EXPORT
+void rudp_packet_stats_get(
+    struct rudp_base *rudp,
+    struct rudp_packet_stats *stats);
+
+/**
+   @this sets how many released buffers of a size class are kept for
+   reuse instead of being given back to @tt mem_free.  Exceeding
+   buffers are released immediately.
+
+   @param rudp Rudp context
+   @param size Buffer size of the class, as reported in @ref
+   rudp_packet_class_stats
+   @param max_free Maximum count of buffers in the free pool
+   @returns 0, or EINVAL if no pooled class has this size
+ */
+RUDP_EXPORT
+rudp_error_t rudp_packet_pool_set_max_free(
+    struct rudp_base *rudp,
+    size_t size,
+    uint32_t max_free);
+
+/**
+   @this backs receive-sized packet buffers with a single memory
+   region of @tt size bytes, mapped and pre-faulted at once.  Huge
+   pages are used when the system provides them, normal pages
+   otherwise.
+
+   Buffers are taken from the region first.  When it is exhausted,
+   allocation falls back to the usual pool and @tt mem_alloc path.
+   Region memory is released on @ref rudp_deinit, or when calling this
+   function again, with a zero size to only drop it.
+
+   @param rudp Rudp context
+   @param size Region size in bytes, 0 to remove the region
+   @returns 0 on success, EBUSY if buffers of the current region are
+   still in use, ENOMEM if mapping failed
+ */
+RUDP_EXPORT
+rudp_error_t rudp_packet_pool_set_region(
+    struct rudp_base *rudp,
+    size_t size);
+
+/**
+   @this sets the protocol features offered to peers when connecting,
+   and accepted from peers connecting.  Features of a connection are
+   the ones both sides agree on.  All known features are enabled by
+   default.
+
+   Change only applies to connections established afterwards.
+
+   @param rudp Rudp context
+   @param features A mask of @tt RUDP_FEATURE_* values
+ */
+RUDP_EXPORT
+void rudp_set_features(
+    struct rudp_base *rudp,
+    uint32_t features);
+
+/**
+   @this sets the count of independent channels of new peers.  A
+   connection uses the lowest count of both sides, older
+   implementations only have one channel.  Default is 1.  Servers
+   take the count at @ref rudp_server_init time.
+
+   @param rudp Rudp context
+   @param channels Count of channels, from 1 to 256
+   @returns 0, or EINVAL if count is out of range
+ */
+RUDP_EXPORT
+rudp_error_t rudp_set_channels(
+    struct rudp_base *rudp,
+    unsigned int channels);
+
+/**
+   @this enables bundling of small messages.  Messages fitting in a
+   single packet are then held for at most @tt delay milliseconds,
+   and sent together with the following ones of the same channel and
+   reliability in a single packet, up to the path MTU.  Receiving
+   side splits them again before calling the usual packet handlers.
+
+   Bundling is only used with peers agreeing on @ref
+   #RUDP_FEATURE_BUNDLE.  It is disabled by default.
+
+   @param rudp Rudp context
+   @param delay Maximum added latency in milliseconds, 0 to disable
+ */
+RUDP_EXPORT
+void rudp_set_bundle_delay(
+    struct rudp_base *rudp,
+    rudp_time_t delay);
+
+/**
+   @this enables compression of sent messages.  Messages of at least
+   @tt min_size bytes are compressed before segmentation, and sent
+   compressed if this saves at least an eighth of their size.  When
+   compression does not pay off, following messages to the same peer
+   are sent as is for a while before trying again.
+
+   Compression is only used with peers agreeing on @ref
+   #RUDP_FEATURE_COMPRESS.  It is disabled by default.
+
+   @param rudp Rudp context
+   @param min_size Smallest message size to compress, 0 to disable
+ */
+RUDP_EXPORT
+void rudp_set_compression(
+    struct rudp_base *rudp,
+    size_t min_size);
+
+/**
+   @this sets the default forward error correction ratio of new
+   peers, see @ref rudp_peer_set_fec.  Default is 0, no parity.
+
+   @param rudp Rudp context
+   @param group Segments per parity packet, 0 to disable
+ */
+RUDP_EXPORT
+void rudp_set_fec(
+    struct rudp_base *rudp,
+    uint8_t group);
+
+/**
+   @this sets the receive window of new peers: how many bytes of
+   reliable packets they may have sent and not acknowledged yet, or
+   held while reading is paused, see @ref rudp_peer_pause_reading.
+   It should fit in the socket receive buffer, for a slow reader not
+   to lose packets there.  Default is 64 KiB.
+
+   Window is only advertised to peers agreeing on @ref
+   #RUDP_FEATURE_WINDOW.
+
+   @param rudp Rudp context
+   @param size Window size in bytes
+ */
+RUDP_EXPORT
+void rudp_set_receive_window(
+    struct rudp_base *rudp,
+    uint32_t size);
+
 /**
    @this generates a 16 bit random value
 
@@ -79,6 +79,7 @@ extern "C" {
 struct rudp_server;
 struct rudp_link_info;
 struct rudp_peer;
+struct rudp_arena;
 
 /**
    Server handler code callbacks
@@ -166,8 +167,26 @@ struct rudp_server
     struct rudp_server_handler handler;
     void *arg;
     struct rudp_list peer_list;
+    /** Slab storage for the peers in @tt peer_list, allocated along
+        the first peer */
+    struct rudp_arena *peer_arena;
+    /** Channel count of the peers, taken from the rudp context at
+        init, their channel arrays live in @tt peer_arena slots */
+    uint16_t peer_channels;
     struct rudp_endpoint endpoint;
     struct rudp_base *rudp;
+    /** Key of the connection cookies MAC, random */
+    uint8_t cookie_key[16];
+    /** Whether clients not offering cookies are refused */
+    uint8_t cookie_required;
+    /** Peers by connection id index, see @ref #RUDP_FEATURE_CONN_ID */
+    struct rudp_peer **conn_ids;
+    /** Size of @tt conn_ids */
+    size_t conn_id_max;
+    /** Count of used entries of @tt conn_ids */
+    size_t conn_id_used;
+    /** Next entry to try when giving a connection id */
+    size_t conn_id_next;
 };
 
 struct rudp_peer;
@@ -297,6 +316,25 @@ void rudp_server_set_ipv6(
     const struct in6_addr *address,
     const uint16_t port) RUDP_DEPRECATED;
 
+/**
+   @this sets whether clients not offering @ref #RUDP_FEATURE_COOKIE
+   are refused.  Clients offering it never get a peer allocated
+   before they proved they receive packets at their source address,
+   so a spoofed flood of connection requests does not consume server
+   memory.  Older clients can only connect if this is not set, which
+   is the default.
+
+   Has no effect if @ref #RUDP_FEATURE_COOKIE is not in the features
+   of the rudp context.
+
+   @param server An initialized server context structure
+   @param required Whether cookies are required
+ */
+RUDP_EXPORT
+void rudp_server_set_cookie_required(
+    struct rudp_server *server,
+    int required);
+
 /**
    @this sends data from this server to a peer.
 
@@ -317,9 +355,14 @@ rudp_error_t rudp_server_send(
     const void *data, const size_t size);
 
 /**
-   @this sends data from this server to all peers.
+   @this sends data from this server to a peer, on a given channel.
+   Messages of a channel are delivered in order, independently of
+   other channels.  @ref rudp_server_send uses channel 0.
 
    @param server Source server
+   @param peer Destination peer
+   @param channel Channel number, lower than the count agreed on
+          with the peer
    @param reliable Whether to send the payload reliably
    @param command User command code. It may be between 0 and RUDP_CMD_APP_MAX.
    @param data Payload
@@ -328,6 +371,54 @@ rudp_error_t rudp_server_send(
    @returns An error level
  */
 RUDP_EXPORT
+rudp_error_t rudp_server_send_channel(
+    struct rudp_server *server,
+    struct rudp_peer *peer,
+    unsigned int channel,
+    int reliable, int command,
+    const void *data, const size_t size);
+
+/**
+   @this sends a partially reliable message from this server to a
+   peer.  See @ref rudp_peer_send_partial.
+
+   @param server Source server
+   @param peer Destination peer
+   @param channel Channel number
+   @param command User command code. It may be between 0 and RUDP_CMD_APP_MAX.
+   @param data Payload
+   @param size Total packet size
+   @param ttl Time to live, 0 for none
+   @param max_retransmits Retransmission count limit, 0 for none
+
+   @returns An error level
+ */
+RUDP_EXPORT
+rudp_error_t rudp_server_send_partial(
+    struct rudp_server *server,
+    struct rudp_peer *peer,
+    unsigned int channel, int command,
+    const void *data, const size_t size,
+    rudp_time_t ttl, unsigned int max_retransmits);
+
+/**
+   @this sends data from this server to all peers.
+
+   The payload is copied once and shared by the send queues of all
+   the peers, it is released when the last peer acknowledges or drops
+   it.  When it can not be sent to a peer, it is still sent to the
+   other ones.
+
+   @param server Source server
+   @param reliable Whether to send the payload reliably
+   @param command User command code. It may be between 0 and RUDP_CMD_APP_MAX.
+   @param data Payload
+   @param size Total packet size
+
+   @returns 0, or the error of the first peer the payload could not
+   be sent to
+ */
+RUDP_EXPORT
 rudp_error_t rudp_server_send_all(
     struct rudp_server *server,
     int reliable, int command,
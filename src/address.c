@@ -197,6 +197,10 @@ rudp_error_t rudp_address_set(
     if (size < sizeof (*sockaddr) || size > sizeof (*rua->addr))
         return EINVAL;
 
+    if (rua->hostname)
+        free(rua->hostname);
+    rua->hostname = NULL;
+
     switch (sockaddr->sa_family)
     {
     case AF_INET:
@@ -311,11 +315,17 @@ rudp_address_get(
 int rudp_address_compare(const struct rudp_address *rua,
                          const struct sockaddr_storage *addr)
 {
-    struct sockaddr_in6 *left6 = (struct sockaddr_in6 *)rua->addr;
-    struct sockaddr_in *left = (struct sockaddr_in *)rua->addr;
+    return rudp_sockaddr_compare((const struct sockaddr *)rua->addr, addr);
+}
+
+int rudp_sockaddr_compare(const struct sockaddr *addr,
+                          const struct sockaddr_storage *other)
+{
+    const struct sockaddr_in6 *left6 = (const struct sockaddr_in6 *)addr;
+    const struct sockaddr_in *left = (const struct sockaddr_in *)addr;
 
-    struct sockaddr_in6 *right6 = (struct sockaddr_in6 *)addr;
-    struct sockaddr_in *right = (struct sockaddr_in *)addr;
+    const struct sockaddr_in6 *right6 = (const struct sockaddr_in6 *)other;
+    const struct sockaddr_in *right = (const struct sockaddr_in *)other;
 
     if ( left->sin_family != right->sin_family )
         return 1;
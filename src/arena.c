@@ -0,0 +1,104 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <rudp/rudp.h>
+
+#include "rudp_arena.h"
+#include "rudp_list.h"
+#include "rudp_rudp.h"
+
+void rudp_arena_init(struct rudp_arena *arena, struct rudp_base *rudp,
+                     size_t object_size, size_t slab_objects)
+{
+    if (object_size < sizeof(struct rudp_list))
+        object_size = sizeof(struct rudp_list);
+
+    arena->rudp = rudp;
+    arena->object_size = RUDP_ARENA_ALIGN(object_size);
+    arena->slab_objects = slab_objects;
+    arena->slabs = NULL;
+    arena->slab_count = 0;
+    arena->slab_max = 0;
+    rudp_list_init(&arena->free_list);
+}
+
+void rudp_arena_deinit(struct rudp_arena *arena)
+{
+    size_t i;
+
+    for (i = 0; i < arena->slab_count; i++)
+        rudp_mem_free(arena->rudp, arena->slabs[i]);
+
+    if (arena->slabs != NULL)
+        rudp_mem_free(arena->rudp, arena->slabs);
+
+    arena->slabs = NULL;
+    arena->slab_count = 0;
+    arena->slab_max = 0;
+    rudp_list_init(&arena->free_list);
+}
+
+static int arena_grow(struct rudp_arena *arena)
+{
+    uint8_t *slab;
+    size_t i;
+
+    if (arena->slab_count == arena->slab_max) {
+        size_t max = arena->slab_max ? arena->slab_max * 2 : 8;
+        void **slabs = rudp_mem_alloc(arena->rudp, max * sizeof(void *));
+
+        if (slabs == NULL)
+            return -1;
+
+        if (arena->slabs != NULL) {
+            memcpy(slabs, arena->slabs, arena->slab_count * sizeof(void *));
+            rudp_mem_free(arena->rudp, arena->slabs);
+        }
+
+        arena->slabs = slabs;
+        arena->slab_max = max;
+    }
+
+    slab = rudp_mem_alloc(arena->rudp, arena->object_size * arena->slab_objects);
+    if (slab == NULL)
+        return -1;
+
+    arena->slabs[arena->slab_count++] = slab;
+
+    /* Append in address order so that fresh objects are handed out
+       sequentially. */
+    for (i = 0; i < arena->slab_objects; i++)
+        rudp_list_append(&arena->free_list,
+                         (struct rudp_list *)(slab + i * arena->object_size));
+
+    return 0;
+}
+
+void *rudp_arena_alloc(struct rudp_arena *arena)
+{
+    struct rudp_list *item;
+
+    if (rudp_list_empty(&arena->free_list) && arena_grow(arena) != 0)
+        return NULL;
+
+    item = arena->free_list.next;
+    rudp_list_remove(item);
+
+    return item;
+}
+
+void rudp_arena_free(struct rudp_arena *arena, void *object)
+{
+    rudp_list_insert(&arena->free_list, object);
+}
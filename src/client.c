@@ -21,6 +21,7 @@
 
 #include "rudp_list.h"
 #include "rudp_packet.h"
+#include "rudp_peer.h"
 
 static const struct rudp_endpoint_handler client_endpoint_handler;
 static const struct rudp_peer_handler client_peer_handler;
@@ -36,6 +37,7 @@ rudp_client_init(struct rudp_client *client, struct rudp_base *rudp,
     client->rudp = rudp;
     client->connected = 0;
     client->peer.rudp = NULL;
+    memset(&client->session, 0, sizeof(client->session));
 }
 
 struct rudp_client *
@@ -50,6 +52,33 @@ rudp_client_new(struct rudp_base *rudp, const struct rudp_client_handler *handle
     return client;
 }
 
+static void client_session_save(struct rudp_client *client)
+{
+    struct rudp_peer *peer = &client->peer;
+
+    if ( peer->token_valid ) {
+        memcpy(client->session.token, peer->token, RUDP_TOKEN_SIZE);
+        client->session.token_valid = 1;
+    }
+
+    if ( peer->srtt > 0 ) {
+        client->session.srtt = peer->srtt;
+        client->session.rttvar = peer->rttvar;
+    }
+}
+
+static void client_session_restore(struct rudp_client *client)
+{
+    struct rudp_peer *peer = &client->peer;
+
+    if ( client->session.token_valid ) {
+        memcpy(peer->token, client->session.token, RUDP_TOKEN_SIZE);
+        peer->token_valid = 1;
+    }
+
+    rudp_peer_resume(peer, client->session.srtt, client->session.rttvar);
+}
+
 rudp_error_t rudp_client_connect(struct rudp_client *client)
 {
     const struct sockaddr_storage *addr;
@@ -60,9 +89,12 @@ rudp_error_t rudp_client_connect(struct rudp_client *client)
     if ( err )
         return err;
 
-    rudp_peer_from_sockaddr(&client->peer, client->rudp,
-                            addr,
-                            &client_peer_handler, &client->endpoint);
+    err = rudp_peer_from_sockaddr(&client->peer, client->rudp,
+                                  addr,
+                                  &client_peer_handler, &client->endpoint);
+    if ( err )
+        return err;
+    client_session_restore(client);
     rudp_peer_send_connect(&client->peer);
 
     memset(&bind_addr, 0, sizeof (bind_addr));
@@ -78,6 +110,8 @@ rudp_client_close(struct rudp_client *client)
     if (client == NULL || client->peer.rudp == NULL)
         return;
     rudp_peer_send_close_noqueue(&client->peer);
+    client->connected = 0;
+    client_session_save(client);
     rudp_peer_deinit(&client->peer);
     rudp_endpoint_close(&client->endpoint);
 }
@@ -127,6 +161,7 @@ void client_peer_dropped(struct rudp_peer *peer)
 
     client->connected = 0;
 
+    client_session_save(client);
     rudp_peer_deinit(&client->peer);
     rudp_endpoint_close(&client->endpoint);
 
@@ -159,7 +194,9 @@ void client_handle_endpoint_packet(struct rudp_endpoint *endpoint,
 
     int was_connected = client->connected;
     rudp_error_t err = rudp_peer_incoming_packet(&client->peer, pc);
-    if (err == 0 && was_connected == 0) {
+    /* Cookies come before the connection response */
+    if (err == 0 && was_connected == 0
+        && rudp_peer_connected(&client->peer)) {
         client->connected = 1;
         client->handler.connected(client, client->arg);
     }
@@ -175,12 +212,75 @@ rudp_error_t rudp_client_send(
     const void *data,
     const size_t size)
 {
-    if (client == NULL || !client->connected)
+    if (client == NULL || client->peer.rudp == NULL)
         return EINVAL;
 
     return rudp_peer_send(client->rudp, &client->peer, reliable, command, data, size);
 }
 
+rudp_error_t rudp_client_send_channel(
+    struct rudp_client *client,
+    unsigned int channel,
+    int reliable, int command,
+    const void *data,
+    const size_t size)
+{
+    if (client == NULL || client->peer.rudp == NULL)
+        return EINVAL;
+
+    return rudp_peer_send_channel(&client->peer, channel,
+                                  reliable, command, data, size);
+}
+
+rudp_error_t rudp_client_send_partial(
+    struct rudp_client *client,
+    unsigned int channel, int command,
+    const void *data,
+    const size_t size,
+    rudp_time_t ttl,
+    unsigned int max_retransmits)
+{
+    if (client == NULL || client->peer.rudp == NULL)
+        return EINVAL;
+
+    return rudp_peer_send_partial(&client->peer, channel, command,
+                                  data, size, ttl, max_retransmits);
+}
+
+rudp_error_t rudp_client_set_channel_priority(
+    struct rudp_client *client,
+    unsigned int channel,
+    uint8_t priority)
+{
+    if (client == NULL || client->peer.rudp == NULL)
+        return EINVAL;
+
+    return rudp_peer_set_channel_priority(&client->peer, channel, priority);
+}
+
+rudp_error_t rudp_client_set_channel_delivery(
+    struct rudp_client *client,
+    unsigned int channel,
+    enum rudp_delivery delivery)
+{
+    if (client == NULL || client->peer.rudp == NULL)
+        return EINVAL;
+
+    return rudp_peer_set_channel_delivery(&client->peer, channel, delivery);
+}
+
+rudp_error_t rudp_client_pause_reading(
+    struct rudp_client *client,
+    int paused)
+{
+    if (client == NULL || client->peer.rudp == NULL)
+        return EINVAL;
+
+    rudp_peer_pause_reading(&client->peer, paused);
+
+    return 0;
+}
+
 rudp_error_t rudp_client_set_hostname(
     struct rudp_client *client,
     const char *hostname,
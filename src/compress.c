@@ -0,0 +1,179 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "rudp_compress.h"
+
+#define HASH_BITS 12
+#define MAX_OFFSET 0xffff
+#define NIBBLE(x) ((x) < 15 ? (x) : 15)
+
+static uint32_t hash4(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static int put_length(uint8_t **op, uint8_t *oend, size_t len)
+{
+    for (; len >= 255; len -= 255) {
+        if (*op >= oend)
+            return -1;
+        *(*op)++ = 255;
+    }
+
+    if (*op >= oend)
+        return -1;
+    *(*op)++ = (uint8_t)len;
+
+    return 0;
+}
+
+/* Match length 0 means a final, literal only, sequence */
+static int put_sequence(uint8_t **op, uint8_t *oend,
+                        const uint8_t *literals, size_t literal_len,
+                        size_t offset, size_t match_len)
+{
+    size_t match_code = match_len ? match_len - RUDP_COMPRESS_MIN_MATCH : 0;
+    uint8_t *token = *op;
+
+    if (*op >= oend)
+        return -1;
+    (*op)++;
+
+    *token = (uint8_t)((NIBBLE(literal_len) << 4)
+                       | NIBBLE(match_code));
+
+    if (literal_len >= 15 && put_length(op, oend, literal_len - 15))
+        return -1;
+
+    if ((size_t)(oend - *op) < literal_len)
+        return -1;
+    memcpy(*op, literals, literal_len);
+    *op += literal_len;
+
+    if (match_len == 0)
+        return 0;
+
+    if (oend - *op < 2)
+        return -1;
+    *(*op)++ = offset & 0xff;
+    *(*op)++ = offset >> 8;
+
+    if (match_code >= 15 && put_length(op, oend, match_code - 15))
+        return -1;
+
+    return 0;
+}
+
+size_t rudp_compress(const uint8_t *in, size_t size,
+                     uint8_t *out, size_t max)
+{
+    uint32_t table[1 << HASH_BITS];
+    const uint8_t *ip = in, *anchor = in, *end = in + size;
+    uint8_t *op = out, *oend = out + max;
+
+    memset(table, 0, sizeof(table));
+
+    while (size >= RUDP_COMPRESS_MIN_MATCH
+           && ip <= end - RUDP_COMPRESS_MIN_MATCH) {
+        uint32_t h = hash4(ip);
+        const uint8_t *ref = in + table[h];
+        size_t len;
+
+        table[h] = (uint32_t)(ip - in);
+
+        if (ref >= ip || ip - ref > MAX_OFFSET
+            || memcmp(ref, ip, RUDP_COMPRESS_MIN_MATCH)) {
+            ip++;
+            continue;
+        }
+
+        len = RUDP_COMPRESS_MIN_MATCH;
+        while (ip + len < end && ref[len] == ip[len])
+            len++;
+
+        if (put_sequence(&op, oend, anchor, ip - anchor, ip - ref, len))
+            return 0;
+
+        ip += len;
+        anchor = ip;
+    }
+
+    if (put_sequence(&op, oend, anchor, end - anchor, 0, 0))
+        return 0;
+
+    return op - out;
+}
+
+static int get_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+    uint8_t b;
+
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+
+    return 0;
+}
+
+int rudp_decompress(const uint8_t *in, size_t size,
+                    uint8_t *out, size_t out_size)
+{
+    const uint8_t *ip = in, *iend = in + size;
+    uint8_t *op = out, *oend = out + out_size;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t literal_len = token >> 4;
+        size_t match_len = token & 0xf;
+        size_t offset;
+
+        if (literal_len == 15 && get_length(&ip, iend, &literal_len))
+            return -1;
+
+        if ((size_t)(iend - ip) < literal_len
+            || (size_t)(oend - op) < literal_len)
+            return -1;
+        memcpy(op, ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if (match_len == 15 && get_length(&ip, iend, &match_len))
+            return -1;
+        match_len += RUDP_COMPRESS_MIN_MATCH;
+
+        if (offset == 0 || offset > (size_t)(op - out)
+            || (size_t)(oend - op) < match_len)
+            return -1;
+
+        /* Byte by byte, source and destination may overlap */
+        for (; match_len; match_len--, op++)
+            *op = *(op - offset);
+    }
+
+    return op == oend ? 0 : -1;
+}
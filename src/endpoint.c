@@ -14,6 +14,11 @@
 #ifndef _MSC_VER
 # include <unistd.h>
 #endif
+#ifndef _WIN32
+# include <sys/socket.h>
+# include <sys/uio.h>
+# include <netinet/in.h>
+#endif
 
 #include <event2/event.h>
 
@@ -67,11 +72,15 @@ _endpoint_handle_incoming(evutil_socket_t fd, short flags, void *data)
 {
     struct rudp_endpoint *endpoint = data;
     struct rudp_packet_chain *pc = rudp_packet_chain_alloc(
-        endpoint->rudp, RUDP_RECV_BUFFER_SIZE);
+        endpoint->rudp, RUDP_RECV_HEADROOM + RUDP_RECV_BUFFER_SIZE);
     struct sockaddr_storage addr;
+    rudp_error_t ret;
+
+    pc->packet = (struct rudp_packet *)
+        ((uint8_t *)pc->packet + RUDP_RECV_HEADROOM);
+    pc->len = RUDP_RECV_BUFFER_SIZE;
 
-    rudp_error_t ret = rudp_endpoint_recv(
-        endpoint, pc->packet, &pc->len, &addr);
+    ret = rudp_endpoint_recv(endpoint, pc->packet, &pc->len, &addr);
 
     if (ret == 0)
         endpoint->handler.handle_packet(endpoint, &addr, pc);
@@ -79,6 +88,49 @@ _endpoint_handle_incoming(evutil_socket_t fd, short flags, void *data)
     rudp_packet_chain_free(endpoint->rudp, pc);
 }
 
+/*
+  Path MTU is discovered by peers with probe packets, datagrams must
+  not be fragmented on the way.  Kernel path MTU state is ignored
+  where possible, so that probes larger than its guess can be sent.
+ */
+static void endpoint_set_dontfrag(evutil_socket_t skt, int family)
+{
+    int on = 1;
+
+    (void)on;
+
+    switch (family) {
+    case AF_INET6:
+#if defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_PROBE)
+        {
+            int val = IPV6_PMTUDISC_PROBE;
+            setsockopt(skt, IPPROTO_IPV6, IPV6_MTU_DISCOVER,
+                       (const void *)&val, sizeof(val));
+        }
+#elif defined(IPV6_DONTFRAG)
+        setsockopt(skt, IPPROTO_IPV6, IPV6_DONTFRAG,
+                   (const void *)&on, sizeof(on));
+#endif
+        /* v4-mapped destinations need the IPv4 option too */
+        /* fall through */
+    case AF_INET:
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+        {
+            int val = IP_PMTUDISC_PROBE;
+            setsockopt(skt, IPPROTO_IP, IP_MTU_DISCOVER,
+                       (const void *)&val, sizeof(val));
+        }
+#elif defined(IP_DONTFRAGMENT)
+        setsockopt(skt, IPPROTO_IP, IP_DONTFRAGMENT,
+                   (const void *)&on, sizeof(on));
+#elif defined(IP_DONTFRAG)
+        setsockopt(skt, IPPROTO_IP, IP_DONTFRAG,
+                   (const void *)&on, sizeof(on));
+#endif
+        break;
+    }
+}
+
 rudp_error_t rudp_endpoint_bind(struct rudp_endpoint *endpoint)
 {
     const struct sockaddr_storage *addr;
@@ -106,6 +158,8 @@ rudp_error_t rudp_endpoint_bind(struct rudp_endpoint *endpoint)
 
     endpoint->socket_fd = skt;
 
+    endpoint_set_dontfrag(skt, addr ? addr->ss_family : AF_INET6);
+
     int ret = 0;
 
     if ( addr )
@@ -197,9 +251,20 @@ rudp_endpoint_send(struct rudp_endpoint *endpoint,
     if (err)
         return err;
 
+    return rudp_endpoint_sendto(endpoint, (const struct sockaddr *)address,
+                                size, data, len);
+}
+
+rudp_error_t
+rudp_endpoint_sendto(struct rudp_endpoint *endpoint,
+        const struct sockaddr *addr, socklen_t addrlen,
+        const void *data, size_t len)
+{
+    if (endpoint == NULL || addr == NULL)
+        return EINVAL;
+
     int ret = sendto(endpoint->socket_fd, data, (int)len, 0,
-                     (const struct sockaddr *)address,
-                     (int)size);
+                     addr, (int)addrlen);
 
     if ( ret == -1 )
         return errno;
@@ -207,6 +272,51 @@ rudp_endpoint_send(struct rudp_endpoint *endpoint,
     return 0;
 }
 
+rudp_error_t
+rudp_endpoint_sendtov(struct rudp_endpoint *endpoint,
+        const struct sockaddr *addr, socklen_t addrlen,
+        const struct rudp_endpoint_buffer *buffers, size_t count)
+{
+    size_t i;
+
+    if (endpoint == NULL || addr == NULL
+        || count == 0 || count > RUDP_ENDPOINT_MAX_BUFFERS)
+        return EINVAL;
+
+#ifdef _WIN32
+    WSABUF wsabuf[RUDP_ENDPOINT_MAX_BUFFERS];
+    DWORD sent;
+
+    for (i = 0; i < count; i++) {
+        wsabuf[i].buf = (char *)buffers[i].data;
+        wsabuf[i].len = (ULONG)buffers[i].len;
+    }
+
+    if (WSASendTo(endpoint->socket_fd, wsabuf, (DWORD)count, &sent, 0,
+                  addr, (int)addrlen, NULL, NULL) != 0)
+        return WSAGetLastError();
+#else
+    struct iovec iov[RUDP_ENDPOINT_MAX_BUFFERS];
+    struct msghdr msg;
+
+    for (i = 0; i < count; i++) {
+        iov[i].iov_base = (void *)buffers[i].data;
+        iov[i].iov_len = buffers[i].len;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void *)addr;
+    msg.msg_namelen = addrlen;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    if (sendmsg(endpoint->socket_fd, &msg, 0) == -1)
+        return errno;
+#endif
+
+    return 0;
+}
+
 void rudp_endpoint_set_ipv4(
     struct rudp_endpoint *endpoint,
     const struct in_addr *address,
@@ -9,6 +9,16 @@
   See AUTHORS for details
  */
 
+#include <errno.h>
+#include <string.h>
+#ifdef _WIN32
+# include <winsock2.h>
+# include <windows.h>
+#else
+# include <arpa/inet.h>
+# include <sys/mman.h>
+#endif
+
 #include <rudp/packet.h>
 #include "rudp_packet.h"
 #include "rudp_list.h"
@@ -22,6 +32,15 @@ const char *rudp_command_name(enum rudp_command cmd)
     case RUDP_CMD_CONN_RSP: return "RUDP_CMD_CONN_RSP";
     case RUDP_CMD_PING: return "RUDP_CMD_PING";
     case RUDP_CMD_PONG: return "RUDP_CMD_PONG";
+    case RUDP_CMD_PMTU_PROBE: return "RUDP_CMD_PMTU_PROBE";
+    case RUDP_CMD_PMTU_ACK: return "RUDP_CMD_PMTU_ACK";
+    case RUDP_CMD_BUNDLE: return "RUDP_CMD_BUNDLE";
+    case RUDP_CMD_FEC: return "RUDP_CMD_FEC";
+    case RUDP_CMD_SKIP: return "RUDP_CMD_SKIP";
+    case RUDP_CMD_COOKIE: return "RUDP_CMD_COOKIE";
+    case RUDP_CMD_TOKEN: return "RUDP_CMD_TOKEN";
+    case RUDP_CMD_PATH_CHALLENGE: return "RUDP_CMD_PATH_CHALLENGE";
+    case RUDP_CMD_PATH_RESPONSE: return "RUDP_CMD_PATH_RESPONSE";
     case RUDP_CMD_APP: return "RUDP_CMD_APP";
     default:
         if ( (int) cmd < RUDP_CMD_APP )
@@ -31,59 +50,729 @@ const char *rudp_command_name(enum rudp_command cmd)
     }
 }
 
-#define DEFAULT_ALLOC_SIZE (RUDP_RECV_BUFFER_SIZE)
+#define DEFAULT_ALLOC_SIZE (RUDP_RECV_BUFFER_SIZE + RUDP_RECV_HEADROOM)
 #define FREE_PACKET_POOL 10
 
+/* Header-only packets: ACKs, pings, shared payload headers */
+#define SMALL_ALLOC_SIZE 64
+#define FREE_SMALL_PACKET_POOL 256
+
+enum packet_class
+{
+    PACKET_CLASS_SMALL,
+    PACKET_CLASS_DEFAULT,
+    PACKET_CLASS_LARGE,
+};
+
+static
+enum packet_class packet_class_of(size_t alloc)
+{
+    if ( alloc <= SMALL_ALLOC_SIZE )
+        return PACKET_CLASS_SMALL;
+    if ( alloc <= DEFAULT_ALLOC_SIZE )
+        return PACKET_CLASS_DEFAULT;
+    return PACKET_CLASS_LARGE;
+}
+
+/*
+  Packet memory region: one mapping carved in receive-sized buffers.
+  Region buffers never go back to mem_free, they return to their own
+  free list.
+ */
+#define REGION_ALIGN (2 * 1024 * 1024)
+#define REGION_SLOT_SIZE \
+    ((sizeof(struct rudp_packet_chain) + DEFAULT_ALLOC_SIZE + 63) & ~(size_t)63)
+#define REGION_PAGE_SIZE 4096
+
+static
+void region_prefault(uint8_t *region, size_t size)
+{
+    size_t offset;
+
+    for ( offset = 0; offset < size; offset += REGION_PAGE_SIZE )
+        region[offset] = 0;
+}
+
+static
+void *region_map(size_t size, uint8_t *hugepages)
+{
+    void *region = NULL;
+
+    *hugepages = 0;
+
+#ifdef _WIN32
+    SIZE_T large = GetLargePageMinimum();
+
+    /* Needs SeLockMemoryPrivilege, silently fall back without it. */
+    if ( large != 0 && size % large == 0 ) {
+        region = VirtualAlloc(NULL, size,
+                              MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                              PAGE_READWRITE);
+        *hugepages = region != NULL;
+    }
+
+    if ( region == NULL ) {
+        region = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT,
+                              PAGE_READWRITE);
+        if ( region == NULL )
+            return NULL;
+        region_prefault(region, size);
+    }
+#else
+# ifdef MAP_HUGETLB
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#  ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#  endif
+    region = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if ( region == MAP_FAILED )
+        region = NULL;
+    *hugepages = region != NULL;
+# endif
+
+    if ( region == NULL ) {
+        region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if ( region == MAP_FAILED )
+            return NULL;
+# ifdef MADV_HUGEPAGE
+        /* Transparent huge pages, if enabled, before faulting in. */
+        madvise(region, size, MADV_HUGEPAGE);
+# endif
+        region_prefault(region, size);
+    }
+#endif
+
+    return region;
+}
+
+static
+void region_unmap(void *region, size_t size)
+{
+#ifdef _WIN32
+    VirtualFree(region, 0, MEM_RELEASE);
+#else
+    munmap(region, size);
+#endif
+}
+
+static __inline
+int packet_in_region(struct rudp_base *rudp, struct rudp_packet_chain *pc)
+{
+    uint8_t *region = rudp->packet_region;
+
+    return region != NULL
+        && (uint8_t *)pc >= region
+        && (uint8_t *)pc < region + rudp->packet_stats.region_bytes;
+}
+
+static
+void packet_region_release(struct rudp_base *rudp)
+{
+    struct rudp_packet_stats *stats = &rudp->packet_stats;
+
+    if ( rudp->packet_region != NULL )
+        region_unmap(rudp->packet_region, (size_t)stats->region_bytes);
+
+    rudp->packet_region = NULL;
+    rudp_list_init(&rudp->free_region_list);
+    stats->region_bytes = 0;
+    stats->region_slots = 0;
+    stats->region_free = 0;
+    stats->region_hugepages = 0;
+}
+
+rudp_error_t rudp_packet_pool_set_region(
+    struct rudp_base *rudp,
+    size_t size)
+{
+    struct rudp_packet_stats *stats = &rudp->packet_stats;
+    struct rudp_packet_chain *pc;
+    uint8_t *region;
+    uint8_t hugepages;
+    size_t i;
+
+    if ( stats->region_free != stats->region_slots )
+        return EBUSY;
+
+    packet_region_release(rudp);
+
+    if ( size == 0 )
+        return 0;
+
+    size = (size + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1);
+
+    region = region_map(size, &hugepages);
+    if ( region == NULL )
+        return ENOMEM;
+
+    rudp->packet_region = region;
+    stats->region_bytes = size;
+    stats->region_slots = (uint32_t)(size / REGION_SLOT_SIZE);
+    stats->region_free = stats->region_slots;
+    stats->region_hugepages = hugepages;
+
+    for ( i = 0; i < stats->region_slots; i++ ) {
+        pc = (struct rudp_packet_chain *)(region + i * REGION_SLOT_SIZE);
+        pc->packet = (void*)(pc+1);
+        pc->alloc_size = DEFAULT_ALLOC_SIZE;
+        rudp_list_append(&rudp->free_region_list, &pc->chain_item);
+    }
+
+    rudp_log_printf(rudp, RUDP_LOG_INFO,
+                    "Packet region: %d buffers, %s pages\n",
+                    (int)stats->region_slots, hugepages ? "huge" : "normal");
+
+    return 0;
+}
+
+void rudp_packet_pool_init(struct rudp_base *rudp)
+{
+    struct rudp_packet_class_stats *classes = rudp->packet_stats.classes;
+    int i;
+
+    memset(&rudp->packet_stats, 0, sizeof(rudp->packet_stats));
+
+    for ( i = 0; i < RUDP_PACKET_CLASS_COUNT; i++ )
+        rudp_list_init(&rudp->free_packet_list[i]);
+
+    rudp->packet_region = NULL;
+    rudp_list_init(&rudp->free_region_list);
+
+    classes[PACKET_CLASS_SMALL].size = SMALL_ALLOC_SIZE;
+    classes[PACKET_CLASS_SMALL].max_free = FREE_SMALL_PACKET_POOL;
+    classes[PACKET_CLASS_DEFAULT].size = DEFAULT_ALLOC_SIZE;
+    classes[PACKET_CLASS_DEFAULT].max_free = FREE_PACKET_POOL;
+}
+
+static
+void packet_mem_free(struct rudp_base *rudp, enum packet_class cls,
+                     struct rudp_packet_chain *pc)
+{
+    uint64_t bytes = sizeof(*pc) + pc->alloc_size;
+
+    rudp->packet_stats.classes[cls].bytes -= bytes;
+    rudp->packet_stats.bytes -= bytes;
+    rudp_mem_free(rudp, pc);
+}
+
+static
+void packet_pool_trim(struct rudp_base *rudp, enum packet_class cls)
+{
+    struct rudp_packet_class_stats *stats = &rudp->packet_stats.classes[cls];
+    struct rudp_list *pool = &rudp->free_packet_list[cls];
+    struct rudp_packet_chain *pc;
+
+    while ( stats->free > stats->max_free ) {
+        pc = __container_of(pool->next, struct rudp_packet_chain *, chain_item);
+        rudp_list_remove(&pc->chain_item);
+        stats->free--;
+        packet_mem_free(rudp, cls, pc);
+    }
+}
+
+void rudp_packet_pool_deinit(struct rudp_base *rudp)
+{
+    int i;
+
+    for ( i = 0; i < RUDP_PACKET_CLASS_COUNT; i++ ) {
+        rudp->packet_stats.classes[i].max_free = 0;
+        packet_pool_trim(rudp, (enum packet_class)i);
+    }
+
+    packet_region_release(rudp);
+}
+
 struct rudp_packet_chain *rudp_packet_chain_alloc(
     struct rudp_base *rudp,
     size_t asked)
 {
-    size_t alloc = asked;
+    enum packet_class cls = packet_class_of(asked);
+    struct rudp_packet_stats *all = &rudp->packet_stats;
+    struct rudp_packet_class_stats *stats = &all->classes[cls];
+    struct rudp_list *pool = &rudp->free_packet_list[cls];
+    size_t alloc = stats->size ? stats->size : asked;
     struct rudp_packet_chain *pc;
 
-    if ( alloc < DEFAULT_ALLOC_SIZE )
-        alloc = DEFAULT_ALLOC_SIZE;
+    if ( cls == PACKET_CLASS_DEFAULT
+         && ! rudp_list_empty(&rudp->free_region_list) )
+        pool = &rudp->free_region_list;
 
-    if ( alloc == DEFAULT_ALLOC_SIZE ) {
-        // We'll pass this is the list is empty as well
-        rudp_list_for_each(struct rudp_packet_chain *, pc, &rudp->free_packet_list, chain_item) {
-            rudp_list_remove(&pc->chain_item);
-            rudp->free_packets--;
-            goto found;
-        }
+    if ( ! rudp_list_empty(pool) ) {
+        pc = __container_of(pool->next, struct rudp_packet_chain *, chain_item);
+        rudp_list_remove(&pc->chain_item);
+        if ( pool == &rudp->free_region_list )
+            all->region_free--;
+        else
+            stats->free--;
+        stats->hits++;
+        goto found;
     }
 
+    stats->misses++;
+
     pc = rudp_mem_alloc(rudp, sizeof(*pc)+alloc);
     if ( pc == NULL )
         return NULL;
 
-    rudp->allocated_packets++;
-
     pc->packet = (void*)(pc+1);
     pc->alloc_size = alloc;
 
+    stats->bytes += sizeof(*pc) + alloc;
+    all->bytes += sizeof(*pc) + alloc;
+    all->peak_bytes = RUDP_MAX(all->peak_bytes, all->bytes);
+
 found:
+    stats->in_use++;
+    stats->peak_in_use = RUDP_MAX(stats->peak_in_use, stats->in_use);
+    all->in_use++;
+    all->peak_in_use = RUDP_MAX(all->peak_in_use, all->in_use);
+
+    pc->packet = (void*)(pc+1);
     pc->len = asked;
+    pc->payload = NULL;
+    pc->payload_offset = 0;
+    pc->payload_len = 0;
+    pc->deadline = 0;
+    pc->retransmit_max = 0;
+    pc->retransmits = 0;
+    pc->timeouts = 0;
+    pc->sent_time = 0;
+    pc->lost = 0;
     return pc;
 }
 
 void rudp_packet_chain_free(struct rudp_base *rudp, struct rudp_packet_chain *pc)
 {
-    if ( pc->alloc_size == DEFAULT_ALLOC_SIZE ) {
-        rudp_list_insert(&rudp->free_packet_list, &pc->chain_item);
-        rudp->free_packets++;
+    enum packet_class cls = packet_class_of(pc->alloc_size);
+    struct rudp_packet_class_stats *stats = &rudp->packet_stats.classes[cls];
+
+    if ( pc->payload != NULL ) {
+        rudp_payload_release(rudp, pc->payload);
+        pc->payload = NULL;
+    }
+
+    stats->in_use--;
+    rudp->packet_stats.in_use--;
+
+    if ( packet_in_region(rudp, pc) ) {
+        rudp_list_insert(&rudp->free_region_list, &pc->chain_item);
+        rudp->packet_stats.region_free++;
+    } else if ( stats->free < stats->max_free ) {
+        rudp_list_insert(&rudp->free_packet_list[cls], &pc->chain_item);
+        stats->free++;
     } else {
-        rudp_mem_free(rudp, pc);
-        rudp->allocated_packets--;
+        packet_mem_free(rudp, cls, pc);
+    }
+}
+
+void rudp_packet_stats_get(
+    struct rudp_base *rudp,
+    struct rudp_packet_stats *stats)
+{
+    *stats = rudp->packet_stats;
+}
+
+rudp_error_t rudp_packet_pool_set_max_free(
+    struct rudp_base *rudp,
+    size_t size,
+    uint32_t max_free)
+{
+    int i;
+
+    for ( i = 0; i < RUDP_PACKET_CLASS_COUNT; i++ ) {
+        struct rudp_packet_class_stats *stats = &rudp->packet_stats.classes[i];
+
+        if ( stats->size == 0 || stats->size != size )
+            continue;
+
+        stats->max_free = max_free;
+        packet_pool_trim(rudp, (enum packet_class)i);
+        return 0;
     }
 
-    while ( rudp->free_packets > FREE_PACKET_POOL ) {
-        rudp_list_for_each(struct rudp_packet_chain *, pc, &rudp->free_packet_list, chain_item) {
-            rudp_list_remove(&pc->chain_item);
-            rudp->free_packets--;
-            rudp->allocated_packets--;
-            rudp_mem_free(rudp, pc);
-            break;
-        }
+    return EINVAL;
+}
+
+void rudp_packet_chain_set_payload(
+    struct rudp_packet_chain *pc,
+    struct rudp_payload *payload,
+    size_t offset, size_t len)
+{
+    rudp_payload_ref(payload);
+    pc->payload = payload;
+    pc->payload_offset = offset;
+    pc->payload_len = len;
+}
+
+struct rudp_payload *rudp_payload_new(
+    struct rudp_base *rudp,
+    const void *data, size_t len)
+{
+    struct rudp_payload *payload =
+        rudp_mem_alloc(rudp, sizeof(*payload) + len);
+
+    if ( payload == NULL )
+        return NULL;
+
+    payload->refcount = 1;
+    payload->len = len;
+    memcpy(payload->data, data, len);
+
+    return payload;
+}
+
+void rudp_payload_release(
+    struct rudp_base *rudp,
+    struct rudp_payload *payload)
+{
+    if ( --payload->refcount == 0 )
+        rudp_mem_free(rudp, payload);
+}
+
+/*
+  Layout byte of compact headers, after version, command and opt.
+  Fields follow in this order: channel, acknowledge, reliable,
+  unreliable, segment count and index, all in network order.
+ */
+#define COMPACT_RELIABLE_MASK 0x03      /* 1, 2 or 4 bytes */
+#define COMPACT_UNRELIABLE_MASK 0x0c    /* 0, 1, 2 or 4 bytes */
+#define COMPACT_UNRELIABLE_SHIFT 2
+#define COMPACT_ACK32 0x10              /* else 2 bytes, if opt has ACK */
+#define COMPACT_CHANNEL 0x20
+#define COMPACT_SEGMENTS 0x40
+#define COMPACT_FIXED_SIZE 4
+
+static const uint8_t compact_unreliable_bytes[] = { 0, 1, 2, 4 };
+
+static
+uint8_t *compact_put(uint8_t *p, uint32_t value, size_t bytes)
+{
+    while ( bytes-- )
+        *p++ = (uint8_t)(value >> (8 * bytes));
+    return p;
+}
+
+static
+const uint8_t *compact_get(const uint8_t *p, uint32_t *value, size_t bytes)
+{
+    *value = 0;
+    while ( bytes-- )
+        *value = (*value << 8) | *p++;
+    return p;
+}
+
+/*
+  Unreliable sequence number goes as is, on the fewest bytes that
+  hold it.  Reliable one is truncated to info->reliable_bits.
+ */
+static
+size_t compact_encode(uint8_t *buffer, const struct rudp_packet_info *info)
+{
+    uint8_t *p = buffer + COMPACT_FIXED_SIZE;
+    uint8_t layout, code;
+
+    code = info->reliable_bits > 16 ? 2 : info->reliable_bits > 8;
+    layout = code;
+
+    buffer[0] = RUDP_VERSION_COMPACT;
+    buffer[1] = info->command;
+    buffer[2] = info->opt;
+
+    if ( info->channel ) {
+        layout |= COMPACT_CHANNEL;
+        *p++ = info->channel;
+    }
+
+    if ( info->opt & RUDP_OPT_ACK ) {
+        if ( info->ack_bits > 16 )
+            layout |= COMPACT_ACK32;
+        p = compact_put(p, info->reliable_ack,
+                        (layout & COMPACT_ACK32) ? 4 : 2);
+    }
+
+    p = compact_put(p, info->reliable, (size_t)1 << code);
+
+    if ( info->unreliable == 0 )
+        code = 0;
+    else if ( info->unreliable <= 0xff )
+        code = 1;
+    else if ( info->unreliable <= 0xffff )
+        code = 2;
+    else
+        code = 3;
+    layout |= code << COMPACT_UNRELIABLE_SHIFT;
+    p = compact_put(p, info->unreliable, compact_unreliable_bytes[code]);
+
+    if ( info->segments_size != 1 || info->segment_index != 0 ) {
+        layout |= COMPACT_SEGMENTS;
+        p = compact_put(p, info->segments_size, 2);
+        p = compact_put(p, info->segment_index, 2);
+    }
+
+    buffer[3] = layout;
+
+    return p - buffer;
+}
+
+static
+size_t compact_decode(struct rudp_packet_info *info,
+                      const uint8_t *data, size_t len)
+{
+    const uint8_t *p = data + COMPACT_FIXED_SIZE;
+    size_t ack_bytes, reliable_bytes, unreliable_bytes, needed;
+    uint32_t value;
+    uint8_t layout;
+
+    if ( len < COMPACT_FIXED_SIZE )
+        return 0;
+
+    layout = data[3];
+    if ( (layout & COMPACT_RELIABLE_MASK) == COMPACT_RELIABLE_MASK )
+        return 0;
+
+    reliable_bytes = (size_t)1 << (layout & COMPACT_RELIABLE_MASK);
+    unreliable_bytes = compact_unreliable_bytes[
+        (layout & COMPACT_UNRELIABLE_MASK) >> COMPACT_UNRELIABLE_SHIFT];
+    ack_bytes = 0;
+    if ( data[2] & RUDP_OPT_ACK )
+        ack_bytes = (layout & COMPACT_ACK32) ? 4 : 2;
+
+    needed = COMPACT_FIXED_SIZE + !!(layout & COMPACT_CHANNEL)
+        + ack_bytes + reliable_bytes + unreliable_bytes
+        + ((layout & COMPACT_SEGMENTS) ? 4 : 0);
+    if ( len < needed )
+        return 0;
+
+    info->version = RUDP_VERSION_COMPACT;
+    info->command = data[1];
+    info->opt = data[2];
+    info->channel = (layout & COMPACT_CHANNEL) ? *p++ : 0;
+
+    /* Counters of peers agreeing on this format are the same 32-bit
+       values, unreliable sequence numbers and absent acknowledges are
+       exact. */
+    info->seq_bits = 32;
+    info->ack_bits = ack_bytes ? 8 * ack_bytes : 32;
+    info->reliable_bits = 8 * reliable_bytes;
+    info->unreliable_bits = 32;
+
+    p = compact_get(p, &info->reliable_ack, ack_bytes);
+    p = compact_get(p, &info->reliable, reliable_bytes);
+    p = compact_get(p, &info->unreliable, unreliable_bytes);
+
+    info->segments_size = 1;
+    info->segment_index = 0;
+    if ( layout & COMPACT_SEGMENTS ) {
+        p = compact_get(p, &value, 2);
+        info->segments_size = (uint16_t)value;
+        p = compact_get(p, &value, 2);
+        info->segment_index = (uint16_t)value;
+    }
+
+    return p - data;
+}
+
+size_t rudp_packet_header_encode(
+    void *buffer,
+    const struct rudp_packet_info *info)
+{
+    struct rudp_packet_header *header = buffer;
+    struct rudp_packet_header_seq32 *header32 = buffer;
+    uint32_t conn_id, ts[2], window;
+    size_t size;
+
+    switch ( info->version ) {
+    case RUDP_VERSION_SEQ32:
+        header32->version = RUDP_VERSION_SEQ32;
+        header32->command = info->command;
+        header32->opt = info->opt;
+        header32->channel = info->channel;
+        header32->reliable_ack = htonl(info->reliable_ack);
+        header32->reliable = htonl(info->reliable);
+        header32->unreliable = htonl(info->unreliable);
+        header32->segments_size = htons(info->segments_size);
+        header32->segment_index = htons(info->segment_index);
+        size = sizeof(*header32);
+        break;
+
+    case RUDP_VERSION_COMPACT:
+        size = compact_encode(buffer, info);
+        break;
+
+    default:
+        header->version = RUDP_VERSION;
+        header->command = info->command;
+        header->opt = info->opt;
+        header->channel = info->channel;
+        header->reliable_ack = htons((uint16_t)info->reliable_ack);
+        header->reliable = htons((uint16_t)info->reliable);
+        header->unreliable = htons((uint16_t)info->unreliable);
+        header->segments_size = htons(info->segments_size);
+        header->segment_index = htons(info->segment_index);
+        size = sizeof(*header);
+        break;
     }
+
+    if ( info->conn_id ) {
+        header->version |= RUDP_VERSION_CONN_ID;
+        conn_id = htonl(info->conn_id);
+        memcpy((uint8_t *)buffer + size, &conn_id, sizeof(conn_id));
+        size += sizeof(conn_id);
+    }
+
+    if ( info->ts_val ) {
+        header->version |= RUDP_VERSION_TIMESTAMP;
+        ts[0] = htonl(info->ts_val);
+        ts[1] = htonl(info->ts_ecr);
+        memcpy((uint8_t *)buffer + size, ts, sizeof(ts));
+        size += sizeof(ts);
+    }
+
+    if ( info->has_window ) {
+        header->version |= RUDP_VERSION_WINDOW;
+        window = htonl(info->window);
+        memcpy((uint8_t *)buffer + size, &window, sizeof(window));
+        size += sizeof(window);
+    }
+
+    return size;
+}
+
+size_t rudp_packet_header_decode(
+    struct rudp_packet_info *info,
+    const void *data, size_t len)
+{
+    const struct rudp_packet_header *header = data;
+    const struct rudp_packet_header_seq32 *header32 = data;
+    uint32_t conn_id, ts[2], window;
+    size_t size;
+
+    if ( len < 1 )
+        return 0;
+
+    switch ( header->version
+             & ~(RUDP_VERSION_CONN_ID | RUDP_VERSION_TIMESTAMP
+                 | RUDP_VERSION_WINDOW) ) {
+    case RUDP_VERSION:
+        if ( len < sizeof(*header) )
+            return 0;
+        info->version = RUDP_VERSION;
+        info->command = header->command;
+        info->opt = header->opt;
+        info->channel = header->channel;
+        info->seq_bits = 16;
+        info->ack_bits = 16;
+        info->reliable_bits = 16;
+        info->unreliable_bits = 16;
+        info->reliable_ack = ntohs(header->reliable_ack);
+        info->reliable = ntohs(header->reliable);
+        info->unreliable = ntohs(header->unreliable);
+        info->segments_size = ntohs(header->segments_size);
+        info->segment_index = ntohs(header->segment_index);
+        size = sizeof(*header);
+        break;
+
+    case RUDP_VERSION_SEQ32:
+        if ( len < sizeof(*header32) )
+            return 0;
+        info->version = RUDP_VERSION_SEQ32;
+        info->command = header32->command;
+        info->opt = header32->opt;
+        info->channel = header32->channel;
+        info->seq_bits = 32;
+        info->ack_bits = 32;
+        info->reliable_bits = 32;
+        info->unreliable_bits = 32;
+        info->reliable_ack = ntohl(header32->reliable_ack);
+        info->reliable = ntohl(header32->reliable);
+        info->unreliable = ntohl(header32->unreliable);
+        info->segments_size = ntohs(header32->segments_size);
+        info->segment_index = ntohs(header32->segment_index);
+        size = sizeof(*header32);
+        break;
+
+    case RUDP_VERSION_COMPACT:
+        size = compact_decode(info, data, len);
+        if ( size == 0 )
+            return 0;
+        break;
+
+    default:
+        return 0;
+    }
+
+    info->conn_id = 0;
+    if ( header->version & RUDP_VERSION_CONN_ID ) {
+        if ( len < size + sizeof(conn_id) )
+            return 0;
+        memcpy(&conn_id, (const uint8_t *)data + size, sizeof(conn_id));
+        info->conn_id = ntohl(conn_id);
+        size += sizeof(conn_id);
+    }
+
+    info->ts_val = 0;
+    info->ts_ecr = 0;
+    if ( header->version & RUDP_VERSION_TIMESTAMP ) {
+        if ( len < size + sizeof(ts) )
+            return 0;
+        memcpy(ts, (const uint8_t *)data + size, sizeof(ts));
+        info->ts_val = ntohl(ts[0]);
+        info->ts_ecr = ntohl(ts[1]);
+        size += sizeof(ts);
+    }
+
+    info->window = 0;
+    info->has_window = 0;
+    if ( header->version & RUDP_VERSION_WINDOW ) {
+        if ( len < size + sizeof(window) )
+            return 0;
+        memcpy(&window, (const uint8_t *)data + size, sizeof(window));
+        info->window = ntohl(window);
+        info->has_window = 1;
+        size += sizeof(window);
+    }
+
+    return size;
+}
+
+uint32_t rudp_packet_conn_id(const void *data, size_t len)
+{
+    struct rudp_packet_info info;
+
+    if ( len < 1 || !(*(const uint8_t *)data & RUDP_VERSION_CONN_ID) )
+        return 0;
+
+    if ( rudp_packet_header_decode(&info, data, len) == 0 )
+        return 0;
+
+    return info.conn_id;
+}
+
+void rudp_packet_chain_canonicalize(
+    struct rudp_packet_chain *pc,
+    const struct rudp_packet_info *info,
+    size_t header_size)
+{
+    struct rudp_packet_header *header;
+
+    /* Drop the extra bytes of a longer wire header in front of the
+       canonical one, a compact header grows into the headroom. */
+    pc->packet = (struct rudp_packet *)
+        ((uint8_t *)pc->packet + header_size - sizeof(*header));
+    pc->len = pc->len + sizeof(*header) - header_size;
+
+    header = &pc->packet->header;
+    header->version = RUDP_VERSION;
+    header->command = info->command;
+    header->opt = info->opt;
+    header->channel = info->channel;
+    header->reliable_ack = htons((uint16_t)info->reliable_ack);
+    header->reliable = htons((uint16_t)info->reliable);
+    header->unreliable = htons((uint16_t)info->unreliable);
+    header->segments_size = htons(info->segments_size);
+    header->segment_index = htons(info->segment_index);
+
+    pc->seq_reliable = info->reliable;
+    pc->seq_unreliable = info->unreliable;
 }
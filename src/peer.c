@@ -15,34 +15,109 @@
 # include <sys/time.h>
 #endif
 #include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <event2/event.h>
+#include <event2/util.h>
 
 #include <rudp/address.h>
 #include <rudp/endpoint.h>
 #include <rudp/peer.h>
 #include <rudp/rudp.h>
 
+#include "rudp_compress.h"
 #include "rudp_list.h"
 #include "rudp_packet.h"
+#include "rudp_peer.h"
 
 #define CLOCK_GRANULARITY 1000
 
+/*
+  Path MTU discovery, after RFC 8899 (DPLPMTUD).  Sizes are UDP
+  payload sizes.  Base size is assumed to reach any peer, larger sizes
+  are only used once a probe of that size was acknowledged.
+ */
+#define PMTU_BASE 1200
+#define PMTU_MAX RUDP_RECV_BUFFER_SIZE
+#define PMTU_MAX_PROBES 3
+/* Search stops when the untested range is narrower */
+#define PMTU_GRANULARITY 16
+/* Interval for looking for a larger path MTU again, in ms */
+#define PMTU_RAISE_INTERVAL 600000
+
+/* Most messages sent uncompressed after compression failures */
+#define PEER_COMPRESS_BACKOFF_MAX 64
+
+/*
+  Tail loss probe timeout bounds, and its value while the round-trip
+  time is unknown, in ms
+ */
+#define PEER_PROBE_TIMEOUT_MIN 10
+#define PEER_PROBE_TIMEOUT_DEFAULT 1000
+
+/*
+  Bytes of reliable packets in flight until the peer advertises its
+  window, and for good with peers not agreeing on the window: a single
+  loss must not make the whole queue go again at once.
+ */
+#define PEER_SEND_WINDOW_DEFAULT (64 * 1024)
+
+/* Incoming reliable sequence number until the handshake sets it */
+#define PEER_SEQ_UNSET ((uint32_t)-1)
+
+#ifdef _WIN32
+# define PMTU_EMSGSIZE WSAEMSGSIZE
+#else
+# define PMTU_EMSGSIZE EMSGSIZE
+#endif
+
+/*
+  Layout check, it fails to compile when broken: channel 0 sequence
+  numbers share the first cache line with the RTT state.  The rest of
+  the structure is not on the per-packet path.
+ */
+typedef char peer_check_channel_line[
+    offsetof(struct rudp_peer, default_channel.ts_recent)
+    + sizeof(uint32_t) <= 64 ? 1 : -1];
+
 /* Declarations */
 
-static void peer_post_ack(struct rudp_peer *peer);
+static void peer_post_ack(struct rudp_peer *peer,
+                          struct rudp_peer_channel *channel);
 static rudp_error_t peer_send_raw(
     struct rudp_peer *peer,
     const void *data, size_t len);
-static int peer_handle_ack(struct rudp_peer *peer, uint16_t ack);
+static int peer_handle_ack(struct rudp_peer *peer,
+                           struct rudp_peer_channel *channel, uint32_t ack,
+                           uint32_t ts_ecr);
+static void peer_pmtu_start(struct rudp_peer *peer);
+static void peer_pmtu_service(struct rudp_peer *peer, rudp_time_t now);
+static void peer_handle_pmtu(
+    struct rudp_peer *peer,
+    const struct rudp_packet_chain *pc);
+static void peer_path_challenge(struct rudp_peer *peer,
+                                const struct sockaddr_storage *from);
+static void peer_handle_path(struct rudp_peer *peer,
+                             const struct rudp_packet_chain *pc,
+                             const struct sockaddr_storage *from);
 
 static void peer_service(struct rudp_peer *peer);
 static void _peer_service(evutil_socket_t fd, short flags, void *arg);
 static int peer_service_schedule(struct rudp_peer *peer);
-static void rudp_peer_handle_segment(
+static void peer_rto_update(struct rudp_peer *peer);
+static rudp_time_t peer_channel_deadline(struct rudp_peer *peer,
+                                         struct rudp_peer_channel *channel,
+                                         rudp_time_t now,
+                                         rudp_time_t delta);
+static void peer_sendq_append_unreliable(
+    struct rudp_peer *peer, unsigned int channel,
+    struct rudp_packet_chain *pc, size_t index, size_t length);
+static rudp_error_t rudp_peer_handle_segment(
     struct rudp_peer *peer,
+    struct rudp_peer_channel *channel,
+    const struct rudp_packet_info *info,
     const struct rudp_packet_header *header,
     struct rudp_packet_chain *pc);
 
@@ -56,63 +131,278 @@ enum peer_state
 
 /* Object management */
 
+static uint32_t peer_chain_size(const struct rudp_packet_chain *pc)
+{
+    return pc->len + pc->payload_len;
+}
+
+/*
+  Unqueues and frees a packet of a send queue, bytes in flight are
+  updated if it was sent.
+ */
+static void peer_sendq_free(struct rudp_peer *peer,
+                            struct rudp_packet_chain *pc)
+{
+    const struct rudp_packet_header *header = &pc->packet->header;
+
+    if ( (header->opt & RUDP_OPT_RELIABLE)
+         && (header->opt & RUDP_OPT_RETRANSMITTED) )
+        peer->flight -= peer_chain_size(pc);
+
+    rudp_list_remove(&pc->chain_item);
+    rudp_packet_chain_free(peer->rudp, pc);
+}
+
+static void
+peer_channel_flush(struct rudp_peer *peer, struct rudp_peer_channel *channel)
+{
+    struct rudp_packet_chain *pc, *tmp;
+
+    rudp_list_for_each_safe(struct rudp_packet_chain *, pc, tmp, &channel->sendq, chain_item)
+        peer_sendq_free(peer, pc);
+
+    rudp_list_for_each_safe(struct rudp_packet_chain *, pc, tmp, &channel->unreliable_sendq, chain_item) {
+        rudp_list_remove(&pc->chain_item);
+        rudp_packet_chain_free(peer->rudp, pc);
+    }
+
+    if (channel->segments != NULL)
+        rudp_packet_chain_free(peer->rudp, channel->segments);
+    channel->segments = NULL;
+
+    if (channel->bundle != NULL)
+        rudp_packet_chain_free(peer->rudp, channel->bundle);
+    channel->bundle = NULL;
+}
+
+/*
+  All channels start from the same sequence number, so that the
+  handshake on channel 0 synchronizes all of them.
+ */
+static void
+peer_channel_reset(struct rudp_peer *peer, struct rudp_peer_channel *channel,
+                   uint32_t seq)
+{
+    peer_channel_flush(peer, channel);
+
+    channel->in_seq_reliable = PEER_SEQ_UNSET;
+    channel->in_seq_unreliable = 0;
+    channel->in_seq_window = 0;
+    channel->ts_recent = 0;
+    channel->out_seq_reliable = seq;
+    channel->out_seq_unreliable = 0;
+    channel->out_seq_acked = seq - 1;
+    channel->must_ack = 0;
+    channel->lost = 0;
+    channel->probed = 0;
+    channel->blocked = 0;
+}
+
+static void
+peer_held_flush(struct rudp_peer *peer)
+{
+    struct rudp_packet_chain *pc, *tmp;
+
+    rudp_list_for_each_safe(struct rudp_packet_chain *, pc, tmp, &peer->held, chain_item) {
+        rudp_list_remove(&pc->chain_item);
+        rudp_packet_chain_free(peer->rudp, pc);
+    }
+
+    peer->held_size = 0;
+}
+
+/*
+  Receive window we advertise, what is left of it once held messages
+  are counted.
+ */
+static uint32_t peer_receive_window(const struct rudp_peer *peer)
+{
+    if ( peer->held_size >= peer->receive_window )
+        return 0;
+    return peer->receive_window - peer->held_size;
+}
+
+/*
+  Once held messages fill the receive window, new reliable payloads
+  are refused, whether the peer agreed on the window or not, and so
+  is any reliable packet sent after them.  They are neither sequenced
+  nor acknowledged, peer sends them again.  Only a peer that agreed
+  on the window is told, the acknowledge brings it a closed window.
+  Any other peer would take the acknowledge as a loss and send
+  everything again at once, it is left to its retransmission timer
+  and backoff.
+ */
+static int peer_window_full(const struct rudp_peer *peer,
+                            const struct rudp_peer_channel *channel,
+                            const struct rudp_packet_info *info,
+                            const struct rudp_packet_header *header)
+{
+    int32_t delta = info->reliable - channel->in_seq_reliable;
+
+    if ( !peer->paused
+         || peer->state != PEER_RUN
+         || peer->held_size < peer->receive_window
+         || !(header->opt & RUDP_OPT_RELIABLE) )
+        return 0;
+
+    return delta > 1
+        || (delta == 1
+            && (header->command >= RUDP_CMD_APP
+                || header->command == RUDP_CMD_BUNDLE));
+}
+
+/*
+  An acknowledge may have moved the window, blocked channels try
+  again on next service.
+ */
+static void peer_window_changed(struct rudp_peer *peer)
+{
+    unsigned int i;
+
+    for (i = 0; i < peer->channel_count; i++)
+        peer->channels[i].blocked = 0;
+}
+
 void
 rudp_peer_reset(struct rudp_peer *peer)
 {
-    struct rudp_packet_chain *pc, *tmp;
+    uint32_t seq = rudp_random();
+    unsigned int i;
 
     if (peer == NULL)
         return;
 
-    if (peer->sendq.next != NULL) {
-        rudp_list_for_each_safe(struct rudp_packet_chain *, pc, tmp, &peer->sendq, chain_item) {
-            rudp_list_remove(&pc->chain_item);
-            rudp_packet_chain_free(peer->rudp, pc);
-        }
-    }
-
     if (peer->ev != NULL)
         evtimer_del(peer->ev);
 
+    for (i = 0; i < peer->channel_max; i++)
+        peer_channel_reset(peer, &peer->channels[i], seq);
+
     peer->abs_timeout_deadline = rudp_timestamp() + peer->timeout.drop;
-    peer->in_seq_reliable = (uint16_t)-1;
-    peer->in_seq_unreliable = 0;
-    peer->out_seq_reliable = rudp_random();
-    peer->out_seq_unreliable = 0;
-    peer->out_seq_acked = peer->out_seq_reliable - 1;
+    peer->channel_count = peer->channel_max;
+    peer->features = 0;
+    peer->out_conn_id = 0;
+    peer->in_conn_id = 0;
+    peer->mtu = PMTU_BASE;
+    peer->pmtu.probe = 0;
+    peer->pmtu.deadline = 0;
     peer->state = PEER_NEW;
     peer->last_out_time = rudp_timestamp();
+    peer->last_in_time = peer->last_out_time;
+    peer->ping_time = 0;
+    peer->keepalive_spread = (uint8_t)rudp_random();
+    peer->bundle_deadline = 0;
+    peer->compress.skip = 0;
+    peer->compress.backoff = 0;
+    peer->token_valid = 0;
     peer->srtt = -1;
     peer->rttvar = -1;
-    peer->rto = peer->timeout.min_rto;
-    peer->must_ack = 0;
+    peer->backoff = 0;
+    peer_rto_update(peer);
+    peer->flight = 0;
+    peer->send_window = PEER_SEND_WINDOW_DEFAULT;
+    peer->window_probe = 0;
+    peer_held_flush(peer);
+    peer->paused = 0;
     peer->sendto_err = 0;
+    peer->path.address.sa.sa_family = AF_UNSPEC;
 }
 
-void rudp_peer_init(
+static void peer_init(
     struct rudp_peer *peer,
     struct rudp_base *rudp,
     const struct rudp_peer_handler *handler,
-    struct rudp_endpoint *endpoint)
+    struct rudp_endpoint *endpoint,
+    struct event *ev,
+    struct rudp_peer_channel *channels,
+    unsigned int channel_max)
 {
-    rudp_list_init(&peer->sendq);
-    peer->segments = NULL;
-    rudp_address_init(&peer->address, rudp);
+    unsigned int i;
+
+    if (channels != NULL) {
+        peer->channels = channels;
+        peer->channel_max = channel_max;
+    } else {
+        peer->channels = &peer->default_channel;
+        peer->channel_max = 1;
+    }
+
+    peer->channels_embedded = 0;
+
+    rudp_list_init(&peer->sched);
+    rudp_list_init(&peer->held);
+    for (i = 0; i < peer->channel_max; i++) {
+        rudp_list_init(&peer->channels[i].sendq);
+        rudp_list_init(&peer->channels[i].unreliable_sendq);
+        peer->channels[i].segments = NULL;
+        peer->channels[i].bundle = NULL;
+        peer->channels[i].priority = 0;
+        peer->channels[i].delivery = RUDP_DELIVERY_ORDERED;
+        rudp_list_append(&peer->sched, &peer->channels[i].sched_item);
+    }
+
+    memset(&peer->address, 0, sizeof(peer->address));
+    peer->address.sa.sa_family = AF_UNSPEC;
     peer->endpoint = endpoint;
     peer->rudp = rudp;
     peer->handler = *handler;
-    peer->ev = evtimer_new(rudp->eb, _peer_service, peer);
+
+    if (ev != NULL) {
+        evtimer_assign(ev, rudp->eb, _peer_service, peer);
+        peer->ev = ev;
+        peer->ev_embedded = 1;
+    } else {
+        peer->ev = evtimer_new(rudp->eb, _peer_service, peer);
+        peer->ev_embedded = 0;
+    }
 
     peer->timeout.min_rto = rudp->default_timeout.min_rto;
     peer->timeout.max_rto = rudp->default_timeout.max_rto;
     peer->timeout.drop = rudp->default_timeout.drop;
     peer->timeout.action = rudp->default_timeout.action;
+    peer->timeout.keepalive = rudp->default_timeout.keepalive;
+    peer->timeout.jitter = rudp->default_timeout.jitter;
+    peer->timeout.retries = rudp->default_timeout.retries;
+    peer->fec_group = rudp->fec_group;
+    peer->receive_window = rudp->receive_window;
 
     rudp_peer_reset(peer);
 
     peer_service_schedule(peer);
 }
 
+/*
+  Peers owning their storage get their channel array from the rudp
+  allocator.  Without it, the connection fails rather than silently
+  negotiating fewer channels than asked for.
+ */
+static rudp_error_t peer_init_alloc(
+    struct rudp_peer *peer,
+    struct rudp_base *rudp,
+    const struct rudp_peer_handler *handler,
+    struct rudp_endpoint *endpoint)
+{
+    struct rudp_peer_channel *channels = NULL;
+
+    if (rudp->channels > 1) {
+        channels = rudp_mem_alloc(rudp, rudp->channels * sizeof(*channels));
+        if (channels == NULL)
+            return ENOMEM;
+    }
+
+    peer_init(peer, rudp, handler, endpoint, NULL, channels, rudp->channels);
+    return 0;
+}
+
+rudp_error_t rudp_peer_init(
+    struct rudp_peer *peer,
+    struct rudp_base *rudp,
+    const struct rudp_peer_handler *handler,
+    struct rudp_endpoint *endpoint)
+{
+    return peer_init_alloc(peer, rudp, handler, endpoint);
+}
+
 struct rudp_peer *
 rudp_peer_new(struct rudp_base *rudp, const struct rudp_peer_handler *handler,
         struct rudp_endpoint *endpoint)
@@ -120,8 +410,10 @@ rudp_peer_new(struct rudp_base *rudp, const struct rudp_peer_handler *handler,
     struct rudp_peer *peer;
 
     peer = rudp_mem_alloc(rudp, sizeof(struct rudp_peer));
-    if (peer != NULL)
-        rudp_peer_init(peer, rudp, handler, endpoint);
+    if (peer != NULL && rudp_peer_init(peer, rudp, handler, endpoint) != 0) {
+        rudp_mem_free(rudp, peer);
+        peer = NULL;
+    }
     return peer;
 }
 
@@ -132,14 +424,19 @@ rudp_peer_deinit(struct rudp_peer *peer)
         return;
 
     rudp_peer_reset(peer);
-    rudp_address_deinit(&peer->address);
 
-    if (peer->segments != NULL)
-        rudp_packet_chain_free(peer->rudp, peer->segments);
-    peer->segments = NULL;
+    if (peer->channels != &peer->default_channel && !peer->channels_embedded)
+        rudp_mem_free(peer->rudp, peer->channels);
+    peer->channels = &peer->default_channel;
+    peer->channel_max = peer->channel_count = 1;
+    rudp_list_init(&peer->sched);
+    rudp_list_append(&peer->sched, &peer->default_channel.sched_item);
 
     if (peer->ev != NULL) {
-        event_free(peer->ev);
+        if (peer->ev_embedded)
+            evtimer_del(peer->ev);
+        else
+            event_free(peer->ev);
         peer->ev = NULL;
     }
 
@@ -155,56 +452,145 @@ rudp_peer_free(struct rudp_peer *peer)
     rudp_mem_free(peer->rudp, peer);
 }
 
+/*
+  Retransmission timeout from the round-trip time estimates, or
+  min_rto before the first one, doubled for each backoff up to
+  max_rto.  Backed off timeouts are shortened by a random part of
+  the jitter range, not under min_rto.
+ */
+static void
+peer_rto_update(struct rudp_peer *peer)
+{
+    rudp_time_t rto = peer->timeout.min_rto;
+    unsigned int i;
+
+    if (peer->srtt >= 0)
+        rto = peer->srtt + RUDP_MAX(CLOCK_GRANULARITY, 4 * peer->rttvar);
+
+    /* RFC 6298 2.4 */
+    rto = RUDP_MAX(rto, peer->timeout.min_rto);
+
+    for (i = 0; i < peer->backoff && rto < peer->timeout.max_rto; i++)
+        rto *= 2;
+
+    /* RFC 6298 2.5 */
+    rto = RUDP_MIN(rto, peer->timeout.max_rto);
+
+    if (peer->backoff && peer->timeout.jitter) {
+        rudp_time_t range = rto * peer->timeout.jitter / 100;
+        uint32_t r = ((uint32_t)rudp_random() << 16) | rudp_random();
+
+        rto -= r % (range + 1);
+        rto = RUDP_MAX(rto, RUDP_MIN(peer->timeout.min_rto,
+                                     peer->timeout.max_rto));
+    }
+
+    peer->rto = rto;
+}
+
 static void
 peer_update_rtt(struct rudp_peer *peer, rudp_time_t last_rtt)
 {
-    /* Invalid RTT. */
-    if (last_rtt <= 0)
+    /* Invalid RTT.  Clock has a 1 ms resolution, 0 is a valid sample
+       on fast links. */
+    if (last_rtt < 0)
         return;
 
     if (peer->srtt == -1) {
         /* RFC 6298 2.2 */
         peer->srtt = last_rtt;
         peer->rttvar = last_rtt / 2;
-        peer->rto = peer->srtt + RUDP_MAX(CLOCK_GRANULARITY, 4 * peer->rttvar);
     } else {
         /* RFC 6298 2.3 - Alpha is 1/8 and beta 1/4, both hardcoded for now. */
         peer->rttvar = (3 * peer->rttvar + labs((long)(peer->srtt - last_rtt))) / 4;
         peer->srtt = (7 * peer->srtt + last_rtt) / 8;
-        peer->rto = peer->srtt + RUDP_MAX(CLOCK_GRANULARITY, 4 * peer->rttvar);
     }
 
-    /* RFC 6298 2.4 */
-    peer->rto = RUDP_MAX(peer->rto, peer->timeout.min_rto);
-
-    /* RFC 6298 2.5 */
-    peer->rto = RUDP_MIN(peer->rto, peer->timeout.max_rto);
+    /* A fresh sample ends the backoff */
+    peer->backoff = 0;
+    peer_rto_update(peer);
 
     rudp_log_printf(peer->rudp, RUDP_LOG_INFO,
                     "Timeout state: rttvar %d srtt %d rto %d\n",
                     (int)peer->rttvar, (int)peer->srtt, (int)peer->rto);
 }
 
+void rudp_peer_resume(struct rudp_peer *peer,
+                      rudp_time_t srtt, rudp_time_t rttvar)
+{
+    if ( srtt <= 0 )
+        return;
+
+    peer->srtt = srtt;
+    peer->rttvar = rttvar;
+    peer->backoff = 0;
+    peer_rto_update(peer);
+
+    rudp_log_printf(peer->rudp, RUDP_LOG_INFO,
+                    "Timeout state resumed: rttvar %d srtt %d rto %d\n",
+                    (int)peer->rttvar, (int)peer->srtt, (int)peer->rto);
+}
+
 static void
 peer_rto_backoff(struct rudp_peer *peer)
 {
     /* RFC 6298 5.5 */
-    peer->rto = RUDP_MAX(peer->rto * 2, peer->timeout.max_rto);
+    if ( peer->backoff < UINT8_MAX )
+        peer->backoff++;
+    peer_rto_update(peer);
 
     rudp_log_printf(peer->rudp, RUDP_LOG_INFO,
-                    "Timeout state: rttvar %d srtt %d rto %d\n",
-                    (int)peer->rttvar, (int)peer->srtt, (int)peer->rto);
+                    "Timeout state: rttvar %d srtt %d rto %d backoff %d\n",
+                    (int)peer->rttvar, (int)peer->srtt, (int)peer->rto,
+                    (int)peer->backoff);
+}
+
+static void peer_address_copy(union rudp_sockaddr_inet *address,
+                              const struct sockaddr_storage *addr)
+{
+    switch (addr->ss_family) {
+    case AF_INET:
+        memcpy(&address->sin, addr, sizeof(struct sockaddr_in));
+        break;
+    case AF_INET6:
+        memcpy(&address->sin6, addr, sizeof(struct sockaddr_in6));
+        break;
+    }
+}
+
+static void peer_set_address(struct rudp_peer *peer,
+                             const struct sockaddr_storage *addr)
+{
+    peer_address_copy(&peer->address, addr);
 }
 
-void rudp_peer_from_sockaddr(
+rudp_error_t rudp_peer_from_sockaddr(
     struct rudp_peer *peer,
     struct rudp_base *rudp,
     const struct sockaddr_storage *addr,
     const struct rudp_peer_handler *handler,
     struct rudp_endpoint *endpoint)
 {
-    rudp_peer_init(peer, rudp, handler, endpoint);
-    rudp_address_set(&peer->address, (struct sockaddr *) addr, sizeof (*addr));
+    rudp_error_t err = peer_init_alloc(peer, rudp, handler, endpoint);
+
+    if (err == 0)
+        peer_set_address(peer, addr);
+    return err;
+}
+
+void rudp_peer_from_sockaddr_ev(
+    struct rudp_peer *peer,
+    struct rudp_base *rudp,
+    const struct sockaddr_storage *addr,
+    const struct rudp_peer_handler *handler,
+    struct rudp_endpoint *endpoint,
+    struct event *ev,
+    struct rudp_peer_channel *channels,
+    unsigned int channel_max)
+{
+    peer_init(peer, rudp, handler, endpoint, ev, channels, channel_max);
+    peer->channels_embedded = 1;
+    peer_set_address(peer, addr);
 }
 
 /* Sync handling */
@@ -216,50 +602,129 @@ enum packet_state
     RETRANSMITTED,
 };
 
+/*
+  Whether unreliable sequence numbers of a channel go on across
+  reliable packets instead of restarting after each one.
+ */
+static int peer_unreliable_kept(const struct rudp_peer *peer)
+{
+    return !!(peer->features
+              & (RUDP_FEATURE_FAST_LANE | RUDP_FEATURE_DELIVERY));
+}
+
 static
 enum packet_state peer_analyse_reliable(
     struct rudp_peer *peer,
-    uint16_t reliable_seq)
+    struct rudp_peer_channel *channel,
+    uint32_t reliable_seq)
 {
-    if ( peer->in_seq_reliable == reliable_seq )
+    if ( channel->in_seq_reliable == reliable_seq )
         return RETRANSMITTED;
 
-    if ( (uint16_t)(peer->in_seq_reliable + 1) != reliable_seq ) {
-        if (peer->state != PEER_NEW || peer->in_seq_reliable != (uint16_t)-1) {
+    if ( channel->in_seq_reliable + 1 != reliable_seq ) {
+        if (peer->state != PEER_NEW || channel->in_seq_reliable != PEER_SEQ_UNSET) {
             rudp_log_printf(peer->rudp, RUDP_LOG_WARN,
                             "%s unsequenced last seq %04x packet %04x\n",
-                            __FUNCTION__, peer->in_seq_reliable, reliable_seq);
+                            __FUNCTION__, channel->in_seq_reliable, reliable_seq);
         }
         return UNSEQUENCED;
     }
 
-    peer->in_seq_reliable = reliable_seq;
-    peer->in_seq_unreliable = 0;
+    channel->in_seq_reliable = reliable_seq;
+
+    if (peer_unreliable_kept(peer))
+        return SEQUENCED;
+
+    channel->in_seq_unreliable = 0;
+
+    /* Unreliable message being reassembled can not complete anymore */
+    if (channel->segments != NULL && !channel->segments_reliable) {
+        rudp_packet_chain_free(peer->rudp, channel->segments);
+        channel->segments = NULL;
+    }
 
     return SEQUENCED;
 }
 
+#define UNRELIABLE_WINDOW 32
+
+/*
+  Records an unreliable sequence number, when they are not restarted
+  after reliable packets.  Numbers older than the newest one are only
+  taken if late is set, once, and when in the window.
+ */
+static int peer_unreliable_record(struct rudp_peer_channel *channel,
+                                  uint32_t seq, int late)
+{
+    int32_t delta = seq - channel->in_seq_unreliable;
+    uint32_t bit;
+
+    if ( delta > 0 ) {
+        if ( delta < UNRELIABLE_WINDOW )
+            channel->in_seq_window = (channel->in_seq_window << delta)
+                | (1u << (delta - 1));
+        else if ( delta == UNRELIABLE_WINDOW )
+            channel->in_seq_window = 1u << (delta - 1);
+        else
+            channel->in_seq_window = 0;
+        channel->in_seq_unreliable = seq;
+        return 1;
+    }
+
+    if ( !late || delta == 0 || -delta > UNRELIABLE_WINDOW )
+        return 0;
+
+    bit = 1u << (-delta - 1);
+    if ( channel->in_seq_window & bit )
+        return 0;
+
+    channel->in_seq_window |= bit;
+    return 1;
+}
+
 static
 enum packet_state peer_analyse_unreliable(
     struct rudp_peer *peer,
-    uint16_t reliable_seq,
-    uint16_t unreliable_seq)
+    struct rudp_peer_channel *channel,
+    uint8_t opt,
+    uint32_t reliable_seq,
+    uint32_t unreliable_seq)
 {
     rudp_log_printf(peer->rudp, RUDP_LOG_IO,
                     "%s rel %04x == %04x, unrel %04x >= %04x\n",
                     __FUNCTION__,
-                    peer->in_seq_reliable, reliable_seq,
-                    unreliable_seq, peer->in_seq_unreliable);
+                    channel->in_seq_reliable, reliable_seq,
+                    unreliable_seq, channel->in_seq_unreliable);
+
+    if ( peer_unreliable_kept(peer) ) {
+        if ( !(peer->features & RUDP_FEATURE_DELIVERY) )
+            opt &= ~(RUDP_OPT_SEQUENCED | RUDP_OPT_UNORDERED);
+
+        /* Sequenced or unordered packets do not wait for reliable
+           ones.  In the fast lane, the reliable packet must only be
+           received. */
+        if ( !(opt & (RUDP_OPT_SEQUENCED | RUDP_OPT_UNORDERED))
+             && ((peer->features & RUDP_FEATURE_FAST_LANE)
+                 ? (int32_t)(reliable_seq - channel->in_seq_reliable) > 0
+                 : reliable_seq != channel->in_seq_reliable) )
+            return UNSEQUENCED;
+
+        if ( !peer_unreliable_record(channel, unreliable_seq,
+                                     opt & RUDP_OPT_UNORDERED) )
+            return UNSEQUENCED;
+
+        return SEQUENCED;
+    }
 
-    if ( peer->in_seq_reliable != reliable_seq )
+    if ( channel->in_seq_reliable != reliable_seq )
         return UNSEQUENCED;
 
-    int16_t unreliable_delta = unreliable_seq - peer->in_seq_unreliable;
+    int32_t unreliable_delta = unreliable_seq - channel->in_seq_unreliable;
 
     if ( unreliable_delta <= 0 )
         return UNSEQUENCED;
 
-    peer->in_seq_unreliable = unreliable_seq;
+    channel->in_seq_unreliable = unreliable_seq;
 
     return SEQUENCED;
 }
@@ -272,7 +737,12 @@ static void peer_ping(struct rudp_peer *peer)
         peer->rudp,
         sizeof(struct rudp_packet_header) + sizeof(rudp_time_t)
         );
-    struct rudp_packet_data *data = &pc->packet->data;
+    struct rudp_packet_data *data;
+
+    if ( pc == NULL )
+        return;
+
+    data = &pc->packet->data;
 
     rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
                     "%s pushing PING\n", __FUNCTION__);
@@ -282,9 +752,89 @@ static void peer_ping(struct rudp_peer *peer)
     rudp_time_t timestamp = rudp_timestamp();
     memcpy(data->data, &timestamp, sizeof(timestamp));
 
+    peer->ping_time = timestamp;
     rudp_peer_send_reliable(peer, pc);
 }
 
+static void peer_keepalive(struct rudp_peer *peer)
+{
+    struct rudp_packet_chain *pc = rudp_packet_chain_alloc(
+        peer->rudp, sizeof(struct rudp_packet_header));
+
+    if ( pc == NULL )
+        return;
+
+    rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
+                    "%s pushing NOOP\n", __FUNCTION__);
+
+    pc->packet->header.command = RUDP_CMD_NOOP;
+
+    rudp_peer_send_unreliable(peer, pc);
+}
+
+/*
+  Idle intervals are shortened by up to a quarter, a random amount
+  drawn again after each keepalive, so that peers connected together
+  do not wake up together.
+ */
+static __inline
+rudp_time_t peer_idle_interval(const struct rudp_peer *peer,
+                               rudp_time_t interval)
+{
+    return interval - interval * peer->keepalive_spread / 1024;
+}
+
+/*
+  Silence of the peer before it is pinged.  Its keepalives normally
+  come before, a ping only goes out when they stop, as the drop
+  timeout gets close, or later if timeout.action says so.
+ */
+static __inline
+rudp_time_t peer_ping_interval(const struct rudp_peer *peer)
+{
+    return RUDP_MAX(peer->timeout.action,
+                    peer->timeout.drop - peer->timeout.drop / 4);
+}
+
+/*
+  Time, relative to now, an idle peer needs a keepalive at: when we
+  sent nothing for timeout.keepalive, or when the peer is silent for
+  the ping interval, at most once per interval.
+ */
+static rudp_time_t peer_keepalive_deadline(const struct rudp_peer *peer,
+                                           rudp_time_t now)
+{
+    rudp_time_t deadline = RUDP_MAX(peer->last_in_time, peer->ping_time)
+        + peer_idle_interval(peer, peer_ping_interval(peer));
+
+    if ( peer->timeout.keepalive != 0 )
+        deadline = RUDP_MIN(deadline, peer->last_out_time
+                            + peer_idle_interval(peer, peer->timeout.keepalive));
+
+    return deadline - now;
+}
+
+/*
+  The keepalive is an unreliable NOOP, asking for nothing back.  A
+  reliable ping, worth its acknowledge and answer, only goes out for
+  a silent peer, or for a round-trip sample when there is none or the
+  timeout backed off since the last one.
+ */
+static void peer_idle_service(struct rudp_peer *peer, rudp_time_t now)
+{
+    if ( peer_keepalive_deadline(peer, now) > 0 )
+        return;
+
+    if ( now - RUDP_MAX(peer->last_in_time, peer->ping_time)
+             >= peer_idle_interval(peer, peer_ping_interval(peer))
+         || peer->srtt < 0 || peer->backoff != 0 )
+        peer_ping(peer);
+    else
+        peer_keepalive(peer);
+
+    peer->keepalive_spread = (uint8_t)rudp_random();
+}
+
 /* Receiver functions */
 
 static
@@ -339,24 +889,18 @@ peer_service_schedule(struct rudp_peer *peer)
     rudp_time_t timestamp = rudp_timestamp();
 
     // If nothing in sendq: reschedule service for later
-    rudp_time_t delta = peer->timeout.action;
+    rudp_time_t delta = peer_keepalive_deadline(peer, timestamp);
+    unsigned int i;
 
-    // just abuse for_each to get head, if it exists
-    struct rudp_packet_chain *head;
-    rudp_list_for_each(struct rudp_packet_chain *, head, &peer->sendq, chain_item)
-    {
-        struct rudp_packet_header *header = &head->packet->header;
+    for (i = 0; i < peer->channel_count; i++)
+        delta = peer_channel_deadline(peer, &peer->channels[i],
+                                      timestamp, delta);
 
-        if ( header->opt & RUDP_OPT_RETRANSMITTED )
-            // already transmitted head, wait for rto
-            delta = timestamp - peer->last_out_time + peer->rto;
-        else
-            // transmit asap
-            delta = 0;
+    if ( peer->pmtu.deadline != 0 )
+        delta = RUDP_MIN(delta, peer->pmtu.deadline - timestamp);
 
-        // We dont really want to iterate after head
-        break;
-    }
+    if ( peer->bundle_deadline != 0 )
+        delta = RUDP_MIN(delta, peer->bundle_deadline - timestamp);
 
     delta = RUDP_MAX(RUDP_MIN(delta, peer->abs_timeout_deadline - timestamp), 0);
 
@@ -376,13 +920,14 @@ peer_service_schedule(struct rudp_peer *peer)
 }
 
 static
-void peer_handle_connreq(
-    struct rudp_peer *peer,
-    const struct rudp_packet_header *header)
+void peer_handle_connreq(struct rudp_peer *peer)
 {
+    int conn_id = peer->in_conn_id != 0
+        && (peer->features & RUDP_FEATURE_CONN_ID);
     struct rudp_packet_chain *pc =
         rudp_packet_chain_alloc(peer->rudp,
-                                sizeof(struct rudp_packet_conn_rsp));
+                                sizeof(struct rudp_packet_conn_rsp)
+                                + (conn_id ? sizeof(uint32_t) : 0));
     struct rudp_packet_conn_rsp *response = &pc->packet->conn_rsp;
 
     memset(response, 0, sizeof(struct rudp_packet_conn_rsp));
@@ -390,111 +935,788 @@ void peer_handle_connreq(
     response->header.command = RUDP_CMD_CONN_RSP;
     response->header.segments_size = htons(1);
     response->accepted = htonl(1);
+    response->features = htonl(
+        peer->features
+        | ((uint32_t)(peer->channel_count - 1) << RUDP_FEATURE_CHANNELS_SHIFT));
+
+    if ( conn_id ) {
+        uint32_t id = htonl(peer->in_conn_id);
+        memcpy(response + 1, &id, sizeof(id));
+    }
 
     rudp_log_printf(peer->rudp, RUDP_LOG_INFO,
                     "%s answering to connreq\n", __FUNCTION__);
 
-    rudp_peer_send_unreliable(peer, pc);
+    /* Client takes our reliable sequence number from the answer,
+       fast lane or not */
+    peer_sendq_append_unreliable(peer, 0, pc, 0, 1);
+    pc->seq_reliable = peer->channels[0].out_seq_reliable;
+    peer_service_schedule(peer);
 }
 
 /*
- * Accumulate segments until one splitted message fully arrives,
- * then dispatch the callbacks
+  Keeps a reliable message, or a bundle of them, while reading is
+  paused.  A chain we own is kept as it is, others are copied.  Fails
+  only when the copy can not be allocated.
  */
-
-static void rudp_peer_handle_segment(
+static rudp_error_t peer_hold(
     struct rudp_peer *peer,
-    const struct rudp_packet_header *header,
-    struct rudp_packet_chain *pc)
+    struct rudp_packet_chain *pc,
+    int owned)
 {
-    uint16_t segments_size, segment_index;
+    struct rudp_packet_chain *copy = pc;
 
-    segment_index = ntohs(header->segment_index);
-    segments_size = ntohs(header->segments_size);
+    if ( ! owned ) {
+        copy = rudp_packet_chain_alloc(peer->rudp, pc->len);
+        if ( copy == NULL )
+            return ENOMEM;
 
-    if (segments_size == 1) {
-        peer->handler.handle_packet(peer, pc);
-        return;
+        memcpy(copy->packet, pc->packet, pc->len);
     }
 
-    if (segment_index == 0) {
-        if (peer->segments != NULL)
-            rudp_mem_free(peer->rudp, peer->segments);
+    rudp_list_append(&peer->held, &copy->chain_item);
+    peer->held_size += pc->len;
+    return 0;
+}
 
-        peer->segments = rudp_packet_chain_alloc(peer->rudp, segments_size * RUDP_RECV_BUFFER_SIZE);
-        peer->segments->len = 0;
-        peer->segments->packet->header.opt = header->opt;
-        peer->segments->packet->header.command = header->command;
+/*
+  Hands a complete message to the handler, uncompressing it first if
+  needed.  While reading is paused, reliable messages are held still
+  compressed, unreliable ones are not worth holding.  An owned chain
+  is given away.  Fails only if a message we do not own could not be
+  held, it was not handled then.
+ */
+static rudp_error_t peer_deliver(
+    struct rudp_peer *peer,
+    struct rudp_packet_chain *pc,
+    int owned)
+{
+    const struct rudp_packet_header *header = &pc->packet->header;
+    const uint8_t *data = &pc->packet->data.data[0];
+    size_t len = pc->len - sizeof(*header);
+    struct rudp_packet_chain *out;
+    uint32_t size;
+
+    if ( peer->paused ) {
+        if ( header->opt & RUDP_OPT_RELIABLE )
+            return peer_hold(peer, pc, owned);
+        goto done;
     }
 
-    memcpy(&peer->segments->packet->data.data[0] + peer->segments->len,
-            &pc->packet->data.data[0],
-            pc->len - sizeof(*header));
+    if ( !(header->opt & RUDP_OPT_COMPRESSED) ) {
+        peer->handler.handle_packet(peer, pc);
+        goto done;
+    }
 
-    peer->segments->len += pc->len - sizeof(*header);
+    if (len < sizeof(size))
+        goto malformed;
 
-    if ((segment_index + 1) == segments_size) {
-        peer->segments->len += sizeof(*header);
-        peer->handler.handle_packet(peer, peer->segments);
-        rudp_packet_chain_free(peer->rudp, peer->segments);
-        peer->segments = NULL;
-    }
-}
+    memcpy(&size, data, sizeof(size));
+    size = ntohl(size);
 
-/*
+    /* A match never expands to more than 255 bytes per input byte */
+    if (size / 255 > len)
+        goto malformed;
+
+    out = rudp_packet_chain_alloc(peer->rudp, sizeof(*header) + size);
+    if (out == NULL)
+        goto done;
+
+    out->packet->header = *header;
+    out->packet->header.opt &= ~RUDP_OPT_COMPRESSED;
+
+    if (rudp_decompress(data + sizeof(size), len - sizeof(size),
+                        &out->packet->data.data[0], size) == 0)
+        peer->handler.handle_packet(peer, out);
+    else
+        rudp_log_printf(peer->rudp, RUDP_LOG_WARN,
+                        "       malformed compressed message\n");
+
+    rudp_packet_chain_free(peer->rudp, out);
+    goto done;
+
+malformed:
+    rudp_log_printf(peer->rudp, RUDP_LOG_WARN,
+                    "       malformed compressed message\n");
+done:
+    if ( owned )
+        rudp_packet_chain_free(peer->rudp, pc);
+    return 0;
+}
+
+/*
+  Segment reassembly.  Segments are stored at fixed offsets as they
+  come, possibly out of order, and packed when the message is
+  complete.
+ */
+#define SEGMENT_STRIDE RUDP_RECV_BUFFER_SIZE
+
+static uint8_t *segment_data(struct rudp_peer_channel *channel,
+                             unsigned int index)
+{
+    return &channel->segments->packet->data.data[0]
+        + (size_t)index * SEGMENT_STRIDE;
+}
+
+/* Sizes may be unaligned, they are copied */
+static uint16_t segment_size(struct rudp_peer_channel *channel,
+                             unsigned int index)
+{
+    uint16_t size;
+
+    memcpy(&size, segment_data(channel, channel->segments_count)
+           + index * sizeof(size), sizeof(size));
+    return size;
+}
+
+static uint8_t *segment_map(struct rudp_peer_channel *channel)
+{
+    return segment_data(channel, channel->segments_count)
+        + channel->segments_count * sizeof(uint16_t);
+}
+
+static int segment_received(struct rudp_peer_channel *channel,
+                            unsigned int index)
+{
+    return segment_map(channel)[index / 8] & (1 << (index % 8));
+}
+
+static rudp_error_t peer_segments_start(
+    struct rudp_peer *peer,
+    struct rudp_peer_channel *channel,
+    const struct rudp_packet_header *header,
+    uint32_t base)
+{
+    uint16_t count = ntohs(header->segments_size);
+    size_t map_size = (count + 7) / 8;
+
+    if (channel->segments != NULL)
+        rudp_packet_chain_free(peer->rudp, channel->segments);
+
+    channel->segments = rudp_packet_chain_alloc(
+        peer->rudp,
+        sizeof(*header)
+        + (size_t)count * (SEGMENT_STRIDE + sizeof(uint16_t))
+        + map_size);
+    if (channel->segments == NULL)
+        return ENOMEM;
+
+    channel->segments->packet->header = *header;
+    channel->segments_base = base;
+    channel->segments_count = count;
+    channel->segments_received = 0;
+    channel->segments_reliable = !!(header->opt & RUDP_OPT_RELIABLE);
+    memset(segment_map(channel), 0, map_size);
+
+    return 0;
+}
+
+/*
+  Stores a segment.  A NULL data means it is already in place.
+  Returns 0 if segment was new.
+ */
+static int peer_segments_put(
+    struct rudp_peer_channel *channel,
+    unsigned int index,
+    const void *data, size_t len)
+{
+    uint16_t size = (uint16_t)len;
+
+    if (index >= channel->segments_count || len > SEGMENT_STRIDE
+        || segment_received(channel, index))
+        return -1;
+
+    if (data != NULL)
+        memcpy(segment_data(channel, index), data, len);
+
+    memcpy(segment_data(channel, channel->segments_count)
+           + index * sizeof(size), &size, sizeof(size));
+    segment_map(channel)[index / 8] |= 1 << (index % 8);
+    channel->segments_received++;
+
+    return 0;
+}
+
+/*
+  Reliable segments received ahead of sequence are taken as in
+  sequence as soon as all the ones before them are.
+ */
+static void peer_segments_advance(
+    struct rudp_peer *peer,
+    struct rudp_peer_channel *channel)
+{
+    int moved = 0;
+
+    if (channel->segments == NULL || !channel->segments_reliable)
+        return;
+
+    for (;;) {
+        uint32_t index = channel->in_seq_reliable + 1 - channel->segments_base;
+
+        if (index >= channel->segments_count
+            || !segment_received(channel, index))
+            break;
+
+        channel->in_seq_reliable++;
+        if ( !peer_unreliable_kept(peer) )
+            channel->in_seq_unreliable = 0;
+        moved = 1;
+    }
+
+    if (moved)
+        peer_post_ack(peer, channel);
+}
+
+static void peer_segments_complete(
+    struct rudp_peer *peer,
+    struct rudp_peer_channel *channel)
+{
+    struct rudp_packet_chain *pc = channel->segments;
+    uint8_t *data;
+    size_t i, len;
+
+    if (pc == NULL || channel->segments_received != channel->segments_count)
+        return;
+
+    data = &pc->packet->data.data[0];
+    len = segment_size(channel, 0);
+    for (i = 1; i < channel->segments_count; i++) {
+        size_t size = segment_size(channel, i);
+
+        memmove(data + len, segment_data(channel, i), size);
+        len += size;
+    }
+
+    pc->len = sizeof(pc->packet->header) + len;
+
+    channel->segments = NULL;
+    peer_deliver(peer, pc, 1);
+}
+
+/*
+ * Accumulate segments until one splitted message fully arrives,
+ * then dispatch the callbacks
+ */
+
+static rudp_error_t rudp_peer_handle_segment(
+    struct rudp_peer *peer,
+    struct rudp_peer_channel *channel,
+    const struct rudp_packet_info *info,
+    const struct rudp_packet_header *header,
+    struct rudp_packet_chain *pc)
+{
+    uint16_t segments_size, segment_index;
+    int reliable = !!(header->opt & RUDP_OPT_RELIABLE);
+    uint32_t base;
+
+    segment_index = ntohs(header->segment_index);
+    segments_size = ntohs(header->segments_size);
+
+    if (segments_size == 1)
+        return peer_deliver(peer, pc, 0);
+
+    base = (reliable ? info->reliable : info->unreliable) - segment_index;
+
+    if ( channel->segments == NULL
+         || channel->segments_reliable != reliable
+         || channel->segments_base != base
+         || channel->segments_count != segments_size ) {
+        /* Reliable segments received ahead are worth more than an
+           unreliable message */
+        if ( !reliable && channel->segments != NULL
+             && channel->segments_reliable )
+            return 0;
+
+        if ( peer_segments_start(peer, channel, header, base) )
+            return ENOMEM;
+    }
+
+    if ( peer_segments_put(channel, segment_index,
+                           &pc->packet->data.data[0],
+                           pc->len - sizeof(*header)) ) {
+        rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
+                        "       duplicate segment %d/%d\n",
+                        segment_index, segments_size);
+        return 0;
+    }
+
+    peer_segments_advance(peer, channel);
+    peer_segments_complete(peer, channel);
+    return 0;
+}
+
+/*
+  With FEC, reliable segments of the message following the last
+  in-sequence packet are kept when they arrive ahead of sequence, so
+  that a parity packet may fill the hole before them.
+ */
+static int peer_segment_ahead(
+    const struct rudp_peer *peer,
+    const struct rudp_peer_channel *channel,
+    const struct rudp_packet_info *info,
+    const struct rudp_packet_header *header)
+{
+    uint16_t segment_index = ntohs(header->segment_index);
+    uint16_t segments_size = ntohs(header->segments_size);
+    uint32_t base = info->reliable - segment_index;
+
+    if ( peer->state != PEER_RUN
+         || !(peer->features & RUDP_FEATURE_FEC)
+         || !(header->opt & RUDP_OPT_RELIABLE)
+         || header->command < RUDP_CMD_APP
+         || segments_size < 2 || segment_index >= segments_size
+         || (int32_t)(info->reliable - channel->in_seq_reliable) <= 1 )
+        return 0;
+
+    if ( channel->segments != NULL && channel->segments_reliable )
+        return base == channel->segments_base
+            && segments_size == channel->segments_count;
+
+    return base == channel->in_seq_reliable + 1;
+}
+
+/*
+  Rebuilds the segment missing in a group, if there is only one.
+ */
+static void peer_handle_fec(
+    struct rudp_peer *peer,
+    struct rudp_peer_channel *channel,
+    const struct rudp_packet_info *info,
+    const struct rudp_packet_chain *pc)
+{
+    const struct rudp_packet_fec *fec = &pc->packet->fec;
+    uint16_t first, count, total, missing_len;
+    size_t parity_len, len, i, j;
+    uint32_t base;
+    int missing = -1;
+    uint8_t *out;
+
+    if (pc->len < sizeof(*fec) || channel->segments == NULL)
+        return;
+
+    first = ntohs(fec->header.segment_index);
+    total = ntohs(fec->header.segments_size);
+    count = fec->count;
+    parity_len = pc->len - sizeof(*fec);
+    base = rudp_seq_expand(ntohl(fec->base), info->seq_bits,
+                           channel->segments_base);
+
+    if ( base != channel->segments_base
+         || !fec->reliable != !channel->segments_reliable
+         || total != channel->segments_count
+         || count == 0 || first + count > total )
+        return;
+
+    missing_len = ntohs(fec->size_xor);
+    for (i = first; i < first + count; i++) {
+        if (segment_received(channel, i)) {
+            missing_len ^= segment_size(channel, i);
+            continue;
+        }
+        /* More than one lost, parity can not help */
+        if (missing >= 0)
+            return;
+        missing = i;
+    }
+
+    if (missing < 0 || missing_len > parity_len)
+        return;
+
+    out = segment_data(channel, missing);
+    memcpy(out, fec->data, missing_len);
+
+    for (i = first; i < first + count; i++) {
+        const uint8_t *in = segment_data(channel, i);
+
+        if (i == (size_t)missing)
+            continue;
+
+        len = RUDP_MIN(segment_size(channel, i), missing_len);
+        for (j = 0; j < len; j++)
+            out[j] ^= in[j];
+    }
+
+    rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
+                    "       rebuilt segment %d/%d from parity\n",
+                    missing, total);
+
+    peer_segments_put(channel, missing, NULL, missing_len);
+    peer_segments_advance(peer, channel);
+    peer_segments_complete(peer, channel);
+}
+
+/*
+  Takes the reliable sequence numbers a skip packet covers as
+  received, so that the packet itself comes in sequence.  A reliable
+  message being reassembled is one of the skipped ones.
+ */
+static void peer_handle_skip(
+    struct rudp_peer *peer,
+    struct rudp_peer_channel *channel,
+    const struct rudp_packet_info *info,
+    const struct rudp_packet_chain *pc)
+{
+    uint32_t count, first;
+
+    if (pc->len < sizeof(struct rudp_packet_skip))
+        return;
+
+    count = ntohl(pc->packet->skip.count);
+    first = info->reliable - count + 1;
+
+    if ( count == 0
+         || (int32_t)(channel->in_seq_reliable + 1 - first) < 0
+         || (int32_t)(info->reliable - 1 - channel->in_seq_reliable) < 0 )
+        return;
+
+    rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
+                    "       skipping to %04x\n", info->reliable);
+
+    channel->in_seq_reliable = info->reliable - 1;
+
+    if (channel->segments != NULL && channel->segments_reliable) {
+        rudp_packet_chain_free(peer->rudp, channel->segments);
+        channel->segments = NULL;
+    }
+}
+
+/*
+  Bundle messages are handled one after the other.  Each one gets a
+  packet header of its own written just before its data, over the
+  item header and the previous messages, already handled.
+
+  A reliable bundle is held as a whole while reading is paused.  If
+  the handler pauses reading, messages left become a bundle of their
+  own, held in order.  Should it not be possible to hold them, they are
+  handled anyway rather than lost.  An owned chain is given away.
+  Fails only if a bundle we do not own could not be held, none of its
+  messages was handled then.
+ */
+static rudp_error_t peer_handle_bundle(
+    struct rudp_peer *peer,
+    struct rudp_packet_chain *pc,
+    int owned)
+{
+    const struct rudp_packet_header bundle = pc->packet->header;
+    struct rudp_packet_header header = bundle;
+    struct rudp_packet_chain message = *pc;
+    uint8_t *pos = &pc->packet->data.data[0];
+    uint8_t *end = (uint8_t *)pc->packet + pc->len;
+    int reliable = !!(bundle.opt & RUDP_OPT_RELIABLE);
+
+    if ( peer->paused && reliable )
+        return peer_hold(peer, pc, owned);
+
+    while (pos + sizeof(struct rudp_packet_bundle_item) <= end) {
+        struct rudp_packet_bundle_item *item = (void *)pos;
+        size_t size = ntohs(item->size);
+
+        if ( peer->paused ) {
+            if ( ! reliable )
+                break;
+
+            /* Handled messages make room for the bundle header */
+            message.packet = (struct rudp_packet *)(pos - sizeof(header));
+            memcpy(&message.packet->header, &bundle, sizeof(bundle));
+            message.len = sizeof(bundle) + (end - pos);
+
+            /* Owned bundles come from the held list, rest goes back
+               ahead of it */
+            if ( owned ) {
+                pc->packet = message.packet;
+                pc->len = message.len;
+                rudp_list_insert(&peer->held, &pc->chain_item);
+                peer->held_size += pc->len;
+                return 0;
+            }
+            if ( peer_hold(peer, &message, 0) == 0 )
+                return 0;
+        }
+
+        if (item->data + size > end || item->command < RUDP_CMD_APP) {
+            rudp_log_printf(peer->rudp, RUDP_LOG_WARN,
+                            "       malformed bundle\n");
+            break;
+        }
+
+        header.command = item->command;
+        pos = item->data + size;
+
+        message.packet = (struct rudp_packet *)(item->data - sizeof(header));
+        memcpy(&message.packet->header, &header, sizeof(header));
+        message.len = sizeof(header) + size;
+
+        peer->handler.handle_packet(peer, &message);
+    }
+
+    if ( owned )
+        rudp_packet_chain_free(peer->rudp, pc);
+    return 0;
+}
+
+/*
+  Connection request is replaced by one carrying the cookie, with
+  the same sequence number, and sent right away.  A forged cookie
+  only makes the server send another one.  Server dropped the
+  messages sent along with the first request, they go again right
+  after this one.
+ */
+static void peer_handle_cookie(struct rudp_peer *peer,
+                               const struct rudp_packet_chain *pc)
+{
+    struct rudp_peer_channel *channel = &peer->channels[0];
+    struct rudp_packet_chain *old, *req, *early;
+    unsigned int i;
+
+    if ( rudp_list_empty(&channel->sendq) )
+        return;
+
+    old = __container_of(channel->sendq.next,
+                         struct rudp_packet_chain *, chain_item);
+    if ( old->packet->header.command != RUDP_CMD_CONN_REQ )
+        return;
+
+    req = rudp_packet_chain_alloc(
+        peer->rudp, sizeof(struct rudp_packet_conn_req) + RUDP_COOKIE_SIZE);
+    if ( req == NULL )
+        return;
+
+    memcpy(req->packet, old->packet, sizeof(struct rudp_packet_conn_req));
+    memcpy(&req->packet->conn_req + 1, pc->packet->cookie.cookie,
+           RUDP_COOKIE_SIZE);
+    req->seq_reliable = old->seq_reliable;
+    req->seq_unreliable = old->seq_unreliable;
+
+    rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
+                    "%s connection request with cookie\n", __FUNCTION__);
+
+    /* Appending to an item inserts before it */
+    rudp_list_append(&old->chain_item, &req->chain_item);
+    rudp_list_remove(&old->chain_item);
+    rudp_packet_chain_free(peer->rudp, old);
+
+    for (i = 0; i < peer->channel_count; i++)
+        rudp_list_for_each(struct rudp_packet_chain *, early, &peer->channels[i].sendq, chain_item)
+            early->packet->header.opt &= ~RUDP_OPT_RETRANSMITTED;
+    peer->flight = 0;
+}
+
+/*
+  Keeps the features and channels of the remote mask we support as
+  well.  Channels above the agreed count are emptied.
+ */
+static void peer_agree(struct rudp_peer *peer, uint32_t remote)
+{
+    unsigned int channels =
+        ((remote & RUDP_FEATURE_CHANNELS_MASK) >> RUDP_FEATURE_CHANNELS_SHIFT) + 1;
+    unsigned int i;
+
+    peer->features = remote & peer->rudp->features & RUDP_FEATURE_ALL;
+    peer->channel_count = RUDP_MIN(channels, peer->channel_max);
+
+    for (i = peer->channel_count; i < peer->channel_max; i++)
+        peer_channel_flush(peer, &peer->channels[i]);
+}
+
+/*
+  Handshake packet on channel 0 has sequence number seq.  Other
+  channels of the remote side started from the same initial value
+  and did not send anything yet.
+ */
+static void peer_handshake_seq(struct rudp_peer *peer,
+                               uint32_t seq, uint32_t initial)
+{
+    unsigned int i;
+
+    peer->channels[0].in_seq_reliable = seq;
+    for (i = 1; i < peer->channel_count; i++)
+        peer->channels[i].in_seq_reliable = initial;
+}
+
+/*
   - socket watcher
      - endpoint packet reader
         - server packet handler
            - peer packet handler <===
+
+  A packet from another address than the peer one is given with its
+  source in from.  Peer moves there if the packet is new and in
+  sequence, a replay of an older one is not enough.
  */
-rudp_error_t rudp_peer_incoming_packet(
-    struct rudp_peer *peer, struct rudp_packet_chain *pc)
+static rudp_error_t peer_incoming_packet(
+    struct rudp_peer *peer, struct rudp_packet_chain *pc,
+    const struct sockaddr_storage *from)
 {
-    const struct rudp_packet_header *header = &pc->packet->header;
+    const struct rudp_packet_header *header;
+    struct rudp_peer_channel *channel;
+    struct rudp_packet_info info;
     struct rudp_base *rudp;
+    size_t header_size;
+    int handshake;
+
+    header_size = rudp_packet_header_decode(&info, pc->packet, pc->len);
+    if ( header_size == 0 ) {
+        rudp_log_printf(peer->rudp, RUDP_LOG_WARN,
+                        "<<< incoming malformed packet, ignored\n");
+        return EINVAL;
+    }
+
+    if ( info.channel >= peer->channel_count ) {
+        rudp_log_printf(peer->rudp, RUDP_LOG_WARN,
+                        "<<< incoming packet on channel %d, ignored\n",
+                        info.channel);
+        return EINVAL;
+    }
+
+    channel = &peer->channels[info.channel];
+
+    /*
+      Handshake packets carry the initial sequence numbers, they are
+      taken as they are.  Other sequence numbers are expanded to the
+      closest value of our own counters.
+     */
+    handshake = info.channel == 0
+        && ((peer->state == PEER_NEW
+             && info.command == RUDP_CMD_CONN_REQ)
+            || (peer->state == PEER_CONNECTING
+                && info.command == RUDP_CMD_CONN_RSP));
+
+    info.reliable_ack = rudp_seq_expand(info.reliable_ack, info.ack_bits,
+                                        channel->out_seq_acked);
+    if ( ! handshake ) {
+        info.reliable = rudp_seq_expand(info.reliable, info.reliable_bits,
+                                        channel->in_seq_reliable);
+        info.unreliable = rudp_seq_expand(info.unreliable,
+                                          info.unreliable_bits,
+                                          channel->in_seq_unreliable);
+    }
+
+    rudp_packet_chain_canonicalize(pc, &info, header_size);
+    header = &pc->packet->header;
 
     rudp_log_printf(peer->rudp, RUDP_LOG_IO,
-                    "<<< incoming [%d] %s %s (%d) %04x:%04x\n",
+                    "<<< incoming [%d] %s %s (%d) %d/%04x:%04x\n",
                     peer->state,
                     (header->opt & RUDP_OPT_RELIABLE)
                         ? "reliable" : "unreliable",
                     rudp_command_name(header->command), header->command,
-                    ntohs(header->reliable), ntohs(header->unreliable));
+                    info.channel, info.reliable, info.unreliable);
 
     if ( header->opt & RUDP_OPT_ACK ) {
         rudp_log_printf(peer->rudp, RUDP_LOG_IO,
                         "    has ACK flag, %04x\n",
-                        (int)ntohs(header->reliable_ack));
-        int broken = peer_handle_ack(peer, ntohs(header->reliable_ack));
+                        info.reliable_ack);
+        int broken = peer_handle_ack(peer, channel, info.reliable_ack,
+                                     info.ts_val ? info.ts_ecr : 0);
         if ( broken ) {
             rudp_log_printf(peer->rudp, RUDP_LOG_WARN,
                             "    broken ACK flag, ignoring packet\n");
             return EINVAL;
         }
+
+        if ( info.has_window && (peer->features & RUDP_FEATURE_WINDOW) )
+            peer->send_window = info.window;
+        peer_window_changed(peer);
+    }
+
+    if ( header->command == RUDP_CMD_PMTU_PROBE
+         || header->command == RUDP_CMD_PMTU_ACK ) {
+        /* Probes take no sequence number, they are handled as soon as
+           they arrive. */
+        if ( peer->state == PEER_RUN )
+            peer_handle_pmtu(peer, pc);
+        return peer_service_schedule(peer);
+    }
+
+    if ( header->command == RUDP_CMD_PATH_CHALLENGE
+         || header->command == RUDP_CMD_PATH_RESPONSE ) {
+        /* Challenges take no sequence number either, the one we sent
+           may come back from another address than the peer one */
+        if ( peer->state == PEER_RUN
+             && (peer->features & RUDP_FEATURE_CONN_ID) )
+            peer_handle_path(peer, pc, from);
+        return peer_service_schedule(peer);
+    }
+
+    if ( header->command == RUDP_CMD_FEC ) {
+        /* Parity may fill the hole that makes following packets
+           unsequenced, it is handled whatever its sequence numbers. */
+        if ( info.ts_val != 0 )
+            channel->ts_recent = info.ts_val;
+        if ( peer->state == PEER_RUN )
+            peer_handle_fec(peer, channel, &info, pc);
+        return peer_service_schedule(peer);
+    }
+
+    if ( header->command == RUDP_CMD_COOKIE ) {
+        /* Server keeps no state for us yet, cookie is out of any
+           sequence. */
+        if ( peer->state == PEER_CONNECTING
+             && (peer->rudp->features & RUDP_FEATURE_COOKIE)
+             && pc->len == sizeof(struct rudp_packet_cookie) )
+            peer_handle_cookie(peer, pc);
+        return peer_service_schedule(peer);
+    }
+
+    if ( header->command == RUDP_CMD_SKIP
+         && (header->opt & RUDP_OPT_RELIABLE)
+         && peer->state == PEER_RUN )
+        peer_handle_skip(peer, channel, &info, pc);
+
+    if ( peer_window_full(peer, channel, &info, header) ) {
+        rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
+                        "       receive window full, packet refused\n");
+        peer->last_in_time = rudp_timestamp();
+        peer->abs_timeout_deadline = peer->last_in_time + peer->timeout.drop;
+        if ( peer->features & RUDP_FEATURE_WINDOW )
+            peer_post_ack(peer, channel);
+        return peer_service_schedule(peer);
     }
 
     enum packet_state state;
 
-    if ( header->opt & RUDP_OPT_RELIABLE )
-        state = peer_analyse_reliable(peer, ntohs(header->reliable));
+    if ( handshake )
+        state = UNSEQUENCED;
+    else if ( header->opt & RUDP_OPT_RELIABLE )
+        state = peer_analyse_reliable(peer, channel, info.reliable);
     else
-        state = peer_analyse_unreliable(peer, ntohs(header->reliable),
-                                        ntohs(header->unreliable));
+        state = peer_analyse_unreliable(peer, channel, header->opt,
+                                        info.reliable,
+                                        info.unreliable);
+
+    /* Echo the timestamp of the last new reliable packet, the one
+       acknowledges are sent for, even if it was held for reordering. */
+    if ( (header->opt & RUDP_OPT_RELIABLE) && state != RETRANSMITTED
+         && info.ts_val != 0 )
+        channel->ts_recent = info.ts_val;
 
     switch ( state ) {
     case UNSEQUENCED:
-        if (peer->state == PEER_NEW
-            && header->command == RUDP_CMD_CONN_REQ) {
+        if (handshake && header->command == RUDP_CMD_CONN_REQ) {
             // Server side, handling new client
-            peer_handle_connreq(peer, header);
-            peer->in_seq_reliable = ntohs(header->reliable);
+            peer_agree(peer, pc->len >= sizeof(struct rudp_packet_conn_req)
+                       ? ntohl(pc->packet->conn_req.data) : 0);
+            peer_handle_connreq(peer);
+            peer_handshake_seq(peer, info.reliable, info.reliable - 1);
             peer->state = PEER_RUN;
-        } else if (peer->state == PEER_CONNECTING
-                   && header->command == RUDP_CMD_CONN_RSP) {
+            peer_pmtu_start(peer);
+        } else if (handshake && header->command == RUDP_CMD_CONN_RSP) {
             // Client side, handling new server
-            peer->in_seq_reliable = ntohs(header->reliable);
-            peer_handle_ack(peer, ntohs(header->reliable_ack));
+            peer_agree(peer, pc->len >= sizeof(struct rudp_packet_conn_rsp)
+                       ? ntohl(pc->packet->conn_rsp.features) : 0);
+            if ( (peer->features & RUDP_FEATURE_CONN_ID)
+                 && pc->len >= sizeof(struct rudp_packet_conn_rsp)
+                               + sizeof(uint32_t) ) {
+                uint32_t id;
+                memcpy(&id, &pc->packet->conn_rsp + 1, sizeof(id));
+                peer->out_conn_id = ntohl(id);
+            }
+            peer_handshake_seq(peer, info.reliable, info.reliable);
+            peer_handle_ack(peer, channel, info.reliable_ack, 0);
             peer->state = PEER_RUN;
+            peer_pmtu_start(peer);
+        } else if ( peer_segment_ahead(peer, channel, &info, header) ) {
+            rudp_peer_handle_segment(peer, channel, &info, header, pc);
         } else {
             rudp_log_printf(peer->rudp, RUDP_LOG_WARN,
                             "    unsequenced packet in state %d, ignored\n",
@@ -503,11 +1725,16 @@ rudp_error_t rudp_peer_incoming_packet(
         break;
 
     case RETRANSMITTED:
-        peer->abs_timeout_deadline = rudp_timestamp() + peer->timeout.drop;
+        peer->last_in_time = rudp_timestamp();
+        peer->abs_timeout_deadline = peer->last_in_time + peer->timeout.drop;
         break;
 
     case SEQUENCED:
-        peer->abs_timeout_deadline = rudp_timestamp() + peer->timeout.drop;
+        peer->last_in_time = rudp_timestamp();
+        peer->abs_timeout_deadline = peer->last_in_time + peer->timeout.drop;
+
+        if ( from != NULL && (header->opt & RUDP_OPT_RELIABLE) )
+            peer_path_challenge(peer, from);
 
         switch ( header->command )
         {
@@ -545,7 +1772,24 @@ rudp_error_t rudp_peer_incoming_packet(
             }
             break;
 
+        case RUDP_CMD_BUNDLE:
+            if ( peer->state != PEER_RUN )
+                rudp_log_printf(peer->rudp, RUDP_LOG_WARN,
+                                "       bundle while not running\n");
+            else if ( peer_handle_bundle(peer, pc, 0) )
+                goto refused;
+            break;
+
+        case RUDP_CMD_TOKEN:
+            if ( pc->len == sizeof(struct rudp_packet_token) ) {
+                memcpy(peer->token, pc->packet->token.token,
+                       RUDP_TOKEN_SIZE);
+                peer->token_valid = 1;
+            }
+            break;
+
         case RUDP_CMD_NOOP:
+        case RUDP_CMD_SKIP:
         case RUDP_CMD_CONN_REQ:
         case RUDP_CMD_CONN_RSP:
              break;
@@ -557,51 +1801,142 @@ rudp_error_t rudp_peer_incoming_packet(
                 break;
             }
 
-            if ( header->command >= RUDP_CMD_APP ){
-                rudp_peer_handle_segment(peer,header,pc);
-            }
+            if ( header->command >= RUDP_CMD_APP
+                 && rudp_peer_handle_segment(peer, channel, &info,
+                                             header, pc)
+                 && (header->opt & RUDP_OPT_RELIABLE) )
+                goto refused;
         }
     }
 
     if ( header->opt & RUDP_OPT_RELIABLE ) {
         rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
                         "       reliable packet, posting ack\n");
-        peer_post_ack(peer);
+        peer_post_ack(peer, channel);
     }
 
     return peer_service_schedule(peer);
-}
 
+refused:
+    /* Out of memory to keep it, packet is taken as never received
+       and is not acknowledged, peer sends it again */
+    rudp_log_printf(peer->rudp, RUDP_LOG_WARN,
+                    "       no memory for reliable packet, refused\n");
+    channel->in_seq_reliable = info.reliable - 1;
+    return peer_service_schedule(peer);
+}
 
-/* Ack handling function */
-
+rudp_error_t rudp_peer_incoming_packet(
+    struct rudp_peer *peer, struct rudp_packet_chain *pc)
+{
+    return peer_incoming_packet(peer, pc, NULL);
+}
 
-static
-int peer_handle_ack(struct rudp_peer *peer, uint16_t ack)
+rudp_error_t rudp_peer_incoming_packet_from(
+    struct rudp_peer *peer, struct rudp_packet_chain *pc,
+    const struct sockaddr_storage *from)
 {
-    struct rudp_link_info link_info;
-    int16_t ack_delta = (ack - peer->out_seq_acked);
-    int16_t adv_delta = (ack - peer->out_seq_reliable);
+    if ( ! rudp_peer_address_compare(peer, from) )
+        from = NULL;
 
-    if ( ack_delta < 0 )
-        // ack in past
-        return 0;
+    return peer_incoming_packet(peer, pc, from);
+}
 
-    if ( adv_delta > 0 )
-        // packet acking an unsent seq no -- broken packet
-        return 1;
 
-    rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
+/* Ack handling function */
+
+/*
+  Time-based loss detection, in the spirit of RACK (RFC 8985).  Peer
+  got a packet sent at delivered, a packet still unacknowledged that
+  was sent before it is lost once it is older than a round trip and a
+  reordering allowance of a quarter of it.  Lost packets go out again
+  on next service.
+ */
+static void peer_detect_loss(struct rudp_peer *peer,
+                             struct rudp_peer_channel *channel,
+                             uint32_t delivered)
+{
+    rudp_time_t now = rudp_timestamp();
+    rudp_time_t rtt = RUDP_MAX(peer->srtt, 0);
+    struct rudp_packet_chain *pc;
+
+    rudp_list_for_each(struct rudp_packet_chain *, pc, &channel->sendq, chain_item)
+    {
+        const struct rudp_packet_header *header = &pc->packet->header;
+
+        if ( ! (header->opt & RUDP_OPT_RELIABLE)
+             || ! (header->opt & RUDP_OPT_RETRANSMITTED) )
+            continue;
+
+        /* A packet sent in the same millisecond as the delivered one
+           may have been sent after it */
+        if ( (int32_t)(delivered - (uint32_t)pc->sent_time) <= 0 ) {
+            /* Queue is in first transmission order */
+            if ( pc->retransmits == 0 )
+                break;
+            continue;
+        }
+
+        if ( pc->lost || now - pc->sent_time < rtt + rtt / 4 )
+            continue;
+
+        rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
+                        "%s %d/%04x lost\n", __FUNCTION__,
+                        header->channel, pc->seq_reliable);
+
+        pc->lost = 1;
+        channel->lost = 1;
+    }
+}
+
+/*
+  Every acknowledge of new packets is a round-trip time sample.  An
+  echoed timestamp tells when the packet that triggered it was sent,
+  whether it was a retransmission or not.  Otherwise, Karn's rule
+  applies: only a packet sent once tells, the last one acked being
+  the most recent.
+ */
+static void peer_ack_rtt(struct rudp_peer *peer,
+                         rudp_time_t sent_time, uint32_t ts_ecr)
+{
+    rudp_time_t now = rudp_timestamp();
+
+    if ( ts_ecr != 0 )
+        peer_update_rtt(peer, (int32_t)((uint32_t)now - ts_ecr));
+    else if ( sent_time != 0 )
+        peer_update_rtt(peer, now - sent_time);
+}
+
+static
+int peer_handle_ack(struct rudp_peer *peer,
+                    struct rudp_peer_channel *channel, uint32_t ack,
+                    uint32_t ts_ecr)
+{
+    struct rudp_link_info link_info;
+    int32_t ack_delta = (ack - channel->out_seq_acked);
+    int32_t adv_delta = (ack - channel->out_seq_reliable);
+    rudp_time_t sent_time = 0, last_sent = 0;
+    int acked = 0;
+
+    if ( ack_delta < 0 )
+        // ack in past
+        return 0;
+
+    if ( adv_delta > 0 )
+        // packet acking an unsent seq no -- broken packet
+        return 1;
+
+    rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
                     "%s acked seqno is now %04x\n", __FUNCTION__, ack);
 
-    peer->out_seq_acked = ack;
+    channel->out_seq_acked = ack;
 
     struct rudp_packet_chain *pc, *tmp;
-    rudp_list_for_each_safe(struct rudp_packet_chain *, pc, tmp, &peer->sendq, chain_item)
+    rudp_list_for_each_safe(struct rudp_packet_chain *, pc, tmp, &channel->sendq, chain_item)
     {
         struct rudp_packet_header *header = &pc->packet->header;
-        uint16_t seqno = ntohs(header->reliable);
-        int16_t delta = (seqno - ack);
+        uint32_t seqno = pc->seq_reliable;
+        int32_t delta = (seqno - ack);
 
         // not transmitted yet:
         // - unreliable packets, if they are still here
@@ -616,303 +1951,1611 @@ int peer_handle_ack(struct rudp_peer *peer, uint16_t ack)
                         __FUNCTION__,
                         ack, seqno, delta, delta > 0 ? "no": "yes");
 
-        if ( delta > 0 )
-            break;
+        if ( delta > 0 )
+            break;
+
+        sent_time = pc->retransmits == 0 ? pc->sent_time : 0;
+        last_sent = pc->sent_time;
+        acked = 1;
+
+        link_info.acked = seqno;
+        peer->handler.link_info(peer, &link_info);
+
+        peer_sendq_free(peer, pc);
+    }
+
+    if ( acked ) {
+        peer_ack_rtt(peer, sent_time, ts_ecr);
+        channel->probed = 0;
+    }
+
+    /*
+      Echoed timestamp tells about the newest packet the peer got, even
+      if it was out of sequence and the ack did not move.  Without it,
+      the last packet acked tells, or failing that, the peer sent this
+      acknowledge half a round trip ago, so it got what was sent a
+      round trip ago.
+     */
+    if ( ts_ecr != 0 )
+        peer_detect_loss(peer, channel, ts_ecr);
+    else if ( acked )
+        peer_detect_loss(peer, channel, (uint32_t)last_sent);
+    else if ( peer->srtt >= 0 )
+        peer_detect_loss(peer, channel,
+                         (uint32_t)(rudp_timestamp() - peer->srtt));
+
+    rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
+                    "%s left in queue:\n",
+                    __FUNCTION__);
+    rudp_list_for_each(struct rudp_packet_chain *, pc, &channel->sendq, chain_item) {
+        rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
+                        "%s   - %04x:%04x\n",
+                        __FUNCTION__,
+                        pc->seq_reliable,
+                        pc->seq_unreliable);
+    }
+    rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
+                    "%s ---\n",
+                    __FUNCTION__);
+
+    return 0;
+}
+
+
+/*
+  Tells whether a packet of the channel goes out on next service,
+  without waiting for a retransmission timeout.
+ */
+static int peer_channel_sending(struct rudp_peer_channel *channel)
+{
+    const struct rudp_packet_chain *last;
+
+    if ( ! rudp_list_empty(&channel->unreliable_sendq) || channel->lost )
+        return 1;
+
+    if ( rudp_list_empty(&channel->sendq) )
+        return 0;
+
+    /* New packets are queued last */
+    last = __container_of(channel->sendq.prev,
+                          const struct rudp_packet_chain *, chain_item);
+    return !(last->packet->header.opt & RUDP_OPT_RETRANSMITTED)
+        && ! channel->blocked;
+}
+
+/*
+  Ack field is present in all headers.  Therefore any packet can be an
+  ack.  If the send queue is empty, we cant afford to wait for a new
+  one, so we send a new NOOP.  In the fast lane, the NOOP does not
+  wait for a retransmitted packet either.
+ */
+static
+void peer_post_ack(struct rudp_peer *peer, struct rudp_peer_channel *channel)
+{
+    channel->must_ack = 1;
+
+    if ( (peer->features & RUDP_FEATURE_FAST_LANE)
+         ? peer_channel_sending(channel)
+         : ! rudp_list_empty(&channel->sendq) ) {
+        return;
+    }
+
+    struct rudp_packet_chain *pc = rudp_packet_chain_alloc(
+        peer->rudp, sizeof(struct rudp_packet_header));
+    struct rudp_packet_header *header = &pc->packet->header;
+
+    rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
+                    "%s pushing NOOP ACK\n", __FUNCTION__);
+
+    header->command = RUDP_CMD_NOOP;
+
+    peer_sendq_append_unreliable(peer, channel - peer->channels, pc, 0, 1);
+    peer_service_schedule(peer);
+}
+
+
+/* Sender functions */
+
+/*
+  Queue of unreliable packets.  In the fast lane, they follow the
+  last acknowledged reliable packet and are sent apart.
+ */
+static struct rudp_list *
+peer_unreliable_queue(const struct rudp_peer *peer,
+                      struct rudp_peer_channel *channel)
+{
+    if (peer->features & RUDP_FEATURE_FAST_LANE)
+        return &channel->unreliable_sendq;
+    return &channel->sendq;
+}
+
+/*
+  Delivery flags of an unreliable application packet of the channel.
+ */
+static uint8_t
+peer_delivery_opt(const struct rudp_peer *peer,
+                  const struct rudp_peer_channel *channel, uint8_t command)
+{
+    if ( !(peer->features & RUDP_FEATURE_DELIVERY)
+         || (command < RUDP_CMD_APP && command != RUDP_CMD_BUNDLE) )
+        return 0;
+
+    switch ( channel->delivery ) {
+    case RUDP_DELIVERY_SEQUENCED:
+        return RUDP_OPT_SEQUENCED;
+    case RUDP_DELIVERY_UNORDERED:
+        return RUDP_OPT_UNORDERED;
+    default:
+        return 0;
+    }
+}
+
+static void
+peer_sendq_append_unreliable(struct rudp_peer *peer, unsigned int channel,
+        struct rudp_packet_chain *pc, size_t index, size_t length)
+{
+    struct rudp_peer_channel *ch = &peer->channels[channel];
+
+    pc->packet->header.version = RUDP_VERSION;
+    pc->packet->header.opt = peer_delivery_opt(peer, ch,
+                                               pc->packet->header.command);
+    pc->packet->header.channel = channel;
+    pc->packet->header.segment_index = htons((unsigned int)index);
+    pc->packet->header.segments_size = htons((unsigned int)length);
+    pc->seq_reliable = (peer->features & RUDP_FEATURE_FAST_LANE)
+        ? ch->out_seq_acked : ch->out_seq_reliable;
+    pc->seq_unreliable = ++(ch->out_seq_unreliable);
+
+    rudp_log_printf(peer->rudp, RUDP_LOG_IO,
+                    ">>> outgoing unreliable %s (%d) %d/%04x:%04x\n",
+                    rudp_command_name(pc->packet->header.command),
+                    pc->packet->header.command, channel,
+                    pc->seq_reliable, pc->seq_unreliable);
+
+    rudp_list_append(peer_unreliable_queue(peer, ch), &pc->chain_item);
+}
+
+static void
+peer_sendq_append_reliable(struct rudp_peer *peer, unsigned int channel,
+        struct rudp_packet_chain *pc, size_t index, size_t length)
+{
+    struct rudp_peer_channel *ch = &peer->channels[channel];
+
+    if ( !peer_unreliable_kept(peer) )
+        ch->out_seq_unreliable = 0;
+
+    pc->packet->header.version = RUDP_VERSION;
+    pc->packet->header.opt = RUDP_OPT_RELIABLE;
+    pc->packet->header.channel = channel;
+    pc->packet->header.segment_index = htons((unsigned int)index);
+    pc->packet->header.segments_size = htons((unsigned int)length);
+    pc->seq_reliable = ++(ch->out_seq_reliable);
+    pc->seq_unreliable = 0;
+
+    rudp_log_printf(peer->rudp, RUDP_LOG_IO,
+                    ">>> outgoing reliable %s (%d) %d/%04x:%04x\n",
+                    rudp_command_name(pc->packet->header.command),
+                    pc->packet->header.command, channel,
+                    pc->seq_reliable, pc->seq_unreliable);
+
+    rudp_list_append(&ch->sendq, &pc->chain_item);
+}
+
+static int peer_bundling(const struct rudp_peer *peer)
+{
+    return peer->rudp->bundle_delay > 0
+        && (peer->features & RUDP_FEATURE_BUNDLE);
+}
+
+/*
+  Queues the bundle being filled on a channel.  A bundle holding a
+  single message is sent as a plain data packet.
+ */
+static void peer_bundle_close(struct rudp_peer *peer, unsigned int channel)
+{
+    struct rudp_peer_channel *ch = &peer->channels[channel];
+    struct rudp_packet_chain *pc = ch->bundle;
+    struct rudp_packet_bundle_item *item;
+    size_t size;
+
+    if (pc == NULL)
+        return;
+
+    ch->bundle = NULL;
+
+    item = (struct rudp_packet_bundle_item *)&pc->packet->data.data[0];
+    size = ntohs(item->size);
+    if (sizeof(struct rudp_packet_header) + sizeof(*item) + size == pc->len) {
+        pc->packet->header.command = item->command;
+        memmove(item, item->data, size);
+        pc->len -= sizeof(*item);
+    }
+
+    if (ch->bundle_reliable)
+        peer_sendq_append_reliable(peer, channel, pc, 0, 1);
+    else
+        peer_sendq_append_unreliable(peer, channel, pc, 0, 1);
+}
+
+static void peer_bundle_flush(struct rudp_peer *peer)
+{
+    unsigned int i;
+
+    for (i = 0; i < peer->channel_count; i++)
+        peer_bundle_close(peer, i);
+
+    peer->bundle_deadline = 0;
+}
+
+/*
+  Adds a message to the bundle of a channel.  Bundle is closed
+  whenever the message does not fit or has another reliability, it
+  is sent at last when bundle deadline of the peer expires.
+ */
+static rudp_error_t
+peer_bundle_add(struct rudp_peer *peer, unsigned int channel,
+        int reliable, int command, const void *data, const size_t size)
+{
+    struct rudp_peer_channel *ch = &peer->channels[channel];
+    struct rudp_packet_bundle_item *item;
+    size_t header_size = sizeof(struct rudp_packet_header);
+    size_t item_size = sizeof(*item) + size;
+    size_t max_len = header_size + peer->mtu - RUDP_PACKET_HEADER_MAX;
+
+    if ( ch->bundle != NULL
+         && (ch->bundle_reliable != !!reliable
+             || ch->bundle->len + item_size
+                > RUDP_MIN(ch->bundle->alloc_size, max_len)) )
+        peer_bundle_close(peer, channel);
+
+    if (ch->bundle == NULL) {
+        ch->bundle = rudp_packet_chain_alloc(peer->rudp, max_len);
+        if (ch->bundle == NULL)
+            return ENOMEM;
+        ch->bundle->len = header_size;
+        ch->bundle->packet->header.command = RUDP_CMD_BUNDLE;
+        ch->bundle_reliable = !!reliable;
+
+        if (peer->bundle_deadline == 0)
+            peer->bundle_deadline = rudp_timestamp() + peer->rudp->bundle_delay;
+    }
+
+    item = (struct rudp_packet_bundle_item *)
+        ((uint8_t *)ch->bundle->packet + ch->bundle->len);
+    item->command = RUDP_CMD_APP + command;
+    item->size = htons((uint16_t)size);
+    memcpy(item->data, data, size);
+    ch->bundle->len += item_size;
+
+    if ( ch->bundle->len + sizeof(*item) + 1
+         > RUDP_MIN(ch->bundle->alloc_size, max_len) )
+        peer_bundle_close(peer, channel);
+
+    return peer_service_schedule(peer);
+}
+
+/*
+  Forward error correction.  A parity packet covers up to fec_group
+  consecutive segments of a message.  It takes no sequence number,
+  so that unreliable segments keep consecutive ones, and is one
+  parity header larger than the segments it covers.
+ */
+#define FEC_OVERHEAD \
+    (sizeof(struct rudp_packet_fec) - sizeof(struct rudp_packet_header))
+
+static size_t peer_fec_max_segment(const struct rudp_peer *peer)
+{
+    return peer->mtu - RUDP_PACKET_HEADER_MAX - FEC_OVERHEAD;
+}
+
+static struct rudp_packet_chain *
+peer_fec_open(struct rudp_peer *peer, const struct rudp_packet_chain *first)
+{
+    const struct rudp_packet_header *header = &first->packet->header;
+    size_t capacity = peer_fec_max_segment(peer);
+    struct rudp_packet_chain *pc;
+    struct rudp_packet_fec *fec;
+    int reliable = !!(header->opt & RUDP_OPT_RELIABLE);
+    uint32_t seq = reliable ? first->seq_reliable : first->seq_unreliable;
+
+    pc = rudp_packet_chain_alloc(peer->rudp, sizeof(*fec) + capacity);
+    if (pc == NULL)
+        return NULL;
+
+    fec = &pc->packet->fec;
+    memset(fec, 0, sizeof(*fec) + capacity);
+    fec->header.version = RUDP_VERSION;
+    fec->header.command = RUDP_CMD_FEC;
+    fec->header.channel = header->channel;
+    fec->header.segment_index = header->segment_index;
+    fec->header.segments_size = header->segments_size;
+    fec->base = htonl(seq - ntohs(header->segment_index));
+    fec->reliable = reliable;
+    pc->len = sizeof(*fec);
+
+    return pc;
+}
+
+/*
+  Adds a queued segment to the parity of its group, opened on first
+  segment of the group.  Parity is queued once the group is
+  complete.  Groups with segments too large for parity to fit in the
+  path MTU get none.
+ */
+static rudp_error_t
+peer_fec_segment(struct rudp_peer *peer, struct rudp_packet_chain **parity,
+        const struct rudp_packet_chain *pc, const uint8_t *data, size_t len)
+{
+    const struct rudp_packet_header *header = &pc->packet->header;
+    struct rudp_peer_channel *channel = &peer->channels[header->channel];
+    struct rudp_packet_fec *fec;
+    size_t i;
+
+    if (*parity == NULL) {
+        *parity = peer_fec_open(peer, pc);
+        if (*parity == NULL)
+            return ENOMEM;
+    }
+
+    fec = &(*parity)->packet->fec;
+
+    /* Marks the group as having no parity */
+    if (len > peer_fec_max_segment(peer))
+        fec->reliable = 0xff;
+
+    if (fec->reliable != 0xff) {
+        for (i = 0; i < len; i++)
+            fec->data[i] ^= data[i];
+        fec->size_xor ^= htons((uint16_t)len);
+        (*parity)->len = RUDP_MAX((*parity)->len, sizeof(*fec) + len);
+    }
+
+    if (++fec->count < peer->fec_group
+        && ntohs(header->segment_index) + 1 < ntohs(header->segments_size))
+        return 0;
+
+    if (fec->reliable == 0xff) {
+        rudp_packet_chain_free(peer->rudp, *parity);
+    } else {
+        (*parity)->seq_reliable = channel->out_seq_reliable;
+        (*parity)->seq_unreliable = channel->out_seq_unreliable;
+        rudp_list_append(fec->reliable
+                         ? &channel->sendq
+                         : peer_unreliable_queue(peer, channel),
+                         &(*parity)->chain_item);
+    }
+    *parity = NULL;
+
+    return 0;
+}
+
+static int peer_fec_enabled(const struct rudp_peer *peer, size_t segments)
+{
+    return segments > 1 && peer->fec_group
+        && (peer->features & RUDP_FEATURE_FEC);
+}
+
+/*
+  Splits a message in segments and queues them.  If payload is set,
+  segments reference slices of it instead of holding a copy of data.
+  Reliable segments get the expiry limits of the message.  Out of
+  memory, nothing of the message is queued.
+ */
+static rudp_error_t
+peer_queue_segments(struct rudp_peer *peer, unsigned int channel,
+        int reliable, uint8_t opt, int command,
+        const void *data, struct rudp_payload *payload, const size_t size,
+        rudp_time_t deadline, uint16_t retransmit_max)
+{
+    struct rudp_peer_channel *ch = &peer->channels[channel];
+    struct rudp_list *queue = reliable
+        ? &ch->sendq : peer_unreliable_queue(peer, ch);
+    /* Restored if the message can not be queued whole */
+    struct rudp_list *last = queue->prev;
+    uint32_t out_seq_reliable = ch->out_seq_reliable;
+    uint32_t out_seq_unreliable = ch->out_seq_unreliable;
+    struct rudp_packet_chain *pc, *parity = NULL;
+    size_t written, to_write;
+    size_t header_size = sizeof(struct rudp_packet_header);
+    /* Header format may change before segments are sent, size them
+       for the largest one. */
+    size_t max_write = peer->mtu - RUDP_PACKET_HEADER_MAX;
+    size_t segments = (size / max_write) + ((size % max_write) != 0);
+    size_t segment;
+    int fec = 0;
+
+    if ( peer_fec_enabled(peer, segments) ) {
+        fec = 1;
+        max_write = peer_fec_max_segment(peer);
+        segments = (size / max_write) + ((size % max_write) != 0);
+    }
+
+    written = 0;
+    for (segment = 0; segment < segments; segment++) {
+        to_write = RUDP_MIN(size - written, max_write);
+        if (payload != NULL) {
+            pc = rudp_packet_chain_alloc(peer->rudp, header_size);
+            if (pc == NULL)
+                goto nomem;
+            rudp_packet_chain_set_payload(pc, payload, written, to_write);
+        } else {
+            pc = rudp_packet_chain_alloc(peer->rudp, header_size + to_write);
+            if (pc == NULL)
+                goto nomem;
+            memcpy(&pc->packet->data.data[0], (const char *)data + written, to_write);
+        }
+        pc->packet->header.command = RUDP_CMD_APP + command;
+        if (reliable)
+            peer_sendq_append_reliable(peer, channel, pc, segment, segments);
+        else
+            peer_sendq_append_unreliable(peer, channel, pc, segment, segments);
+        pc->packet->header.opt |= opt;
+        pc->deadline = deadline;
+        pc->retransmit_max = retransmit_max;
+
+        if ( fec && peer_fec_segment(peer, &parity, pc,
+                                     (const uint8_t *)data + written,
+                                     to_write) )
+            goto nomem;
+
+        written += to_write;
+    }
+
+    return 0;
+
+nomem:
+    if (parity != NULL)
+        rudp_packet_chain_free(peer->rudp, parity);
+
+    /* Segments and parities already queued would make a message
+       peer can never complete */
+    while (queue->prev != last) {
+        pc = __container_of(queue->prev, struct rudp_packet_chain *,
+                            chain_item);
+        rudp_list_remove(&pc->chain_item);
+        rudp_packet_chain_free(peer->rudp, pc);
+    }
+    ch->out_seq_reliable = out_seq_reliable;
+    ch->out_seq_unreliable = out_seq_unreliable;
+
+    return ENOMEM;
+}
+
+/*
+  Returns a buffer holding the uncompressed size and the compressed
+  message, or NULL if compression is off or does not save an eighth
+  of the size.  Each failure doubles the count of following messages
+  sent without trying.
+ */
+static uint8_t *
+peer_compress(struct rudp_peer *peer, const void *data, size_t size,
+        size_t *compressed_size)
+{
+    size_t max = size - size / 8;
+    uint32_t original = htonl((uint32_t)size);
+    uint8_t *buffer;
+    size_t len;
+
+    if ( peer->rudp->compress_min == 0 || size < peer->rudp->compress_min
+         || !(peer->features & RUDP_FEATURE_COMPRESS)
+         || size > UINT32_MAX || max <= sizeof(original) )
+        return NULL;
+
+    if ( peer->compress.skip ) {
+        peer->compress.skip--;
+        return NULL;
+    }
+
+    buffer = rudp_mem_alloc(peer->rudp, max);
+    if (buffer == NULL)
+        return NULL;
+
+    len = rudp_compress(data, size, buffer + sizeof(original),
+                        max - sizeof(original));
+    if (len == 0) {
+        rudp_mem_free(peer->rudp, buffer);
+        peer->compress.backoff = peer->compress.backoff
+            ? RUDP_MIN(peer->compress.backoff * 2, PEER_COMPRESS_BACKOFF_MAX)
+            : 1;
+        peer->compress.skip = peer->compress.backoff;
+        return NULL;
+    }
+
+    peer->compress.backoff = 0;
+    memcpy(buffer, &original, sizeof(original));
+    *compressed_size = sizeof(original) + len;
+    return buffer;
+}
+
+static rudp_error_t
+peer_send_segments(struct rudp_peer *peer, unsigned int channel,
+        int reliable, int command,
+        const void *data, struct rudp_payload *payload, const size_t size,
+        rudp_time_t deadline, uint16_t retransmit_max)
+{
+    int ret;
+    size_t max_write = peer->mtu - RUDP_PACKET_HEADER_MAX;
+    uint8_t *compressed = NULL;
+    size_t compressed_size;
+
+    /* Expiring messages must not share packets with others */
+    if ( payload == NULL && peer_bundling(peer)
+         && deadline == 0 && retransmit_max == 0
+         && size + sizeof(struct rudp_packet_bundle_item) <= max_write ) {
+        ret = peer_bundle_add(peer, channel, reliable, command, data, size);
+        if (ret != 0)
+            return ret;
+        return peer->sendto_err;
+    }
+
+    /* Keep message order on the channel */
+    peer_bundle_close(peer, channel);
+
+    /* Shared payloads are sent as is */
+    if (payload == NULL)
+        compressed = peer_compress(peer, data, size, &compressed_size);
+
+    if (compressed != NULL) {
+        ret = peer_queue_segments(peer, channel, reliable, RUDP_OPT_COMPRESSED,
+                                  command, compressed, NULL, compressed_size,
+                                  deadline, retransmit_max);
+        rudp_mem_free(peer->rudp, compressed);
+    } else {
+        ret = peer_queue_segments(peer, channel, reliable, 0,
+                                  command, data, payload, size,
+                                  deadline, retransmit_max);
+    }
+    if (ret != 0)
+        return ret;
+
+    ret = peer_service_schedule(peer);
+    if (ret != 0)
+        return ret;
+    return peer->sendto_err;
+}
+
+rudp_error_t
+rudp_peer_send(struct rudp_base *rudp, struct rudp_peer *peer, int reliable,
+        int command, const void *data, const size_t size)
+{
+    (void)rudp;
+
+    if (peer == NULL || data == NULL || size <= 0)
+        return EINVAL;
+
+    if ((command + RUDP_CMD_APP) > 255)
+        return EINVAL;
+
+    return peer_send_segments(peer, 0, reliable, command, data, NULL, size,
+                              0, 0);
+}
+
+rudp_error_t
+rudp_peer_send_channel(struct rudp_peer *peer, unsigned int channel,
+        int reliable, int command, const void *data, const size_t size)
+{
+    if (peer == NULL || data == NULL || size <= 0)
+        return EINVAL;
+
+    if ((command + RUDP_CMD_APP) > 255 || channel >= peer->channel_count)
+        return EINVAL;
+
+    return peer_send_segments(peer, channel, reliable, command,
+                              data, NULL, size, 0, 0);
+}
+
+rudp_error_t
+rudp_peer_send_partial(struct rudp_peer *peer, unsigned int channel,
+        int command, const void *data, const size_t size,
+        rudp_time_t ttl, unsigned int max_retransmits)
+{
+    if (peer == NULL || data == NULL || size <= 0 || ttl < 0)
+        return EINVAL;
+
+    if ((command + RUDP_CMD_APP) > 255 || channel >= peer->channel_count)
+        return EINVAL;
+
+    return peer_send_segments(peer, channel, 1, command, data, NULL, size,
+                              ttl ? rudp_timestamp() + ttl : 0,
+                              RUDP_MIN(max_retransmits, UINT16_MAX));
+}
+
+void
+rudp_peer_set_fec(struct rudp_peer *peer, uint8_t group)
+{
+    peer->fec_group = group;
+}
+
+rudp_error_t
+rudp_peer_set_channel_priority(struct rudp_peer *peer,
+        unsigned int channel, uint8_t priority)
+{
+    struct rudp_peer_channel *ch, *pos;
+
+    if (peer == NULL || channel >= peer->channel_max)
+        return EINVAL;
+
+    ch = &peer->channels[channel];
+    ch->priority = priority;
+    rudp_list_remove(&ch->sched_item);
+
+    /* Keep channel number order among equal priorities */
+    rudp_list_for_each(struct rudp_peer_channel *, pos, &peer->sched, sched_item) {
+        if ( pos->priority < priority
+             || (pos->priority == priority && pos > ch) )
+            break;
+    }
+    /* Appending to an item inserts before it */
+    rudp_list_append(&pos->sched_item, &ch->sched_item);
+
+    return 0;
+}
+
+rudp_error_t
+rudp_peer_set_channel_delivery(struct rudp_peer *peer,
+        unsigned int channel, enum rudp_delivery delivery)
+{
+    if (peer == NULL || channel >= peer->channel_max
+        || delivery > RUDP_DELIVERY_UNORDERED)
+        return EINVAL;
+
+    peer->channels[channel].delivery = delivery;
+
+    return 0;
+}
+
+void
+rudp_peer_pause_reading(struct rudp_peer *peer, int paused)
+{
+    struct rudp_packet_chain *pc;
+    int held = ! rudp_list_empty(&peer->held);
+    unsigned int i;
+
+    peer->paused = !!paused;
+
+    /* Handler may pause again */
+    while ( ! peer->paused && ! rudp_list_empty(&peer->held) ) {
+        pc = __container_of(peer->held.next,
+                            struct rudp_packet_chain *, chain_item);
+        rudp_list_remove(&pc->chain_item);
+        peer->held_size -= pc->len;
+        if ( pc->packet->header.command == RUDP_CMD_BUNDLE )
+            peer_handle_bundle(peer, pc, 1);
+        else
+            peer_deliver(peer, pc, 1);
+    }
+
+    if ( ! held || peer->paused
+         || !(peer->features & RUDP_FEATURE_WINDOW) )
+        return;
+
+    /* Tell the window opened again, any channel carries it */
+    for (i = 0; i < peer->channel_count; i++) {
+        if ( peer->channels[i].must_ack ) {
+            peer_post_ack(peer, &peer->channels[i]);
+            break;
+        }
+    }
+}
+
+rudp_error_t
+rudp_peer_send_payload(struct rudp_peer *peer, unsigned int channel,
+        int reliable, int command, struct rudp_payload *payload)
+{
+    if (peer == NULL || payload == NULL || payload->len <= 0)
+        return EINVAL;
+
+    if ((command + RUDP_CMD_APP) > 255 || channel >= peer->channel_count)
+        return EINVAL;
+
+    return peer_send_segments(peer, channel, reliable, command,
+                              payload->data, payload, payload->len, 0, 0);
+}
+
+rudp_error_t
+rudp_peer_send_unreliable(struct rudp_peer *peer,
+        struct rudp_packet_chain *pc)
+{
+    int ret;
+    peer_sendq_append_unreliable(peer, 0, pc, 0, 1);
+
+    ret = peer_service_schedule(peer);
+    if (ret != 0)
+        return ret;
+    return peer->sendto_err;
+}
+
+rudp_error_t
+rudp_peer_send_unreliable_segments(struct rudp_peer *peer,
+        struct rudp_packet_chain **pc, size_t length)
+{
+    struct rudp_packet_chain *parity = NULL;
+    int fec = peer_fec_enabled(peer, length);
+    int ret;
+    size_t index;
+
+    for (index = 0; index < length; index++, pc++) {
+        peer_sendq_append_unreliable(peer, 0, *pc, index, length);
+        if (fec)
+            peer_fec_segment(peer, &parity, *pc, &(*pc)->packet->data.data[0],
+                             (*pc)->len - sizeof(struct rudp_packet_header));
+    }
+
+    ret = peer_service_schedule(peer);
+    if (ret != 0)
+        return ret;
+    return peer->sendto_err;
+}
+
+rudp_error_t
+rudp_peer_send_reliable(struct rudp_peer *peer,
+        struct rudp_packet_chain *pc)
+{
+    int ret;
+    peer_sendq_append_reliable(peer, 0, pc, 0, 1);
+
+    ret = peer_service_schedule(peer);
+    if (ret != 0)
+        return ret;
+    return peer->sendto_err;
+}
+
+rudp_error_t
+rudp_peer_send_reliable_segments(struct rudp_peer *peer,
+        struct rudp_packet_chain **pc, size_t length)
+{
+    struct rudp_packet_chain *parity = NULL;
+    int fec = peer_fec_enabled(peer, length);
+    int ret;
+    size_t index;
+
+    for (index = 0; index < length; index++, pc++) {
+        peer_sendq_append_reliable(peer, 0, *pc, index, length);
+        if (fec)
+            peer_fec_segment(peer, &parity, *pc, &(*pc)->packet->data.data[0],
+                             (*pc)->len - sizeof(struct rudp_packet_header));
+    }
+
+    ret = peer_service_schedule(peer);
+    if (ret != 0)
+        return ret;
+    return peer->sendto_err;
+}
+
+static
+rudp_error_t peer_sendv_to(
+    struct rudp_peer *peer,
+    const union rudp_sockaddr_inet *to,
+    const struct rudp_endpoint_buffer *buffers, size_t count)
+{
+    switch (to->sa.sa_family) {
+    case AF_INET:
+        peer->sendto_err = rudp_endpoint_sendtov(
+            peer->endpoint, &to->sa,
+            sizeof(struct sockaddr_in), buffers, count);
+        break;
+    case AF_INET6:
+        peer->sendto_err = rudp_endpoint_sendtov(
+            peer->endpoint, &to->sa,
+            sizeof(struct sockaddr_in6), buffers, count);
+        break;
+    default:
+#ifdef _WIN32
+        peer->sendto_err = WSAEDESTADDRREQ;
+#else
+        peer->sendto_err = EDESTADDRREQ;
+#endif
+        break;
+    }
+
+    if (peer->sendto_err != EINVAL)
+        peer->last_out_time = rudp_timestamp();
+
+    return peer->sendto_err;
+}
+
+static
+rudp_error_t peer_sendv(
+    struct rudp_peer *peer,
+    const struct rudp_endpoint_buffer *buffers, size_t count)
+{
+    if (peer == NULL)
+        return EINVAL;
+
+    return peer_sendv_to(peer, &peer->address, buffers, count);
+}
+
+static
+rudp_error_t peer_send_raw(
+    struct rudp_peer *peer,
+    const void *data, size_t len)
+{
+    struct rudp_endpoint_buffer buffer = { data, len };
+
+    return peer_sendv(peer, &buffer, 1);
+}
+
+/*
+  Header format used towards the peer, depends on the features agreed
+  on at connection.
+ */
+static __inline
+uint8_t peer_header_version(const struct rudp_peer *peer)
+{
+    if ( peer->features & RUDP_FEATURE_COMPACT )
+        return RUDP_VERSION_COMPACT;
+    if ( peer->features & RUDP_FEATURE_SEQ32 )
+        return RUDP_VERSION_SEQ32;
+    return RUDP_VERSION;
+}
+
+/*
+  Widths of the sequence numbers of a compact header on channel.
+  Receiver expands the reliable one relative to the last one it got
+  in sequence, which is between the last one acknowledged and the
+  last one sent: this distance must fit in an eighth of the range,
+  the rest is margin for late duplicates.  Nothing tells how late
+  the acknowledge is, it goes on as many bits as the fixed formats.
+ */
+static
+void peer_header_bits(const struct rudp_peer *peer,
+                      const struct rudp_peer_channel *channel,
+                      struct rudp_packet_info *info)
+{
+    uint32_t distance = channel->out_seq_reliable - channel->out_seq_acked;
+
+    if ( distance < (1 << 5) )
+        info->reliable_bits = 8;
+    else if ( distance < (1 << 13) )
+        info->reliable_bits = 16;
+    else
+        info->reliable_bits = 32;
+
+    info->ack_bits = (peer->features & RUDP_FEATURE_SEQ32) ? 32 : 16;
+}
+
+static
+rudp_error_t peer_send_chain(
+    struct rudp_peer *peer,
+    const struct rudp_packet_chain *pc)
+{
+    const struct rudp_packet_header *header = &pc->packet->header;
+    const struct rudp_peer_channel *channel = &peer->channels[header->channel];
+    uint8_t wire_header[RUDP_PACKET_HEADER_MAX];
+    struct rudp_endpoint_buffer buffers[3];
+    struct rudp_packet_info info;
+    size_t count = 0;
+
+    info.version = peer_header_version(peer);
+    info.conn_id = peer->out_conn_id;
+    info.command = header->command;
+    info.opt = header->opt;
+    info.channel = header->channel;
+    info.reliable_ack = 0;
+    info.reliable = pc->seq_reliable;
+    info.unreliable = pc->seq_unreliable;
+    info.segments_size = ntohs(header->segments_size);
+    info.segment_index = ntohs(header->segment_index);
+    peer_header_bits(peer, channel, &info);
+
+    /* Initial sequence numbers are taken as they come */
+    if ( header->command == RUDP_CMD_CONN_REQ
+         || header->command == RUDP_CMD_CONN_RSP )
+        info.reliable_bits = 32;
+
+    info.has_window = 0;
+    info.window = 0;
+    if ( channel->must_ack ) {
+        info.opt |= RUDP_OPT_ACK;
+        info.reliable_ack = channel->in_seq_reliable;
+        if ( peer->features & RUDP_FEATURE_WINDOW ) {
+            info.has_window = 1;
+            info.window = peer_receive_window(peer);
+        }
+    }
+
+    info.ts_val = 0;
+    info.ts_ecr = 0;
+    if ( peer->features & RUDP_FEATURE_TIMESTAMP ) {
+        info.ts_val = (uint32_t)rudp_timestamp();
+        if ( info.ts_val == 0 )
+            info.ts_val = 1;
+        info.ts_ecr = channel->ts_recent;
+    }
+
+    buffers[count].data = wire_header;
+    buffers[count++].len = rudp_packet_header_encode(wire_header, &info);
+
+    if ( pc->len > sizeof(*header) ) {
+        buffers[count].data = header + 1;
+        buffers[count++].len = pc->len - sizeof(*header);
+    }
+
+    if (pc->payload != NULL) {
+        buffers[count].data = pc->payload->data + pc->payload_offset;
+        buffers[count++].len = pc->payload_len;
+    }
+
+    return peer_sendv(peer, buffers, count);
+}
+
+rudp_error_t rudp_peer_send_connect(struct rudp_peer *peer)
+{
+    int resume = peer->token_valid
+        && (peer->rudp->features & RUDP_FEATURE_RESUME);
+    struct rudp_packet_chain *pc = rudp_packet_chain_alloc(
+        peer->rudp, sizeof(struct rudp_packet_conn_req)
+                    + (resume ? RUDP_TOKEN_SIZE : 0));
+    struct rudp_packet_conn_req *conn_req = &pc->packet->conn_req;
+
+    memset(conn_req, 0, sizeof(struct rudp_packet_conn_req));
+    if ( resume )
+        memcpy(conn_req + 1, peer->token, RUDP_TOKEN_SIZE);
+
+    conn_req->header.command = RUDP_CMD_CONN_REQ;
+    conn_req->data = htonl(
+        peer->rudp->features
+        | ((uint32_t)(peer->channel_max - 1) << RUDP_FEATURE_CHANNELS_SHIFT));
+
+    /* Connection request always goes in the original format, others
+       follow once features are agreed on. */
+    peer->features = 0;
+    peer->state = PEER_CONNECTING;
+
+    return rudp_peer_send_reliable(peer, pc);
+}
+
+rudp_error_t rudp_peer_send_token(struct rudp_peer *peer,
+                                  const uint8_t *token)
+{
+    struct rudp_packet_chain *pc = rudp_packet_chain_alloc(
+        peer->rudp, sizeof(struct rudp_packet_token));
+
+    if ( pc == NULL )
+        return ENOMEM;
+
+    memset(&pc->packet->header, 0, sizeof(struct rudp_packet_header));
+    pc->packet->header.command = RUDP_CMD_TOKEN;
+    memcpy(pc->packet->token.token, token, RUDP_TOKEN_SIZE);
+
+    return rudp_peer_send_reliable(peer, pc);
+}
+
+rudp_error_t
+rudp_peer_send_close_noqueue(struct rudp_peer *peer)
+{
+    uint8_t wire_header[RUDP_PACKET_HEADER_MAX];
+    struct rudp_packet_info info;
+    size_t len;
+
+    if (peer == NULL || peer->rudp == NULL)
+        return EINVAL;
+
+    memset(&info, 0, sizeof(info));
+
+    info.version = peer_header_version(peer);
+    info.conn_id = peer->out_conn_id;
+    info.command = RUDP_CMD_CLOSE;
+    info.reliable = peer->channels[0].out_seq_reliable;
+    info.unreliable = ++(peer->channels[0].out_seq_unreliable);
+    info.segments_size = 1;
+    peer_header_bits(peer, &peer->channels[0], &info);
+
+    rudp_log_printf(peer->rudp, RUDP_LOG_IO,
+                    ">>> outgoing noqueue %s (%d) %04x:%04x\n",
+                    rudp_command_name(info.command),
+                    info.command,
+                    info.reliable,
+                    info.unreliable);
+
+    len = rudp_packet_header_encode(wire_header, &info);
+
+    return peer_send_raw(peer, wire_header, len);
+}
+
+/*
+  Sends a packet bypassing the send queue, to the given address.  It
+  takes no sequence number and is padded with zero bytes up to size,
+  if larger.
+ */
+static
+rudp_error_t peer_send_unsequenced_to(
+    struct rudp_peer *peer,
+    const union rudp_sockaddr_inet *to,
+    uint8_t command,
+    const void *body, size_t body_len,
+    size_t size)
+{
+    static const uint8_t zeroes[PMTU_MAX];
+    uint8_t wire_header[RUDP_PACKET_HEADER_MAX];
+    struct rudp_endpoint_buffer buffers[3];
+    struct rudp_packet_info info;
+    size_t count = 0;
+
+    memset(&info, 0, sizeof(info));
+
+    info.version = peer_header_version(peer);
+    info.conn_id = peer->out_conn_id;
+    info.command = command;
+    info.reliable = peer->channels[0].out_seq_reliable;
+    info.unreliable = peer->channels[0].out_seq_unreliable;
+    info.segments_size = 1;
+    peer_header_bits(peer, &peer->channels[0], &info);
+
+    buffers[count].data = wire_header;
+    buffers[count++].len = rudp_packet_header_encode(wire_header, &info);
+    buffers[count].data = body;
+    buffers[count++].len = body_len;
+    if ( size > buffers[0].len + body_len ) {
+        buffers[count].data = zeroes;
+        buffers[count++].len = RUDP_MIN(size - buffers[0].len - body_len,
+                                        sizeof(zeroes));
+    }
+
+    return peer_sendv_to(peer, to, buffers, count);
+}
+
+static
+rudp_error_t peer_send_unsequenced(
+    struct rudp_peer *peer, uint8_t command,
+    const void *body, size_t body_len,
+    size_t size)
+{
+    return peer_send_unsequenced_to(peer, &peer->address, command,
+                                    body, body_len, size);
+}
+
+/* Address migration */
+
+/*
+  A reliable packet, new and in sequence, from another address makes
+  us challenge this address with random data.  Peer moves there once
+  the data comes back from it, packets keep going to the former
+  address until then.  Challenge goes again at most once per
+  retransmission timeout.
+ */
+static void peer_path_challenge(struct rudp_peer *peer,
+                                const struct sockaddr_storage *from)
+{
+    rudp_time_t now = rudp_timestamp();
+
+    if ( peer->path.address.sa.sa_family != AF_UNSPEC
+         && ! rudp_sockaddr_compare(&peer->path.address.sa, from) ) {
+        if ( now - peer->path.time < peer->rto )
+            return;
+    } else {
+        peer_address_copy(&peer->path.address, from);
+        evutil_secure_rng_get_bytes(peer->path.data,
+                                    sizeof(peer->path.data));
+    }
+
+    rudp_log_printf(peer->rudp, RUDP_LOG_INFO,
+                    "      peer seen at a new address, challenging it\n");
+
+    peer->path.time = now;
+    peer_send_unsequenced_to(peer, &peer->path.address,
+                             RUDP_CMD_PATH_CHALLENGE,
+                             peer->path.data, sizeof(peer->path.data), 0);
+}
+
+static void peer_handle_path(struct rudp_peer *peer,
+                             const struct rudp_packet_chain *pc,
+                             const struct sockaddr_storage *from)
+{
+    if ( pc->len != sizeof(struct rudp_packet_path) )
+        return;
+
+    switch ( pc->packet->header.command ) {
+    case RUDP_CMD_PATH_CHALLENGE:
+        peer_send_unsequenced(peer, RUDP_CMD_PATH_RESPONSE,
+                              pc->packet->path.data,
+                              sizeof(pc->packet->path.data), 0);
+        break;
+
+    case RUDP_CMD_PATH_RESPONSE:
+        if ( from == NULL
+             || peer->path.address.sa.sa_family == AF_UNSPEC
+             || rudp_sockaddr_compare(&peer->path.address.sa, from)
+             || memcmp(pc->packet->path.data, peer->path.data,
+                       sizeof(peer->path.data)) )
+            break;
+
+        peer_set_address(peer, from);
+        peer->path.address.sa.sa_family = AF_UNSPEC;
+        rudp_log_printf(peer->rudp, RUDP_LOG_INFO,
+                        "      peer moved to a new address\n");
+        break;
+    }
+}
+
+/* Path MTU discovery */
+
+static rudp_error_t peer_pmtu_probe(struct rudp_peer *peer)
+{
+    uint32_t size = htonl(peer->pmtu.probe);
+    rudp_error_t sendto_err = peer->sendto_err;
+    rudp_error_t err;
+
+    rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
+                    "%s probing %d bytes, try %d\n", __FUNCTION__,
+                    peer->pmtu.probe, peer->pmtu.probe_count + 1);
+
+    err = peer_send_unsequenced(
+        peer, RUDP_CMD_PMTU_PROBE, &size, sizeof(size), peer->pmtu.probe);
+
+    /* A probe too large is no error of the user traffic */
+    peer->sendto_err = sendto_err;
+    peer->pmtu.probe_count++;
+
+    return err;
+}
+
+/*
+  Probes the middle of the untested range.  Sizes refused by the local
+  stack are known too large at once.
+ */
+static void peer_pmtu_search(struct rudp_peer *peer, rudp_time_t now)
+{
+    while ( peer->pmtu.high - peer->pmtu.low >= PMTU_GRANULARITY ) {
+        peer->pmtu.probe = peer->pmtu.low
+            + (peer->pmtu.high - peer->pmtu.low + 1) / 2;
+        peer->pmtu.probe_count = 0;
+
+        if ( peer_pmtu_probe(peer) != PMTU_EMSGSIZE ) {
+            peer->pmtu.deadline = now + peer->rto;
+            return;
+        }
+
+        peer->pmtu.high = peer->pmtu.probe - 1;
+    }
+
+    rudp_log_printf(peer->rudp, RUDP_LOG_INFO,
+                    "%s path MTU is %d\n", __FUNCTION__, peer->mtu);
+
+    peer->pmtu.probe = 0;
+    peer->pmtu.deadline = now + PMTU_RAISE_INTERVAL;
+}
+
+static void peer_pmtu_start(struct rudp_peer *peer)
+{
+    if ( ! (peer->features & RUDP_FEATURE_PMTUD) )
+        return;
+
+    peer->pmtu.low = peer->mtu;
+    peer->pmtu.high = PMTU_MAX;
+    peer->pmtu.probe = 0;
+    peer->pmtu.deadline = rudp_timestamp();
+}
+
+static void peer_pmtu_service(struct rudp_peer *peer, rudp_time_t now)
+{
+    if ( peer->pmtu.deadline == 0 || now < peer->pmtu.deadline )
+        return;
+
+    if ( peer->pmtu.probe == 0 ) {
+        /* Search start, or the path may have changed since last one */
+        peer->pmtu.low = peer->mtu;
+        peer->pmtu.high = PMTU_MAX;
+    } else if ( peer->pmtu.probe_count < PMTU_MAX_PROBES ) {
+        peer_pmtu_probe(peer);
+        peer->pmtu.deadline = now + peer->rto;
+        return;
+    } else {
+        /* Probe lost too many times, consider it too large */
+        peer->pmtu.high = peer->pmtu.probe - 1;
+    }
+
+    peer_pmtu_search(peer, now);
+}
+
+static void peer_handle_pmtu(
+    struct rudp_peer *peer,
+    const struct rudp_packet_chain *pc)
+{
+    uint32_t size;
+
+    if ( pc->len < sizeof(struct rudp_packet_pmtu) )
+        return;
+
+    size = ntohl(pc->packet->pmtu.size);
 
-        link_info.acked = seqno;
-        peer->handler.link_info(peer, &link_info);
+    switch ( pc->packet->header.command ) {
+    case RUDP_CMD_PMTU_PROBE:
+        peer_send_unsequenced(peer, RUDP_CMD_PMTU_ACK,
+                              &pc->packet->pmtu.size, sizeof(uint32_t), 0);
+        break;
 
-        rudp_list_remove(&pc->chain_item);
-        rudp_packet_chain_free(peer->rudp, pc);
-    }
+    case RUDP_CMD_PMTU_ACK:
+        if ( peer->pmtu.probe == 0 || size != peer->pmtu.probe )
+            break;
 
-    rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
-                    "%s left in queue:\n",
-                    __FUNCTION__);
-    rudp_list_for_each(struct rudp_packet_chain *, pc, &peer->sendq, chain_item) {
-        struct rudp_packet_header *header = &pc->packet->header;
-        rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
-                        "%s   - %04x:%04x\n",
-                        __FUNCTION__,
-                        ntohs(header->reliable),
-                        ntohs(header->unreliable));
+        peer->mtu = size;
+        peer->pmtu.low = size;
+        peer_pmtu_search(peer, rudp_timestamp());
+        break;
     }
-    rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
-                    "%s ---\n",
-                    __FUNCTION__);
-
-    return 0;
 }
 
+/* Expiring messages */
+
+static int peer_chain_expired(const struct rudp_peer *peer,
+                              const struct rudp_packet_chain *pc,
+                              rudp_time_t now)
+{
+    if ( !(peer->features & RUDP_FEATURE_SKIP)
+         || !(pc->packet->header.opt & RUDP_OPT_RELIABLE) )
+        return 0;
+
+    if ( pc->deadline != 0 && now >= pc->deadline )
+        return 1;
+
+    return pc->retransmit_max != 0
+        && pc->retransmits >= pc->retransmit_max;
+}
 
 /*
-  Ack field is present in all headers.  Therefore any packet can be an
-  ack.  If the send queue is empty, we cant afford to wait for a new
-  one, so we send a new NOOP.
+  Replaces pc, the following segments of its message and their parity
+  by a skip packet taking the sequence number of the last segment.
+  Returns the skip packet, or pc if it could not be allocated.
  */
-static
-void peer_post_ack(struct rudp_peer *peer)
+static struct rudp_packet_chain *
+peer_expire(struct rudp_peer *peer, struct rudp_packet_chain *pc)
 {
-    peer->must_ack = 1;
+    struct rudp_packet_header *header = &pc->packet->header;
+    struct rudp_peer_channel *channel = &peer->channels[header->channel];
+    uint32_t first = pc->seq_reliable;
+    uint32_t last = first - ntohs(header->segment_index)
+        + ntohs(header->segments_size) - 1;
+    struct rudp_packet_chain *skip;
+    struct rudp_list *next;
+
+    skip = rudp_packet_chain_alloc(peer->rudp,
+                                   sizeof(struct rudp_packet_skip));
+    if (skip == NULL)
+        return pc;
+
+    skip->packet->header.version = RUDP_VERSION;
+    skip->packet->header.command = RUDP_CMD_SKIP;
+    skip->packet->header.opt = RUDP_OPT_RELIABLE;
+    skip->packet->header.channel = header->channel;
+    skip->packet->header.segment_index = htons(0);
+    skip->packet->header.segments_size = htons(1);
+    skip->packet->skip.count = htonl(last - first + 1);
+    skip->seq_reliable = last;
+    skip->seq_unreliable = 0;
 
-    if ( ! rudp_list_empty(&peer->sendq) ) {
-        return;
-    }
+    rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
+                    "%s %d/%04x-%04x expired\n", __FUNCTION__,
+                    header->channel, first, last);
 
-    struct rudp_packet_chain *pc = rudp_packet_chain_alloc(
-        peer->rudp, sizeof(struct rudp_packet_conn_rsp));
-    struct rudp_packet_conn_rsp *packet = &pc->packet->conn_rsp;
+    for (;;) {
+        next = pc->chain_item.next;
+        peer_sendq_free(peer, pc);
 
-    rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
-                    "%s pushing NOOP ACK\n", __FUNCTION__);
+        if (next == &channel->sendq)
+            break;
+
+        pc = __container_of(next, struct rudp_packet_chain *, chain_item);
+        if ( (pc->packet->header.opt & RUDP_OPT_RELIABLE)
+             ? (int32_t)(pc->seq_reliable - last) > 0
+             : pc->packet->header.command != RUDP_CMD_FEC )
+            break;
+    }
 
-    packet->header.command = RUDP_CMD_NOOP;
-    packet->accepted = 0;
+    /* Appending to an item inserts before it */
+    rudp_list_append(next, &skip->chain_item);
 
-    rudp_peer_send_unreliable(peer, pc);
+    return skip;
 }
 
+/* Worker functions */
 
-/* Sender functions */
-
-static void
-peer_sendq_append_unreliable(struct rudp_peer *peer,
-        struct rudp_packet_chain *pc, size_t index, size_t length)
+static void peer_channel_send_unreliable(struct rudp_peer *peer,
+                                         struct rudp_peer_channel *channel)
 {
-    pc->packet->header.version = RUDP_VERSION;
-    pc->packet->header.opt = 0;
-    pc->packet->header.dummy = 0;
-    pc->packet->header.segment_index = htons((unsigned int)index);
-    pc->packet->header.segments_size = htons((unsigned int)length);
-    pc->packet->header.reliable = htons(peer->out_seq_reliable);
-    pc->packet->header.unreliable = htons(++(peer->out_seq_unreliable));
+    struct rudp_packet_chain *pc, *tmp;
+    rudp_list_for_each_safe(struct rudp_packet_chain *, pc, tmp, &channel->unreliable_sendq, chain_item)
+    {
+        rudp_log_printf(peer->rudp, RUDP_LOG_IO,
+                        ">>>>>> send fast unreliable %s %d/%04x:%04x %s %04x\n",
+                        rudp_command_name(pc->packet->header.command),
+                        pc->packet->header.channel,
+                        pc->seq_reliable,
+                        pc->seq_unreliable,
+                        channel->must_ack ? "ack" : "noack",
+                        channel->in_seq_reliable);
 
-    rudp_log_printf(peer->rudp, RUDP_LOG_IO,
-                    ">>> outgoing unreliable %s (%d) %04x:%04x\n",
-                    rudp_command_name(pc->packet->header.command),
-                    pc->packet->header.command,
-                    ntohs(pc->packet->header.reliable),
-                    ntohs(pc->packet->header.unreliable));
+        peer_send_chain(peer, pc);
 
-    rudp_list_append(&peer->sendq, &pc->chain_item);
+        rudp_list_remove(&pc->chain_item);
+        rudp_packet_chain_free(peer->rudp, pc);
+    }
 }
 
-static void
-peer_sendq_append_reliable(struct rudp_peer *peer,
-        struct rudp_packet_chain *pc, size_t index, size_t length)
+static void peer_chain_send(struct rudp_peer *peer,
+                            struct rudp_peer_channel *channel,
+                            struct rudp_packet_chain *pc,
+                            rudp_time_t now)
 {
-    peer->out_seq_unreliable = 0;
-
-    pc->packet->header.version = RUDP_VERSION;
-    pc->packet->header.opt = RUDP_OPT_RELIABLE;
-    pc->packet->header.dummy = 0;
-    pc->packet->header.segment_index = htons((unsigned int)index);
-    pc->packet->header.segments_size = htons((unsigned int)length);
-    pc->packet->header.reliable = htons(++(peer->out_seq_reliable));
-    pc->packet->header.unreliable = 0; /* htons(peer->out_seq_unreliable); */
+    struct rudp_packet_header *header = &pc->packet->header;
 
     rudp_log_printf(peer->rudp, RUDP_LOG_IO,
-                    ">>> outgoing reliable %s (%d) %04x:%04x\n",
+                    ">>>>>> %ssend %sreliable %s %d/%04x:%04x %s %04x\n",
+                    header->opt & RUDP_OPT_RETRANSMITTED ? "RE" : "",
+                    header->opt & RUDP_OPT_RELIABLE ? "" : "un",
                     rudp_command_name(pc->packet->header.command),
-                    pc->packet->header.command,
-                    ntohs(pc->packet->header.reliable),
-                    ntohs(pc->packet->header.unreliable));
+                    header->channel,
+                    pc->seq_reliable,
+                    pc->seq_unreliable,
+                    channel->must_ack ? "ack" : "noack",
+                    channel->in_seq_reliable);
+
+    peer_send_chain(peer, pc);
+
+    if ( ! (header->opt & RUDP_OPT_RELIABLE) ) {
+        rudp_list_remove(&pc->chain_item);
+        rudp_packet_chain_free(peer->rudp, pc);
+        return;
+    }
+
+    if ( !(header->opt & RUDP_OPT_RETRANSMITTED) )
+        peer->flight += peer_chain_size(pc);
+    else if ( pc->retransmits < UINT16_MAX )
+        pc->retransmits++;
 
-    rudp_list_append(&peer->sendq, &pc->chain_item);
+    header->opt |= RUDP_OPT_RETRANSMITTED;
+    pc->sent_time = now;
+    pc->lost = 0;
 }
 
-rudp_error_t
-rudp_peer_send(struct rudp_base *rudp, struct rudp_peer *peer, int reliable,
-        int command, const void *data, const size_t size)
+/*
+  Whether a new reliable packet fits in the peer window.  A packet
+  larger than the window still goes when nothing is in flight.  When
+  the window is closed, no acknowledge will tell it opened again, so
+  a packet is let out once per retransmission timeout to probe it.
+ */
+static int peer_window_open(struct rudp_peer *peer,
+                            const struct rudp_packet_chain *pc,
+                            rudp_time_t now)
 {
-    int ret;
-    struct rudp_packet_chain *pc;
-    size_t written, to_write;
-    size_t header_size = sizeof(struct rudp_packet_header);
-    size_t max_write = RUDP_RECV_BUFFER_SIZE - header_size;
-    size_t segments = (size / max_write) + ((size % max_write) != 0);
-    size_t segment;
-
-    if (peer == NULL || data == NULL || size <= 0)
-        return EINVAL;
+    if ( (uint64_t)peer->flight + peer_chain_size(pc) <= peer->send_window
+         || (peer->flight == 0 && peer->send_window != 0) ) {
+        peer->window_probe = 0;
+        return 1;
+    }
 
-    if ((command + RUDP_CMD_APP) > 255)
-        return EINVAL;
+    if ( peer->flight != 0 )
+        return 0;
 
-    written = 0;
-    for (segment = 0; segment < segments; segment++) {
-        to_write = RUDP_MIN(size - written, max_write);
-        pc = rudp_packet_chain_alloc(rudp, header_size + to_write);
-        memcpy(&pc->packet->data.data[0], (const char *)data + written, to_write);
-        written += to_write;
-        pc->packet->header.command = RUDP_CMD_APP + command;
-        if (reliable)
-            peer_sendq_append_reliable(peer, pc, segment, segments);
-        else
-            peer_sendq_append_unreliable(peer, pc, segment, segments);
+    if ( peer->window_probe == 0 ) {
+        peer->window_probe = now + peer->rto;
+        return 0;
     }
 
-    ret = peer_service_schedule(peer);
-    if (ret != 0)
-        return ret;
-    return peer->sendto_err;
-}
+    if ( now < peer->window_probe )
+        return 0;
 
-rudp_error_t
-rudp_peer_send_unreliable(struct rudp_peer *peer,
-        struct rudp_packet_chain *pc)
-{
-    int ret;
-    peer_sendq_append_unreliable(peer, pc, 0, 1);
+    rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
+                    "%s probing closed window\n", __FUNCTION__);
 
-    ret = peer_service_schedule(peer);
-    if (ret != 0)
-        return ret;
-    return peer->sendto_err;
+    peer->window_probe = 0;
+    return 1;
 }
 
-rudp_error_t
-rudp_peer_send_unreliable_segments(struct rudp_peer *peer,
-        struct rudp_packet_chain **pc, size_t length)
+/*
+  New packets are sent, and the ones found lost.  Oldest reliable
+  packet is sent again if the retransmission timer expired, this is
+  the only case returning 1.  When it already timed out as many times
+  as the peer allows, its message is skipped if possible, else -1 is
+  returned.  New reliable packets stop at the first one out of the
+  peer window, the channel is then blocked.
+ */
+static int peer_channel_send_queue(struct rudp_peer *peer,
+                                   struct rudp_peer_channel *channel,
+                                   rudp_time_t now)
 {
-    int ret;
-    size_t index;
+    struct rudp_packet_chain *pc, *tmp;
+    int oldest = 1, timeout = 0;
 
-    for (index = 0; index < length; index++)
-        peer_sendq_append_unreliable(peer, *(pc++), index, length);
+    channel->lost = 0;
+    channel->blocked = 0;
 
-    ret = peer_service_schedule(peer);
-    if (ret != 0)
-        return ret;
-    return peer->sendto_err;
-}
+    rudp_list_for_each_safe(struct rudp_packet_chain *, pc, tmp, &channel->sendq, chain_item)
+    {
+        struct rudp_packet_header *header;
 
-rudp_error_t
-rudp_peer_send_reliable(struct rudp_peer *peer,
-        struct rudp_packet_chain *pc)
-{
-    int ret;
-    peer_sendq_append_reliable(peer, pc, 0, 1);
+        if ( peer_chain_expired(peer, pc, now) ) {
+            pc = peer_expire(peer, pc);
+            tmp = __container_of(pc->chain_item.next,
+                                 struct rudp_packet_chain *, chain_item);
+        }
 
-    ret = peer_service_schedule(peer);
-    if (ret != 0)
-        return ret;
-    return peer->sendto_err;
-}
+        header = &pc->packet->header;
 
-rudp_error_t
-rudp_peer_send_reliable_segments(struct rudp_peer *peer,
-        struct rudp_packet_chain **pc, size_t length)
-{
-    int ret;
-    size_t index;
+        if ( (header->opt & RUDP_OPT_RELIABLE)
+             && (header->opt & RUDP_OPT_RETRANSMITTED) ) {
+            int expired = oldest && now - pc->sent_time >= peer->rto;
 
-    for (index = 0; index < length; index++)
-        peer_sendq_append_reliable(peer, *(pc++), index, length);
+            oldest = 0;
+            if ( ! pc->lost && ! expired )
+                continue;
 
-    ret = peer_service_schedule(peer);
-    if (ret != 0)
-        return ret;
-    return peer->sendto_err;
+            if ( ! pc->lost && peer->timeout.retries != 0
+                 && pc->timeouts >= peer->timeout.retries ) {
+                rudp_log_printf(peer->rudp, RUDP_LOG_WARN,
+                                "%s %d/%04x timed out %d times\n",
+                                __FUNCTION__, header->channel,
+                                pc->seq_reliable, (int)pc->timeouts);
+
+                /* Only application messages may be skipped */
+                if ( !(peer->features & RUDP_FEATURE_SKIP)
+                     || header->command < RUDP_CMD_APP )
+                    return -1;
+
+                pc = peer_expire(peer, pc);
+                tmp = __container_of(pc->chain_item.next,
+                                     struct rudp_packet_chain *, chain_item);
+            } else if ( ! pc->lost ) {
+                timeout = 1;
+                if ( pc->timeouts < UINT16_MAX )
+                    pc->timeouts++;
+            }
+        } else if ( (header->opt & RUDP_OPT_RELIABLE)
+                    && ! peer_window_open(peer, pc, now) ) {
+            channel->blocked = 1;
+            break;
+        }
+
+        peer_chain_send(peer, channel, pc, now);
+    }
+
+    return timeout;
 }
 
-static
-rudp_error_t peer_send_raw(
-    struct rudp_peer *peer,
-    const void *data, size_t len)
+/*
+  Last packet sent of the channel, NULL if none is waiting for an
+  acknowledge.
+ */
+static struct rudp_packet_chain *
+peer_channel_last_sent(struct rudp_peer_channel *channel)
 {
-    if (peer == NULL)
-        return EINVAL;
+    struct rudp_packet_chain *pc;
 
-    peer->sendto_err = rudp_endpoint_send(peer->endpoint, &peer->address, data, len);
-    if (peer->sendto_err != EINVAL)
-        peer->last_out_time = rudp_timestamp();
+    rudp_list_for_each_reverse(struct rudp_packet_chain *, pc, &channel->sendq, chain_item)
+    {
+        if ( (pc->packet->header.opt & RUDP_OPT_RELIABLE)
+             && (pc->packet->header.opt & RUDP_OPT_RETRANSMITTED) )
+            return pc;
+    }
 
-    return peer->sendto_err;
+    return NULL;
 }
 
-rudp_error_t rudp_peer_send_connect(struct rudp_peer *peer)
+/*
+  Tail loss probe timeout, two round trips (RFC 8985 7.2).
+ */
+static rudp_time_t peer_probe_timeout(const struct rudp_peer *peer)
 {
-    struct rudp_packet_chain *pc = rudp_packet_chain_alloc(
-        peer->rudp, sizeof(struct rudp_packet_conn_req));
-    struct rudp_packet_conn_req *conn_req = &pc->packet->conn_req;
+    if ( peer->srtt < 0 )
+        return PEER_PROBE_TIMEOUT_DEFAULT;
+    return RUDP_MAX(2 * peer->srtt, PEER_PROBE_TIMEOUT_MIN);
+}
 
-    memset(conn_req, 0, sizeof(struct rudp_packet_conn_req));
+/*
+  When nothing was acknowledged for a probe timeout after the last
+  packet went out, it is sent again, once.  The acknowledge it brings
+  back tells which packets are lost, or that none is, without waiting
+  for the retransmission timeout.
+ */
+static void peer_channel_probe(struct rudp_peer *peer,
+                               struct rudp_peer_channel *channel,
+                               rudp_time_t now)
+{
+    struct rudp_packet_chain *last;
 
-    conn_req->header.command = RUDP_CMD_CONN_REQ;
+    /* Packets waiting for the window would make the search long, the
+       retransmission timeout is enough there. */
+    if ( channel->probed || channel->blocked )
+        return;
 
-    peer->state = PEER_CONNECTING;
+    last = peer_channel_last_sent(channel);
+    if ( last == NULL
+         || now - last->sent_time < peer_probe_timeout(peer) )
+        return;
 
-    return rudp_peer_send_reliable(peer, pc);
+    rudp_log_printf(peer->rudp, RUDP_LOG_DEBUG,
+                    "%s probing with %d/%04x\n", __FUNCTION__,
+                    last->packet->header.channel, last->seq_reliable);
+
+    channel->probed = 1;
+    peer_chain_send(peer, channel, last, now);
 }
 
-rudp_error_t
-rudp_peer_send_close_noqueue(struct rudp_peer *peer)
+/*
+  Time the channel needs service at, relative to now, if earlier
+  than delta.  Returns delta otherwise.
+ */
+static rudp_time_t peer_channel_deadline(struct rudp_peer *peer,
+                                         struct rudp_peer_channel *channel,
+                                         rudp_time_t now,
+                                         rudp_time_t delta)
 {
-    struct rudp_packet_header header;
+    const struct rudp_packet_chain *head, *last;
 
-    if (peer == NULL || peer->rudp == NULL)
-        return EINVAL;
+    if ( ! rudp_list_empty(&channel->unreliable_sendq) || channel->lost )
+        return 0;
+
+    if ( rudp_list_empty(&channel->sendq) )
+        return delta;
 
-    memset(&header, 0, sizeof(header));
+    last = __container_of(channel->sendq.prev,
+                          const struct rudp_packet_chain *, chain_item);
+    if ( ! (last->packet->header.opt & RUDP_OPT_RETRANSMITTED)
+         && ! channel->blocked )
+        return 0;
 
-    header.version = RUDP_VERSION;
-    header.command = RUDP_CMD_CLOSE;
-    header.reliable = htons(peer->out_seq_reliable);
-    header.unreliable = htons(++(peer->out_seq_unreliable));
-    header.segments_size = htons(1);
+    head = __container_of(channel->sendq.next,
+                          const struct rudp_packet_chain *, chain_item);
+    if ( ! (head->packet->header.opt & RUDP_OPT_RETRANSMITTED) ) {
+        if ( ! channel->blocked )
+            return 0;
+        /* Waiting for the window, another channel has packets in
+           flight or the window is to be probed */
+        if ( peer->flight != 0 )
+            return delta;
+        return RUDP_MIN(delta, peer->window_probe - now);
+    }
 
-    rudp_log_printf(peer->rudp, RUDP_LOG_IO,
-                    ">>> outgoing noqueue %s (%d) %04x:%04x\n",
-                    rudp_command_name(header.command),
-                    ntohs(header.reliable),
-                    header.reliable,
-                    ntohs(header.unreliable));
+    delta = RUDP_MIN(delta, head->sent_time + peer->rto - now);
 
-    return peer_send_raw(peer, &header, sizeof(header));
-}
+    if ( ! channel->probed && ! channel->blocked )
+        delta = RUDP_MIN(delta, last->sent_time
+                         + peer_probe_timeout(peer) - now);
 
-/* Worker functions */
+    return delta;
+}
 
-static void peer_send_queue(struct rudp_peer *peer)
+/*
+  Channels are flushed by decreasing priority, then probed.  A single
+  backoff is applied for the whole peer, whatever the number of
+  channels whose retransmission timer expired.  Fast lane packets of
+  a channel always go first.  Returns -1 if the peer ran out of
+  retries.
+ */
+static int peer_send_queue(struct rudp_peer *peer, rudp_time_t now)
 {
-    struct rudp_packet_chain *pc, *tmp;
-    rudp_list_for_each_safe(struct rudp_packet_chain *, pc, tmp, &peer->sendq, chain_item)
-    {
-        struct rudp_packet_header *header = &pc->packet->header;
+    struct rudp_peer_channel *channel;
+    int retransmitted = 0;
+
+    rudp_list_for_each(struct rudp_peer_channel *, channel, &peer->sched, sched_item) {
+        int ret;
+
+        if ( channel - peer->channels >= peer->channel_count )
+            continue;
+        peer_channel_send_unreliable(peer, channel);
+        ret = peer_channel_send_queue(peer, channel, now);
+        if ( ret < 0 )
+            return ret;
+        retransmitted |= ret;
+        peer_channel_probe(peer, channel, now);
+    }
 
-        if ( peer->must_ack ) {
-            header->opt |= RUDP_OPT_ACK;
-            header->reliable_ack = htons(peer->in_seq_reliable);
-        } else {
-            header->reliable_ack = 0;
-        }
+    if (retransmitted)
+        peer_rto_backoff(peer);
 
-        rudp_log_printf(peer->rudp, RUDP_LOG_IO,
-                        ">>>>>> %ssend %sreliable %s %04x:%04x %s %04x\n",
-                        header->opt & RUDP_OPT_RETRANSMITTED ? "RE" : "",
-                        header->opt & RUDP_OPT_RELIABLE ? "" : "un",
-                        rudp_command_name(pc->packet->header.command),
-                        ntohs(pc->packet->header.reliable),
-                        ntohs(pc->packet->header.unreliable),
-                        header->opt & RUDP_OPT_ACK ? "ack" : "noack",
-                        ntohs(pc->packet->header.reliable_ack));
+    return 0;
+}
 
-        peer_send_raw(peer, header, pc->len);
+static int peer_sendq_empty(const struct rudp_peer *peer)
+{
+    unsigned int i;
 
-        if ( (header->opt & RUDP_OPT_RELIABLE)
-             && (header->opt & RUDP_OPT_RETRANSMITTED) ) {
-            peer_rto_backoff(peer);
-            break;
-        }
+    for (i = 0; i < peer->channel_count; i++)
+        if ( ! rudp_list_empty(&peer->channels[i].sendq)
+             || ! rudp_list_empty(&peer->channels[i].unreliable_sendq) )
+            return 0;
 
-        if ( header->opt & RUDP_OPT_RELIABLE ) {
-            header->opt |= RUDP_OPT_RETRANSMITTED;
-        } else {
-            rudp_list_remove(&pc->chain_item);
-            rudp_packet_chain_free(peer->rudp, pc);
-        }
-    }
+    return 1;
 }
 
 
@@ -936,17 +3579,23 @@ static void peer_service(struct rudp_peer *peer)
         return;
     }
 
-    if ( rudp_list_empty(&peer->sendq) ) {
+    if ( peer->bundle_deadline != 0 && peer->bundle_deadline <= timestamp )
+        peer_bundle_flush(peer);
+
+    if ( peer_sendq_empty(peer) ) {
         /*
           Nothing was in the send queue, so we may be in a timeout
           situation. Handle retries and final timeout.
         */
-        rudp_time_t out_delta = timestamp - peer->last_out_time;
-        if (out_delta > peer->timeout.action)
-            peer_ping(peer);
+        peer_idle_service(peer, timestamp);
+    }
+
+    if ( peer_send_queue(peer, timestamp) < 0 ) {
+        peer->handler.dropped(peer);
+        return;
     }
 
-    peer_send_queue(peer);
+    peer_pmtu_service(peer, timestamp);
 
     peer_service_schedule(peer);
 }
@@ -956,16 +3605,34 @@ static void _peer_service(evutil_socket_t fd, short flags, void *arg)
     peer_service((struct rudp_peer *)arg);
 }
 
+int rudp_peer_connected(const struct rudp_peer *peer)
+{
+    return peer->state == PEER_RUN;
+}
+
 int rudp_peer_address_compare(const struct rudp_peer *peer,
                               const struct sockaddr_storage *addr)
 {
-    return rudp_address_compare(&peer->address, addr);
+    return rudp_sockaddr_compare(&peer->address.sa, addr);
+}
+
+size_t rudp_peer_get_mtu(const struct rudp_peer *peer)
+{
+    return peer->mtu;
+}
+
+void
+rudp_peer_set_timeout_min_rto(struct rudp_peer *peer, rudp_time_t min_rto)
+{
+    peer->timeout.min_rto = min_rto;
+    peer_rto_update(peer);
 }
 
 void
 rudp_peer_set_timeout_max_rto(struct rudp_peer *peer, rudp_time_t max_rto)
 {
     peer->timeout.max_rto = max_rto;
+    peer_rto_update(peer);
 }
 
 void
@@ -979,3 +3646,21 @@ rudp_peer_set_timeout_action(struct rudp_peer *peer, rudp_time_t action)
 {
     peer->timeout.action = action;
 }
+
+void
+rudp_peer_set_timeout_keepalive(struct rudp_peer *peer, rudp_time_t keepalive)
+{
+    peer->timeout.keepalive = keepalive;
+}
+
+void
+rudp_peer_set_timeout_jitter(struct rudp_peer *peer, unsigned int percent)
+{
+    peer->timeout.jitter = RUDP_MIN(percent, 100);
+}
+
+void
+rudp_peer_set_timeout_retries(struct rudp_peer *peer, unsigned int retries)
+{
+    peer->timeout.retries = RUDP_MIN(retries, UINT16_MAX);
+}
@@ -9,6 +9,7 @@
   See AUTHORS for details
  */
 
+#include <errno.h>
 #include <stdlib.h>
 
 #include <event2/util.h>
@@ -18,6 +19,7 @@
 #include <rudp/time.h>
 
 #include "rudp_list.h"
+#include "rudp_packet.h"
 #include "rudp_rudp.h"
 
 void rudp_init(
@@ -28,9 +30,7 @@ void rudp_init(
     rudp->handler = *handler;
     rudp->eb = eb;
 
-    rudp_list_init(&rudp->free_packet_list);
-    rudp->free_packets = 0;
-    rudp->allocated_packets = 0;
+    rudp_packet_pool_init(rudp);
 
     /* RFC 6298 2.1 - RTO of at least 1 second but as we probably are using a
      * low quality connection, use the old default of 3 seconds (RFC 2988). */
@@ -41,6 +41,65 @@ void rudp_init(
     rudp->default_timeout.action = 5000;
     /* Does it make any sense to have a drop timeout lesser than max_rto? */
     rudp->default_timeout.drop = rudp->default_timeout.action * 2;
+    /* UDP bindings of most NATs last 30 seconds at least. */
+    rudp->default_timeout.keepalive = 25000;
+    /* No jitter nor retransmission limit, the drop timeout applies. */
+    rudp->default_timeout.jitter = 0;
+    rudp->default_timeout.retries = 0;
+
+    rudp->features = RUDP_FEATURE_ALL;
+    rudp->channels = 1;
+    rudp->bundle_delay = 0;
+    rudp->compress_min = 0;
+    rudp->fec_group = 0;
+    rudp->receive_window = 64 * 1024;
+}
+
+rudp_error_t rudp_set_channels(
+    struct rudp_base *rudp,
+    unsigned int channels)
+{
+    if ( channels < 1
+         || channels > (RUDP_FEATURE_CHANNELS_MASK >> RUDP_FEATURE_CHANNELS_SHIFT) + 1 )
+        return EINVAL;
+
+    rudp->channels = channels;
+    return 0;
+}
+
+void rudp_set_bundle_delay(
+    struct rudp_base *rudp,
+    rudp_time_t delay)
+{
+    rudp->bundle_delay = delay;
+}
+
+void rudp_set_compression(
+    struct rudp_base *rudp,
+    size_t min_size)
+{
+    rudp->compress_min = min_size;
+}
+
+void rudp_set_fec(
+    struct rudp_base *rudp,
+    uint8_t group)
+{
+    rudp->fec_group = group;
+}
+
+void rudp_set_receive_window(
+    struct rudp_base *rudp,
+    uint32_t size)
+{
+    rudp->receive_window = size;
+}
+
+void rudp_set_features(
+    struct rudp_base *rudp,
+    uint32_t features)
+{
+    rudp->features = features & RUDP_FEATURE_ALL;
 }
 
 static
@@ -65,11 +124,7 @@ const struct rudp_handler rudp_handler_default =
 
 void rudp_deinit(struct rudp_base *rudp)
 {
-    struct rudp_packet_chain *pc, *tmp;
-    rudp_list_for_each_safe(struct rudp_packet_chain *, pc, tmp, &rudp->free_packet_list, chain_item) {
-        rudp_list_remove(&pc->chain_item);
-        rudp_mem_free(rudp, pc);
-    }
+    rudp_packet_pool_deinit(rudp);
 }
 
 struct rudp_base *
@@ -0,0 +1,49 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#ifndef RUDP_ARENA_H_
+#define RUDP_ARENA_H_
+
+#include <stddef.h>
+
+#include <rudp/list.h>
+
+struct rudp_base;
+
+/*
+  Fixed-size object allocator.  Objects are carved out of slabs of
+  slab_objects elements, released objects are kept in a LIFO free
+  list and reused before any new slab is allocated.  Slabs are only
+  given back to the rudp allocator on deinit.
+ */
+struct rudp_arena
+{
+    struct rudp_base *rudp;
+    size_t object_size;
+    size_t slab_objects;
+    void **slabs;
+    size_t slab_count;
+    size_t slab_max;
+    struct rudp_list free_list;
+};
+
+#define RUDP_ARENA_ALIGN(x) (((x) + 15) & ~(size_t)15)
+
+void rudp_arena_init(struct rudp_arena *arena, struct rudp_base *rudp,
+                     size_t object_size, size_t slab_objects);
+
+void rudp_arena_deinit(struct rudp_arena *arena);
+
+void *rudp_arena_alloc(struct rudp_arena *arena);
+
+void rudp_arena_free(struct rudp_arena *arena, void *object);
+
+#endif
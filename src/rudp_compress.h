@@ -0,0 +1,49 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#ifndef RUDP_COMPRESS_H_
+#define RUDP_COMPRESS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+  Byte-oriented LZ77 block codec, in the spirit of LZ4.  A block is a
+  sequence of:
+
+  - a token byte, literal count in the high nibble, match length
+    minus 4 in the low nibble.  A nibble of 15 is followed by extra
+    bytes added to it, until one is not 255;
+  - literals;
+  - a 2-byte little endian match offset, and the match length
+    extra bytes if any.
+
+  The last sequence of a block only has literals.
+ */
+
+#define RUDP_COMPRESS_MIN_MATCH 4
+
+/*
+  Compresses size bytes of in to out.  Returns the compressed size,
+  or 0 if it would exceed max.
+ */
+size_t rudp_compress(const uint8_t *in, size_t size,
+                     uint8_t *out, size_t max);
+
+/*
+  Decompresses a block of size bytes to exactly out_size bytes.
+  Returns 0, or -1 if the block is malformed or does not match
+  out_size.
+ */
+int rudp_decompress(const uint8_t *in, size_t size,
+                    uint8_t *out, size_t out_size);
+
+#endif
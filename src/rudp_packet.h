@@ -12,6 +12,7 @@
 #ifndef RUDP_PACKET_IMPL_H
 #define RUDP_PACKET_IMPL_H
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <rudp/list.h>
 #include <rudp/packet.h>
@@ -20,6 +21,17 @@
 
 #define RUDP_RECV_BUFFER_SIZE 4096
 
+/*
+  Received packets are read this many bytes into their buffer, so
+  that a wire header shorter than struct rudp_packet_header can be
+  rewritten in place.
+ */
+#define RUDP_RECV_HEADROOM 16
+
+void rudp_packet_pool_init(struct rudp_base *rudp);
+
+void rudp_packet_pool_deinit(struct rudp_base *rudp);
+
 struct rudp_packet_chain *rudp_packet_chain_alloc(
     struct rudp_base *rudp,
     size_t alloc);
@@ -28,4 +40,128 @@ void rudp_packet_chain_free(
     struct rudp_base *rudp,
     struct rudp_packet_chain *pc);
 
+/*
+  Reference counted payload, shared by the chains of all the peers a
+  message is broadcast to.  Each chain referencing it holds one
+  reference, dropped when the chain is freed.
+ */
+struct rudp_payload
+{
+    unsigned int refcount;
+    size_t len;
+    uint8_t data[];
+};
+
+struct rudp_payload *rudp_payload_new(
+    struct rudp_base *rudp,
+    const void *data, size_t len);
+
+static __inline
+void rudp_payload_ref(struct rudp_payload *payload)
+{
+    payload->refcount++;
+}
+
+void rudp_payload_release(
+    struct rudp_base *rudp,
+    struct rudp_payload *payload);
+
+/*
+  Makes the chain reference len bytes of payload, from offset.
+ */
+void rudp_packet_chain_set_payload(
+    struct rudp_packet_chain *pc,
+    struct rudp_payload *payload,
+    size_t offset, size_t len);
+
+/*
+  Header fields, in host order, whatever the wire format.  On the
+  wire, acknowledge, reliable and unreliable sequence numbers are
+  truncated to ack_bits, reliable_bits and unreliable_bits bits,
+  receiver expands them back with rudp_seq_expand().  Sender chooses
+  ack_bits and reliable_bits of compact headers, fixed formats ignore
+  them.  seq_bits is the width of the format, sequence numbers in
+  packet bodies are expanded with it.  A conn_id of 0 is none, so is
+  a ts_val of 0, ts_ecr is only meaningful along a ts_val.  window is
+  only meaningful if has_window is set.
+ */
+struct rudp_packet_info
+{
+    uint8_t version;
+    uint8_t command;
+    uint8_t opt;
+    uint8_t channel;
+    uint8_t seq_bits;
+    uint8_t ack_bits;
+    uint8_t reliable_bits;
+    uint8_t unreliable_bits;
+    uint32_t reliable_ack;
+    uint32_t reliable;
+    uint32_t unreliable;
+    uint16_t segments_size;
+    uint16_t segment_index;
+    uint32_t conn_id;
+    uint32_t ts_val;
+    uint32_t ts_ecr;
+    uint32_t window;
+    uint8_t has_window;
+};
+
+/* Largest header of all the wire formats, a compact one with all its
+   fields at full width is a byte longer than the seq32 one */
+#define RUDP_PACKET_HEADER_MAX \
+    (sizeof(struct rudp_packet_header_seq32) + 1 + 4 * sizeof(uint32_t))
+
+/*
+  Writes the wire header for info->version in buffer, which must hold
+  RUDP_PACKET_HEADER_MAX bytes.  Returns the header size.
+ */
+size_t rudp_packet_header_encode(
+    void *buffer,
+    const struct rudp_packet_info *info);
+
+/*
+  Parses the wire header at the start of data.  Returns the header
+  size, or 0 if version is unknown or packet is too short.
+ */
+size_t rudp_packet_header_decode(
+    struct rudp_packet_info *info,
+    const void *data, size_t len);
+
+/*
+  Connection id in the wire header at the start of data, 0 if none.
+ */
+uint32_t rudp_packet_conn_id(const void *data, size_t len);
+
+/*
+  Rewrites a received chain whose wire header is header_size bytes
+  long so that it starts with a struct rudp_packet_header built from
+  info, as handlers expect.  Full sequence numbers go in the chain.
+  A shorter wire header takes room from the receive headroom.
+ */
+void rudp_packet_chain_canonicalize(
+    struct rudp_packet_chain *pc,
+    const struct rudp_packet_info *info,
+    size_t header_size);
+
+/*
+  Expands a sequence number received truncated to bits bits to the
+  32-bit value closest to reference.
+ */
+static __inline
+uint32_t rudp_seq_expand(uint32_t value, unsigned int bits, uint32_t reference)
+{
+    uint32_t mask, delta;
+
+    if ( bits >= 32 )
+        return value;
+
+    mask = ((uint32_t)1 << bits) - 1;
+    delta = (value - reference) & mask;
+
+    if ( delta > (mask >> 1) )
+        return reference + delta - mask - 1;
+    return reference + delta;
+}
+
 #endif
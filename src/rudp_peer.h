@@ -0,0 +1,76 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#ifndef RUDP_PEER_IMPL_H_
+#define RUDP_PEER_IMPL_H_
+
+#include <event2/event.h>
+
+#include <rudp/peer.h>
+
+#include "rudp_packet.h"
+
+/*
+  Same as rudp_peer_from_sockaddr(), but the peer timer lives in
+  caller-provided storage of event_get_struct_event_size() bytes
+  instead of being allocated by libevent, and so does the array of
+  channel_max channels.  A NULL channels array is the single embedded
+  channel.  Storage must stay valid until rudp_peer_deinit().
+ */
+void rudp_peer_from_sockaddr_ev(
+    struct rudp_peer *peer,
+    struct rudp_base *rudp,
+    const struct sockaddr_storage *addr,
+    const struct rudp_peer_handler *handler,
+    struct rudp_endpoint *endpoint,
+    struct event *ev,
+    struct rudp_peer_channel *channels,
+    unsigned int channel_max);
+
+/*
+  Same as rudp_peer_incoming_packet(), for a packet that may come
+  from another address than the peer one.  A reliable packet, new
+  and in sequence, makes the peer challenge the new address, it moves
+  there once the challenge is answered from it.
+ */
+rudp_error_t rudp_peer_incoming_packet_from(
+    struct rudp_peer *peer, struct rudp_packet_chain *pc,
+    const struct sockaddr_storage *from);
+
+/*
+  Takes round-trip time estimates of a former connection back, an
+  srtt of 0 or less is none.
+ */
+void rudp_peer_resume(struct rudp_peer *peer,
+                      rudp_time_t srtt, rudp_time_t rttvar);
+
+/*
+  Sends a resumption token of RUDP_TOKEN_SIZE bytes.
+ */
+rudp_error_t rudp_peer_send_token(struct rudp_peer *peer,
+                                  const uint8_t *token);
+
+/*
+  Tells whether the handshake with the peer is over.
+ */
+int rudp_peer_connected(const struct rudp_peer *peer);
+
+/*
+  Same as rudp_peer_send(), but segments reference the shared payload
+  instead of holding a private copy of the data.
+ */
+rudp_error_t rudp_peer_send_payload(
+    struct rudp_peer *peer,
+    unsigned int channel,
+    int reliable, int command,
+    struct rudp_payload *payload);
+
+#endif
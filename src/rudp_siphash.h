@@ -0,0 +1,28 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#ifndef RUDP_SIPHASH_H_
+#define RUDP_SIPHASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RUDP_SIPHASH_KEY_SIZE 16
+
+/*
+  SipHash-2-4 of len bytes of data under a 128-bit key.  It is a
+  keyed MAC, cheap enough for short messages to be computed for each
+  incoming datagram.
+ */
+uint64_t rudp_siphash(const uint8_t key[RUDP_SIPHASH_KEY_SIZE],
+                      const void *data, size_t len);
+
+#endif
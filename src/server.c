@@ -14,14 +14,40 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <event2/event.h>
+#include <event2/util.h>
+
 #include <rudp/packet.h>
 #include <rudp/peer.h>
 #include <rudp/rudp.h>
 #include <rudp/server.h>
 
+#include "rudp_arena.h"
 #include "rudp_list.h"
 #include "rudp_packet.h"
+#include "rudp_peer.h"
 #include "rudp_rudp.h"
+#include "rudp_siphash.h"
+
+/* Number of peers allocated at once when the peer arena is empty */
+#define SERVER_PEER_SLAB_SIZE 128
+
+/* Connection cookies lifetime, in seconds */
+#define SERVER_COOKIE_LIFETIME 10
+
+/* Resumption tokens lifetime, in seconds */
+#define SERVER_TOKEN_LIFETIME 600
+
+/* Peers get a fresh resumption token this often, in ms */
+#define SERVER_TOKEN_REFRESH 60000
+
+/*
+  Connection ids are a random 16-bit tag above the 16-bit index of
+  the peer in the connection id table.  The tag tells a stale id from
+  the one of the peer now using the entry.
+ */
+#define SERVER_CONN_ID_MAX 0x10000
+#define SERVER_CONN_ID_INDEX(id) ((id) & 0xffff)
 
 struct server_peer
 {
@@ -29,9 +55,48 @@ struct server_peer
     struct rudp_list server_item;
     struct rudp_server *server;
     void *user_data;
+    /* Time last resumption token was sent at, and whether it held
+       round-trip estimates */
+    rudp_time_t token_time;
+    uint8_t token_rtt;
 };
 
+/*
+  Each arena slot holds a server_peer immediately followed by the
+  storage of its libevent timer, then by its channel array when the
+  server has more than one channel, so that creating a peer needs no
+  allocation once the arena is warm.  On x86_64 with libevent 2.1, a
+  slot is 672 bytes, server_peer and its 488-byte rudp_peer, then the
+  128-byte timer.  With several channels, each adds 120 bytes.
+ */
+#define SERVER_PEER_EV_OFFSET RUDP_ARENA_ALIGN(sizeof(struct server_peer))
+
+static __inline
+struct event *server_peer_ev(struct server_peer *peer)
+{
+    return (struct event *)((uint8_t *)peer + SERVER_PEER_EV_OFFSET);
+}
+
+static __inline
+size_t server_peer_channels_offset(void)
+{
+    return SERVER_PEER_EV_OFFSET
+        + RUDP_ARENA_ALIGN(event_get_struct_event_size());
+}
+
+static __inline
+struct rudp_peer_channel *server_peer_channels(struct rudp_server *server,
+                                               struct server_peer *peer)
+{
+    if ( server->peer_channels <= 1 )
+        return NULL;
+    return (struct rudp_peer_channel *)
+        ((uint8_t *)peer + server_peer_channels_offset());
+}
+
 static const struct rudp_endpoint_handler server_endpoint_handler;
+static void server_token_send(struct rudp_server *server,
+                              struct server_peer *peer);
 
 void
 rudp_server_init(struct rudp_server *server, struct rudp_base *rudp,
@@ -39,9 +104,17 @@ rudp_server_init(struct rudp_server *server, struct rudp_base *rudp,
 {
     rudp_endpoint_init(&server->endpoint, rudp, &server_endpoint_handler);
     rudp_list_init(&server->peer_list);
+    server->peer_channels = rudp->channels;
+    server->peer_arena = NULL;
     server->handler = *handler;
     server->arg = arg;
     server->rudp = rudp;
+    evutil_secure_rng_get_bytes(server->cookie_key, sizeof(server->cookie_key));
+    server->cookie_required = 0;
+    server->conn_ids = NULL;
+    server->conn_id_max = 0;
+    server->conn_id_used = 0;
+    server->conn_id_next = 0;
 }
 
 struct rudp_server *
@@ -73,12 +146,93 @@ rudp_error_t rudp_server_bind(struct rudp_server *server)
     return err;
 }
 
+static int server_conn_id_grow(struct rudp_server *server)
+{
+    size_t max = server->conn_id_max ? server->conn_id_max * 2 : 64;
+    struct rudp_peer **conn_ids;
+
+    if ( server->conn_id_max >= SERVER_CONN_ID_MAX )
+        return -1;
+
+    conn_ids = rudp_mem_alloc(server->rudp, max * sizeof(*conn_ids));
+    if ( conn_ids == NULL )
+        return -1;
+
+    memset(conn_ids, 0, max * sizeof(*conn_ids));
+    if ( server->conn_ids != NULL ) {
+        memcpy(conn_ids, server->conn_ids,
+               server->conn_id_max * sizeof(*conn_ids));
+        rudp_mem_free(server->rudp, server->conn_ids);
+    }
+
+    server->conn_id_next = server->conn_id_max;
+    server->conn_ids = conn_ids;
+    server->conn_id_max = max;
+
+    return 0;
+}
+
+/*
+  Gives a connection id to the peer.  Without any entry left, peer
+  gets none and is only known by its address.
+ */
+static void server_conn_id_alloc(struct rudp_server *server,
+                                 struct server_peer *peer)
+{
+    size_t index = server->conn_id_next;
+    uint16_t tag;
+
+    if ( server->conn_id_used == server->conn_id_max
+         && server_conn_id_grow(server) )
+        return;
+
+    while ( server->conn_ids[index] != NULL )
+        index = (index + 1) % server->conn_id_max;
+
+    do
+        tag = rudp_random();
+    while ( tag == 0 );
+
+    server->conn_ids[index] = &peer->base;
+    server->conn_id_used++;
+    server->conn_id_next = (index + 1) % server->conn_id_max;
+    peer->base.in_conn_id = ((uint32_t)tag << 16) | (uint32_t)index;
+}
+
+static void server_conn_id_free(struct rudp_server *server,
+                                struct server_peer *peer)
+{
+    if ( peer->base.in_conn_id == 0 )
+        return;
+
+    server->conn_ids[SERVER_CONN_ID_INDEX(peer->base.in_conn_id)] = NULL;
+    server->conn_id_used--;
+}
+
+static
+struct server_peer *server_conn_id_lookup(struct rudp_server *server,
+                                          uint32_t conn_id)
+{
+    size_t index = SERVER_CONN_ID_INDEX(conn_id);
+    struct rudp_peer *peer;
+
+    if ( index >= server->conn_id_max )
+        return NULL;
+
+    peer = server->conn_ids[index];
+    if ( peer == NULL || peer->in_conn_id != conn_id )
+        return NULL;
+
+    return (struct server_peer *)peer;
+}
+
 static void server_peer_forget(struct rudp_server *server,
                                struct server_peer *peer)
 {
+    server_conn_id_free(server, peer);
     rudp_list_remove(&peer->server_item);
     rudp_peer_deinit(&peer->base);
-    rudp_mem_free(server->rudp, peer);
+    rudp_arena_free(server->peer_arena, peer);
 }
 
 void rudp_server_client_close(struct rudp_server *server,
@@ -111,6 +265,18 @@ rudp_server_deinit(struct rudp_server *server)
     rudp_server_close(server);
     rudp_endpoint_deinit(&server->endpoint);
     rudp_list_init(&server->peer_list);
+    if (server->peer_arena != NULL) {
+        rudp_arena_deinit(server->peer_arena);
+        rudp_mem_free(server->rudp, server->peer_arena);
+    }
+    server->peer_arena = NULL;
+
+    if (server->conn_ids != NULL)
+        rudp_mem_free(server->rudp, server->conn_ids);
+    server->conn_ids = NULL;
+    server->conn_id_max = 0;
+    server->conn_id_used = 0;
+    server->conn_id_next = 0;
 }
 
 void
@@ -155,6 +321,12 @@ void server_link_info(struct rudp_peer *_peer,
 {
     struct server_peer *peer = (struct server_peer *)_peer;
 
+    /* Token holding round-trip estimates as soon as they are known */
+    if ( (_peer->features & RUDP_FEATURE_RESUME)
+         && ((!peer->token_rtt && _peer->srtt > 0)
+             || rudp_timestamp() - peer->token_time > SERVER_TOKEN_REFRESH) )
+        server_token_send(peer->server, peer);
+
     peer->server->handler.link_info(peer->server, _peer, info,
             peer->server->arg);
 }
@@ -178,18 +350,51 @@ static const struct rudp_peer_handler server_peer_handler = {
     .dropped = server_peer_dropped,
 };
 
+/*
+  Arena is only allocated along the first peer, so that it stays out
+  of the server structure, and its layout out of the library ABI.
+ */
+static struct rudp_arena *server_peer_arena(struct rudp_server *server)
+{
+    struct rudp_arena *arena = server->peer_arena;
+
+    if ( arena != NULL )
+        return arena;
+
+    arena = rudp_mem_alloc(server->rudp, sizeof(*arena));
+    if ( arena == NULL )
+        return NULL;
+
+    rudp_arena_init(arena, server->rudp,
+                    server_peer_channels_offset()
+                    + (server->peer_channels > 1
+                       ? server->peer_channels
+                         * sizeof(struct rudp_peer_channel)
+                       : 0),
+                    SERVER_PEER_SLAB_SIZE);
+    server->peer_arena = arena;
+
+    return arena;
+}
+
 static struct server_peer *server_peer_new(struct rudp_server *server,
                                            const struct sockaddr_storage *addr)
 {
-    struct server_peer *peer = rudp_mem_alloc(server->rudp, sizeof(*peer));
+    struct rudp_arena *arena = server_peer_arena(server);
+    struct server_peer *peer;
+
+    if ( arena == NULL )
+        return NULL;
 
+    peer = rudp_arena_alloc(arena);
     if ( peer == NULL )
         return NULL;
 
-    rudp_peer_from_sockaddr(
+    rudp_peer_from_sockaddr_ev(
         &peer->base, server->rudp,
         addr, &server_peer_handler,
-        &server->endpoint);
+        &server->endpoint, server_peer_ev(peer),
+        server_peer_channels(server, peer), server->peer_channels);
 
     rudp_log_printf(server->rudp, RUDP_LOG_INFO, "New connection\n");
 
@@ -197,10 +402,230 @@ static struct server_peer *server_peer_new(struct rudp_server *server,
 
     peer->server = server;
     peer->user_data = NULL;
+    peer->token_time = 0;
+    peer->token_rtt = 0;
+
+    server_conn_id_alloc(server, peer);
 
     return peer;
 }
 
+/*
+  MAC of the len leading bytes of a cookie or token and of the client
+  address, written right after them.  Tokens outlive a NAT mapping,
+  they are not bound to the client port.  Cookies and tokens have
+  leading parts of different sizes, their MACs never match.  Returns
+  -1 for addresses of unknown families.
+ */
+static int server_mac(const struct rudp_server *server,
+                      const struct sockaddr_storage *addr,
+                      uint8_t *data, size_t len, int with_port)
+{
+    const union rudp_sockaddr_inet *inet =
+        (const union rudp_sockaddr_inet *)addr;
+    uint8_t msg[RUDP_TOKEN_SIZE + 2 + 2 + sizeof(struct in6_addr)];
+    uint16_t family = inet->sa.sa_family;
+    size_t pos = len;
+    uint64_t mac;
+    int i;
+
+    memcpy(msg, data, len);
+    memcpy(msg + pos, &family, 2);
+    pos += 2;
+
+    switch (family) {
+    case AF_INET:
+        if (with_port) {
+            memcpy(msg + pos, &inet->sin.sin_port, 2);
+            pos += 2;
+        }
+        memcpy(msg + pos, &inet->sin.sin_addr, sizeof(struct in_addr));
+        pos += sizeof(struct in_addr);
+        break;
+    case AF_INET6:
+        if (with_port) {
+            memcpy(msg + pos, &inet->sin6.sin6_port, 2);
+            pos += 2;
+        }
+        memcpy(msg + pos, &inet->sin6.sin6_addr, sizeof(struct in6_addr));
+        pos += sizeof(struct in6_addr);
+        break;
+    default:
+        return -1;
+    }
+
+    mac = rudp_siphash(server->cookie_key, msg, pos);
+
+    for (i = 0; i < 8; i++)
+        data[len + i] = (uint8_t)(mac >> (8 * i));
+
+    return 0;
+}
+
+/*
+  Checks the MAC of a cookie or token of size bytes, and that it was
+  issued less than lifetime seconds ago.  Its first 4 bytes are the
+  issue time.
+ */
+static int server_mac_valid(const struct rudp_server *server,
+                            const struct sockaddr_storage *addr,
+                            const uint8_t *data, size_t size,
+                            int with_port, uint32_t lifetime)
+{
+    uint8_t expected[RUDP_TOKEN_SIZE];
+    uint32_t issued, now = (uint32_t)(rudp_timestamp() / 1000);
+    uint8_t diff = 0;
+    size_t i;
+
+    memcpy(&issued, data, 4);
+    issued = ntohl(issued);
+
+    /* Also refuses the ones from the future */
+    if ( now - issued > lifetime )
+        return 0;
+
+    memcpy(expected, data, size - 8);
+    if ( server_mac(server, addr, expected, size - 8, with_port) )
+        return 0;
+
+    for (i = 0; i < size; i++)
+        diff |= expected[i] ^ data[i];
+
+    return diff == 0;
+}
+
+/*
+  A cookie is its issue time in seconds, followed by a MAC of that
+  time and of the client address and port.
+ */
+static int server_cookie_make(const struct rudp_server *server,
+                              const struct sockaddr_storage *addr,
+                              uint8_t cookie[RUDP_COOKIE_SIZE])
+{
+    uint32_t issued = htonl((uint32_t)(rudp_timestamp() / 1000));
+
+    memcpy(cookie, &issued, 4);
+
+    return server_mac(server, addr, cookie, 4, 1);
+}
+
+/*
+  A token is its issue time in seconds, the smoothed round-trip time
+  and its variation in ms, followed by a MAC of them and of the
+  client address.
+ */
+static void server_token_send(struct rudp_server *server,
+                              struct server_peer *peer)
+{
+    uint8_t token[RUDP_TOKEN_SIZE];
+    rudp_time_t now = rudp_timestamp();
+    uint32_t issued = htonl((uint32_t)(now / 1000));
+    uint16_t srtt = 0, rttvar = 0;
+
+    if ( peer->base.srtt > 0 ) {
+        srtt = htons((uint16_t)RUDP_MIN(peer->base.srtt, UINT16_MAX));
+        rttvar = htons((uint16_t)RUDP_MIN(peer->base.rttvar, UINT16_MAX));
+    }
+
+    memcpy(token, &issued, 4);
+    memcpy(token + 4, &srtt, 2);
+    memcpy(token + 6, &rttvar, 2);
+
+    if ( server_mac(server, (const struct sockaddr_storage *)&peer->base.address,
+                    token, 8, 0) )
+        return;
+
+    if ( rudp_peer_send_token(&peer->base, token) )
+        return;
+
+    peer->token_time = now;
+    peer->token_rtt = srtt != 0;
+}
+
+/*
+  A client resuming a connection presents a token instead of a
+  cookie.  Round-trip estimates it holds are returned.
+ */
+static int server_token_check(struct rudp_server *server,
+                              const struct sockaddr_storage *addr,
+                              const struct rudp_packet_chain *pc,
+                              rudp_time_t *srtt, rudp_time_t *rttvar)
+{
+    const struct rudp_packet_conn_req *conn_req = &pc->packet->conn_req;
+    const uint8_t *token = (const uint8_t *)(conn_req + 1);
+    uint16_t value;
+
+    if ( !(server->rudp->features & RUDP_FEATURE_RESUME)
+         || !(ntohl(conn_req->data) & RUDP_FEATURE_RESUME)
+         || pc->len != sizeof(*conn_req) + RUDP_TOKEN_SIZE )
+        return 0;
+
+    if ( !server_mac_valid(server, addr, token, RUDP_TOKEN_SIZE, 0,
+                           SERVER_TOKEN_LIFETIME) ) {
+        rudp_log_printf(server->rudp, RUDP_LOG_DEBUG,
+                        "Invalid resumption token\n");
+        return 0;
+    }
+
+    memcpy(&value, token + 4, 2);
+    *srtt = ntohs(value);
+    memcpy(&value, token + 6, 2);
+    *rttvar = ntohs(value);
+
+    return 1;
+}
+
+static void server_cookie_send(struct rudp_server *server,
+                               const struct sockaddr_storage *addr)
+{
+    struct rudp_packet_cookie packet;
+    socklen_t addrlen = addr->ss_family == AF_INET
+        ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+
+    memset(&packet, 0, sizeof(packet));
+    packet.header.version = RUDP_VERSION;
+    packet.header.command = RUDP_CMD_COOKIE;
+    packet.header.segments_size = htons(1);
+
+    if ( server_cookie_make(server, addr, packet.cookie) )
+        return;
+
+    rudp_endpoint_sendto(&server->endpoint, (const struct sockaddr *)addr,
+                         addrlen, &packet, sizeof(packet));
+}
+
+/*
+  Tells whether a connection request from an unknown address may
+  create a peer.  Clients offering cookies get one, and are only
+  accepted when they send it back from the same address.  This only
+  costs a MAC computation per spoofed request.
+ */
+static int server_cookie_check(struct rudp_server *server,
+                               const struct sockaddr_storage *addr,
+                               const struct rudp_packet_chain *pc)
+{
+    const struct rudp_packet_conn_req *conn_req = &pc->packet->conn_req;
+
+    if ( !(server->rudp->features & RUDP_FEATURE_COOKIE) )
+        return 1;
+
+    if ( !(ntohl(conn_req->data) & RUDP_FEATURE_COOKIE) ) {
+        if ( server->cookie_required )
+            rudp_log_printf(server->rudp, RUDP_LOG_DEBUG,
+                            "Connection without cookie refused\n");
+        return !server->cookie_required;
+    }
+
+    if ( pc->len == sizeof(*conn_req) + RUDP_COOKIE_SIZE
+         && server_mac_valid(server, addr, (const uint8_t *)(conn_req + 1),
+                             RUDP_COOKIE_SIZE, 1, SERVER_COOKIE_LIFETIME) )
+        return 1;
+
+    rudp_log_printf(server->rudp, RUDP_LOG_DEBUG, "Sending cookie\n");
+    server_cookie_send(server, addr);
+    return 0;
+}
+
 /*
   - socket watcher
      - endpoint packet reader
@@ -211,7 +636,7 @@ static struct server_peer *server_peer_new(struct rudp_server *server,
   If we can't find the source address, packet may be from a new peer
   or maybe garbage data.  We wont know until we pass the handshaking.
   Create a peer and answer unless we are absolutely sure it is
-  garbage.
+  garbage, or the client must prove its address with a cookie first.
  */
 static
 void server_handle_endpoint_packet(struct rudp_endpoint *endpoint,
@@ -219,9 +644,22 @@ void server_handle_endpoint_packet(struct rudp_endpoint *endpoint,
                                            struct rudp_packet_chain *pc)
 {
     struct rudp_server *server = __container_of(endpoint, struct rudp_server *, endpoint);
-    struct server_peer *peer = rudp_server_peer_lookup(server, addr);
+    uint32_t conn_id = rudp_packet_conn_id(pc->packet, pc->len);
+    struct server_peer *peer;
+    rudp_time_t srtt, rttvar;
     rudp_error_t err;
+    int resumed;
+
+    /* Clients with a connection id may come from a new address */
+    if ( conn_id != 0 ) {
+        peer = server_conn_id_lookup(server, conn_id);
+        if ( peer != NULL ) {
+            rudp_peer_incoming_packet_from(&peer->base, pc, addr);
+            return;
+        }
+    }
 
+    peer = rudp_server_peer_lookup(server, addr);
     if ( peer != NULL ) {
         rudp_peer_incoming_packet(&peer->base, pc);
         return;
@@ -229,19 +667,33 @@ void server_handle_endpoint_packet(struct rudp_endpoint *endpoint,
 
     struct rudp_packet_header *header = &pc->packet->header;
 
-    if ( pc->len != sizeof(struct rudp_packet_conn_req)
+    if ( (pc->len != sizeof(struct rudp_packet_conn_req)
+          && pc->len != sizeof(struct rudp_packet_conn_req) + RUDP_COOKIE_SIZE
+          && pc->len != sizeof(struct rudp_packet_conn_req) + RUDP_TOKEN_SIZE)
          || header->command != RUDP_CMD_CONN_REQ )
         goto garbage;
 
+    resumed = server_token_check(server, addr, pc, &srtt, &rttvar);
+    if ( ! resumed && ! server_cookie_check(server, addr, pc) )
+        return;
+
     peer = server_peer_new(server, addr);
     if ( peer == NULL )
         return;
 
+    if ( resumed )
+        rudp_peer_resume(&peer->base, srtt, rttvar);
+
     err = rudp_peer_incoming_packet(&peer->base, pc);
-    if ( err == 0 )
-        server->handler.peer_new(server, &peer->base, server->arg);
-    else
+    if ( err != 0 ) {
         server_peer_forget(server, peer);
+        return;
+    }
+
+    server->handler.peer_new(server, &peer->base, server->arg);
+
+    if ( peer->base.features & RUDP_FEATURE_RESUME )
+        server_token_send(server, peer);
     return;
 
 garbage:
@@ -252,6 +704,13 @@ static const struct rudp_endpoint_handler server_endpoint_handler = {
     .handle_packet = server_handle_endpoint_packet,
 };
 
+void rudp_server_set_cookie_required(
+    struct rudp_server *server,
+    int required)
+{
+    server->cookie_required = !!required;
+}
+
 rudp_error_t rudp_server_send(
     struct rudp_server *server,
     struct rudp_peer *peer,
@@ -265,21 +724,67 @@ rudp_error_t rudp_server_send(
     return rudp_peer_send(server->rudp, peer, reliable, command, data, size);
 }
 
+rudp_error_t rudp_server_send_channel(
+    struct rudp_server *server,
+    struct rudp_peer *peer,
+    unsigned int channel,
+    int reliable, int command,
+    const void *data,
+    const size_t size)
+{
+    if (server == NULL)
+        return EINVAL;
+
+    return rudp_peer_send_channel(peer, channel, reliable, command, data, size);
+}
+
+rudp_error_t rudp_server_send_partial(
+    struct rudp_server *server,
+    struct rudp_peer *peer,
+    unsigned int channel, int command,
+    const void *data,
+    const size_t size,
+    rudp_time_t ttl,
+    unsigned int max_retransmits)
+{
+    if (server == NULL)
+        return EINVAL;
+
+    return rudp_peer_send_partial(peer, channel, command, data, size,
+                                  ttl, max_retransmits);
+}
+
 rudp_error_t rudp_server_send_all(
     struct rudp_server *server,
     int reliable, int command,
     const void *data,
     const size_t size)
 {
+    struct rudp_payload *payload;
+    rudp_error_t ret = 0, err;
+
+    if ( server == NULL || data == NULL || size <= 0 )
+        return EINVAL;
+
     if ( (command + RUDP_CMD_APP) > 255 )
         return EINVAL;
 
+    /* Body is copied once, peers only get their own headers. */
+    payload = rudp_payload_new(server->rudp, data, size);
+    if ( payload == NULL )
+        return ENOMEM;
+
     struct server_peer *peer, *tmp;
     rudp_list_for_each_safe(struct server_peer *, peer, tmp, &server->peer_list, server_item)
     {
-        rudp_server_send(server, &peer->base, reliable, command, data, size);
+        err = rudp_peer_send_payload(&peer->base, 0, reliable, command,
+                                     payload);
+        if ( ret == 0 )
+            ret = err;
     }
-    return 0;
+
+    rudp_payload_release(server->rudp, payload);
+    return ret;
 }
 
 
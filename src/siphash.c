@@ -0,0 +1,71 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#include <stdint.h>
+
+#include "rudp_siphash.h"
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0, v1, v2, v3)                                \
+    do {                                                        \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;                  \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;                  \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+    } while (0)
+
+/* Little endian load, whatever the host order */
+static uint64_t load64(const uint8_t *p, size_t len)
+{
+    uint64_t v = 0;
+
+    while (len--)
+        v |= (uint64_t)p[len] << (8 * len);
+
+    return v;
+}
+
+uint64_t rudp_siphash(const uint8_t key[RUDP_SIPHASH_KEY_SIZE],
+                      const void *data, size_t len)
+{
+    const uint8_t *in = data;
+    uint64_t k0 = load64(key, 8);
+    uint64_t k1 = load64(key + 8, 8);
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+    uint64_t m, b = (uint64_t)len << 56;
+
+    for (; len >= 8; len -= 8, in += 8) {
+        m = load64(in, 8);
+        v3 ^= m;
+        SIPROUND(v0, v1, v2, v3);
+        SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    b |= load64(in, len);
+
+    v3 ^= b;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -0,0 +1,399 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "loopback.h"
+
+int failures;
+
+/* Packet held in the relay for lb->delay ms */
+struct loopback_delayed
+{
+    struct loopback_delayed *next;
+    struct timeval due;
+    evutil_socket_t fd;
+    struct sockaddr_in to;
+    size_t len;
+    uint8_t data[];
+};
+
+static void loopback_timeout_set(struct rudp_base *rudp)
+{
+    rudp->default_timeout.min_rto = 100;
+    rudp->default_timeout.max_rto = 2000;
+    rudp->default_timeout.action = 1000;
+    rudp->default_timeout.drop = 5000;
+}
+
+static void server_handle_packet(struct rudp_server *server,
+                                 struct rudp_peer *peer, int command,
+                                 const void *data, size_t len, void *arg)
+{
+    struct loopback *lb = arg;
+
+    (void)server;
+    (void)peer;
+
+    if (lb->handler.server_packet != NULL)
+        lb->handler.server_packet(lb, command, data, len);
+}
+
+static void server_link_info(struct rudp_server *server,
+                             struct rudp_peer *peer,
+                             struct rudp_link_info *info, void *arg)
+{
+    (void)server;
+    (void)peer;
+    (void)info;
+    (void)arg;
+}
+
+static void server_peer_dropped(struct rudp_server *server,
+                                struct rudp_peer *peer, void *arg)
+{
+    struct loopback *lb = arg;
+
+    (void)server;
+
+    if (lb->server_peer == peer)
+        lb->server_peer = NULL;
+}
+
+static void server_peer_new(struct rudp_server *server,
+                            struct rudp_peer *peer, void *arg)
+{
+    struct loopback *lb = arg;
+
+    (void)server;
+
+    lb->server_peer = peer;
+}
+
+static const struct rudp_server_handler server_handler = {
+    .handle_packet = server_handle_packet,
+    .link_info = server_link_info,
+    .peer_dropped = server_peer_dropped,
+    .peer_new = server_peer_new,
+};
+
+static void client_handle_packet(struct rudp_client *client, int command,
+                                 const void *data, size_t len, void *arg)
+{
+    struct loopback *lb = arg;
+
+    (void)client;
+
+    if (lb->handler.client_packet != NULL)
+        lb->handler.client_packet(lb, command, data, len);
+}
+
+static void client_link_info(struct rudp_client *client,
+                             struct rudp_link_info *info, void *arg)
+{
+    (void)client;
+    (void)info;
+    (void)arg;
+}
+
+static void client_connected(struct rudp_client *client, void *arg)
+{
+    struct loopback *lb = arg;
+
+    (void)client;
+
+    lb->connected = 1;
+    if (lb->handler.connected != NULL)
+        lb->handler.connected(lb);
+}
+
+static void client_server_lost(struct rudp_client *client, void *arg)
+{
+    struct loopback *lb = arg;
+
+    (void)client;
+
+    lb->connected = 0;
+    lb->lost++;
+}
+
+static const struct rudp_client_handler client_handler = {
+    .handle_packet = client_handle_packet,
+    .link_info = client_link_info,
+    .connected = client_connected,
+    .server_lost = client_server_lost,
+};
+
+static void relay_delay_arm(struct loopback *lb)
+{
+    struct timeval now, tv;
+
+    if (lb->delayed == NULL)
+        return;
+
+    event_base_gettimeofday_cached(lb->base, &now);
+    if (evutil_timercmp(&lb->delayed->due, &now, >))
+        evutil_timersub(&lb->delayed->due, &now, &tv);
+    else
+        evutil_timerclear(&tv);
+    evtimer_add(lb->delay_ev, &tv);
+}
+
+/* Sends the packets whose time came, in arrival order */
+static void relay_delayed_send(evutil_socket_t fd, short what, void *arg)
+{
+    struct loopback *lb = arg;
+    struct loopback_delayed *d;
+    struct timeval now;
+
+    (void)fd;
+    (void)what;
+
+    event_base_gettimeofday_cached(lb->base, &now);
+
+    while ((d = lb->delayed) != NULL
+           && !evutil_timercmp(&d->due, &now, >)) {
+        sendto(d->fd, d->data, d->len, 0,
+               (struct sockaddr *)&d->to, sizeof(d->to));
+        lb->delayed = d->next;
+        free(d);
+    }
+
+    if (lb->delayed == NULL)
+        lb->delayed_tail = &lb->delayed;
+    relay_delay_arm(lb);
+}
+
+static void relay_send(struct loopback *lb, evutil_socket_t fd,
+                       const uint8_t *data, size_t len,
+                       const struct sockaddr_in *to)
+{
+    struct timeval now, delay = { lb->delay / 1000,
+                                  (lb->delay % 1000) * 1000 };
+    struct loopback_delayed *d;
+    int idle = lb->delayed == NULL;
+
+    if (lb->delay == 0) {
+        sendto(fd, data, len, 0, (const struct sockaddr *)to, sizeof(*to));
+        return;
+    }
+
+    d = malloc(sizeof(*d) + len);
+    if (d == NULL)
+        return;
+
+    event_base_gettimeofday_cached(lb->base, &now);
+    evutil_timeradd(&now, &delay, &d->due);
+    d->next = NULL;
+    d->fd = fd;
+    d->to = *to;
+    d->len = len;
+    memcpy(d->data, data, len);
+    *lb->delayed_tail = d;
+    lb->delayed_tail = &d->next;
+
+    if (idle)
+        relay_delay_arm(lb);
+}
+
+void loopback_forward(struct loopback *lb, int to_server,
+                      const uint8_t *data, size_t len)
+{
+    if (to_server) {
+        lb->to_server++;
+        relay_send(lb, lb->relay_server_fd, data, len, &lb->server_addr);
+    } else {
+        lb->to_client++;
+        relay_send(lb, lb->relay_client_fd, data, len, &lb->client_addr);
+    }
+}
+
+static void relay_read(evutil_socket_t fd, short what, void *arg)
+{
+    struct loopback *lb = arg;
+    uint8_t buffer[65536];
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    int to_server = fd == lb->relay_client_fd;
+    ssize_t len;
+
+    (void)what;
+
+    len = recvfrom(fd, buffer, sizeof(buffer), 0,
+                   (struct sockaddr *)&from, &from_len);
+    if (len <= 0)
+        return;
+
+    if (to_server) {
+        lb->client_addr = from;
+        lb->have_client_addr = 1;
+    } else if (!lb->have_client_addr) {
+        return;
+    }
+
+    if (lb->handler.relay != NULL
+        && !lb->handler.relay(lb, to_server, buffer, len)) {
+        lb->dropped++;
+        return;
+    }
+
+    loopback_forward(lb, to_server, buffer, len);
+}
+
+static void timeout_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct loopback *lb = arg;
+
+    (void)fd;
+    (void)what;
+
+    lb->timed_out = 1;
+    event_base_loopbreak(lb->base);
+}
+
+void loopback_init(struct loopback *lb,
+                   const struct loopback_handler *handler, void *arg)
+{
+    memset(lb, 0, sizeof(*lb));
+    lb->handler = *handler;
+    lb->arg = arg;
+    lb->base = event_base_new();
+    lb->relay_client_fd = -1;
+    lb->relay_server_fd = -1;
+    lb->delayed_tail = &lb->delayed;
+    lb->delay_ev = evtimer_new(lb->base, relay_delayed_send, lb);
+
+    rudp_init(&lb->server_rudp, lb->base, RUDP_HANDLER_DEFAULT);
+    rudp_init(&lb->client_rudp, lb->base, RUDP_HANDLER_DEFAULT);
+    loopback_timeout_set(&lb->server_rudp);
+    loopback_timeout_set(&lb->client_rudp);
+}
+
+static evutil_socket_t loopback_socket(struct sockaddr_in *addr)
+{
+    socklen_t len = sizeof(*addr);
+    evutil_socket_t fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (fd < 0)
+        return -1;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(fd, (struct sockaddr *)addr, sizeof(*addr))
+        || getsockname(fd, (struct sockaddr *)addr, &len)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int loopback_start(struct loopback *lb)
+{
+    struct sockaddr_in relay_addr, unused;
+    struct in_addr lo;
+    socklen_t len = sizeof(lb->server_addr);
+
+    lo.s_addr = htonl(INADDR_LOOPBACK);
+
+    rudp_server_init(&lb->server, &lb->server_rudp, &server_handler, lb);
+    rudp_server_set_ipv4(&lb->server, &lo, 0);
+    if (rudp_server_bind(&lb->server))
+        return -1;
+    if (getsockname(lb->server.endpoint.socket_fd,
+                    (struct sockaddr *)&lb->server_addr, &len))
+        return -1;
+
+    lb->relay_client_fd = loopback_socket(&relay_addr);
+    lb->relay_server_fd = loopback_socket(&unused);
+    if (lb->relay_client_fd < 0 || lb->relay_server_fd < 0)
+        return -1;
+
+    lb->relay_client_ev = event_new(lb->base, lb->relay_client_fd,
+                                    EV_READ | EV_PERSIST, relay_read, lb);
+    lb->relay_server_ev = event_new(lb->base, lb->relay_server_fd,
+                                    EV_READ | EV_PERSIST, relay_read, lb);
+    event_add(lb->relay_client_ev, NULL);
+    event_add(lb->relay_server_ev, NULL);
+
+    rudp_client_init(&lb->client, &lb->client_rudp, &client_handler, lb);
+    rudp_client_set_ipv4(&lb->client, &lo, ntohs(relay_addr.sin_port));
+
+    return rudp_client_connect(&lb->client) ? -1 : 0;
+}
+
+int loopback_run(struct loopback *lb, unsigned int timeout)
+{
+    struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+
+    lb->timed_out = 0;
+    lb->timeout_ev = evtimer_new(lb->base, timeout_cb, lb);
+    evtimer_add(lb->timeout_ev, &tv);
+
+    event_base_dispatch(lb->base);
+
+    event_free(lb->timeout_ev);
+    lb->timeout_ev = NULL;
+
+    return lb->timed_out ? -1 : 0;
+}
+
+void loopback_stop(struct loopback *lb)
+{
+    event_base_loopbreak(lb->base);
+}
+
+void loopback_wait(struct loopback *lb, unsigned int ms)
+{
+    struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+
+    event_base_loopexit(lb->base, &tv);
+    event_base_dispatch(lb->base);
+}
+
+void loopback_deinit(struct loopback *lb)
+{
+    struct loopback_delayed *d;
+
+    while ((d = lb->delayed) != NULL) {
+        lb->delayed = d->next;
+        free(d);
+    }
+    event_free(lb->delay_ev);
+
+    rudp_client_deinit(&lb->client);
+    rudp_server_deinit(&lb->server);
+
+    if (lb->relay_client_ev != NULL)
+        event_free(lb->relay_client_ev);
+    if (lb->relay_server_ev != NULL)
+        event_free(lb->relay_server_ev);
+    if (lb->relay_client_fd >= 0)
+        close(lb->relay_client_fd);
+    if (lb->relay_server_fd >= 0)
+        close(lb->relay_server_fd);
+
+    rudp_deinit(&lb->client_rudp);
+    rudp_deinit(&lb->server_rudp);
+    event_base_free(lb->base);
+}
+
+int loopback_report(const char *name)
+{
+    printf("%s: %d failure(s)\n", name, failures);
+    return failures != 0;
+}
@@ -0,0 +1,153 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+#ifndef RUDP_TEST_LOOPBACK_H_
+#define RUDP_TEST_LOOPBACK_H_
+
+/*
+  A client and a server in the same event loop, talking through a
+  relay on loopback.  Tests look at and drop packets in the relay,
+  and get the messages both sides receive.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <netinet/in.h>
+
+#include <event2/event.h>
+
+#include <rudp/rudp.h>
+#include <rudp/client.h>
+#include <rudp/server.h>
+
+extern int failures;
+
+#define check(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d %s failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while(0)
+
+struct loopback;
+struct loopback_delayed;
+
+struct loopback_handler
+{
+    /* Client got connected, may be NULL */
+    void (*connected)(struct loopback *lb);
+
+    /* Message received by the server, or by the client, may be NULL */
+    void (*server_packet)(struct loopback *lb, int command,
+                          const void *data, size_t len);
+    void (*client_packet)(struct loopback *lb, int command,
+                          const void *data, size_t len);
+
+    /* Packet crossing the relay, towards the server or the client.
+       Returns whether to forward it.  May be NULL. */
+    int (*relay)(struct loopback *lb, int to_server,
+                 const uint8_t *data, size_t len);
+};
+
+struct loopback
+{
+    struct loopback_handler handler;
+    void *arg;
+    struct event_base *base;
+    struct rudp_base server_rudp;
+    struct rudp_base client_rudp;
+    struct rudp_server server;
+    struct rudp_client client;
+    /* Peer of the client on the server side, once connected */
+    struct rudp_peer *server_peer;
+    int connected;
+    int lost;
+
+    evutil_socket_t relay_client_fd;
+    evutil_socket_t relay_server_fd;
+    struct event *relay_client_ev;
+    struct event *relay_server_ev;
+    struct sockaddr_in server_addr;
+    struct sockaddr_in client_addr;
+    int have_client_addr;
+    struct event *timeout_ev;
+    int timed_out;
+
+    /* Time packets spend in the relay, each way, in ms.  Delayed
+       packets keep their order. */
+    unsigned int delay;
+    struct loopback_delayed *delayed;
+    struct loopback_delayed **delayed_tail;
+    struct event *delay_ev;
+
+    /* Packets forwarded by the relay, and dropped by the handler */
+    unsigned int to_server, to_client, dropped;
+};
+
+/*
+  Creates the event base and both rudp contexts, with the default
+  timeouts shortened for tests.  Tests tune the contexts before
+  loopback_start.
+ */
+void loopback_init(struct loopback *lb,
+                   const struct loopback_handler *handler, void *arg);
+
+/*
+  Binds the server and the relay, and connects the client.  Returns
+  0, or -1 if sockets could not be bound.
+ */
+int loopback_start(struct loopback *lb);
+
+/*
+  Runs the event loop until loopback_stop is called, or for at most
+  timeout ms.  Returns 0 if stopped, -1 on timeout.
+ */
+int loopback_run(struct loopback *lb, unsigned int timeout);
+
+void loopback_stop(struct loopback *lb);
+
+/*
+  Runs the event loop for ms milliseconds, whatever happens.
+ */
+void loopback_wait(struct loopback *lb, unsigned int ms);
+
+void loopback_deinit(struct loopback *lb);
+
+/*
+  Forwards a packet the relay handler dropped earlier, to reorder
+  packets.  Sent before the one being relayed, if called from the
+  handler.
+ */
+void loopback_forward(struct loopback *lb, int to_server,
+                      const uint8_t *data, size_t len);
+
+/*
+  Command and option bytes of a wire packet, they are at the same
+  place in all header formats.
+ */
+static __inline uint8_t loopback_command(const uint8_t *data)
+{
+    return data[1];
+}
+
+static __inline uint8_t loopback_opt(const uint8_t *data)
+{
+    return data[2];
+}
+
+/*
+  Prints the failure count, returns the test exit status.
+ */
+int loopback_report(const char *name);
+
+#endif
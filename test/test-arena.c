@@ -0,0 +1,143 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Peer slab arena: objects are aligned and distinct, freed ones are
+  reused before any new slab, allocation failures are reported, and
+  everything goes back to the rudp allocator on deinit.  Servers
+  without peers allocate no arena.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <event2/event.h>
+
+#include <rudp/rudp.h>
+#include <rudp/server.h>
+
+#include "rudp_arena.h"
+
+static int failures;
+
+#define check(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d %s failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while(0)
+
+#define SLAB 4
+
+/* Allocations not freed yet, and allocations left before failing,
+   -1 for no limit */
+static int outstanding;
+static int allowed = -1;
+
+static void *counting_alloc(struct rudp_base *rudp, size_t size)
+{
+    (void)rudp;
+
+    if (allowed == 0)
+        return NULL;
+    if (allowed > 0)
+        allowed--;
+
+    outstanding++;
+    return malloc(size);
+}
+
+static void counting_free(struct rudp_base *rudp, void *buffer)
+{
+    (void)rudp;
+
+    outstanding--;
+    free(buffer);
+}
+
+static void test_arena(struct rudp_base *rudp)
+{
+    struct rudp_arena arena;
+    uint8_t *objects[2 * SLAB + 1];
+    void *last;
+    size_t i, j;
+
+    rudp_arena_init(&arena, rudp, 10, SLAB);
+    check(arena.object_size == 16);
+
+    for (i = 0; i < 2 * SLAB + 1; i++) {
+        objects[i] = rudp_arena_alloc(&arena);
+        check(objects[i] != NULL);
+        check((uintptr_t)objects[i] % 16 == 0);
+        for (j = 0; j < i; j++)
+            check(objects[i] != objects[j]);
+    }
+    check(arena.slab_count == 3);
+
+    /* Fresh objects are handed out in slab order */
+    check(objects[1] == objects[0] + arena.object_size);
+
+    /* Last freed is reused first, without a new slab */
+    last = objects[2 * SLAB];
+    rudp_arena_free(&arena, objects[3]);
+    rudp_arena_free(&arena, last);
+    check(rudp_arena_alloc(&arena) == last);
+    check(rudp_arena_alloc(&arena) == objects[3]);
+
+    /* Remaining objects of the third slab, then failure to grow */
+    for (i = 1; i < SLAB; i++)
+        check(rudp_arena_alloc(&arena) != NULL);
+    allowed = 0;
+    check(rudp_arena_alloc(&arena) == NULL);
+    check(arena.slab_count == 3);
+    allowed = -1;
+    check(rudp_arena_alloc(&arena) != NULL);
+    check(arena.slab_count == 4);
+
+    rudp_arena_deinit(&arena);
+    check(outstanding == 0);
+}
+
+static void test_server(struct rudp_base *rudp)
+{
+    static const struct rudp_server_handler handler;
+    struct rudp_server server;
+
+    rudp_server_init(&server, rudp, &handler, NULL);
+    check(server.peer_arena == NULL);
+    rudp_server_deinit(&server);
+    check(outstanding == 0);
+}
+
+int main(int argc, char **argv)
+{
+    struct rudp_handler rudp_handler = rudp_handler_default;
+    struct event_base *base = event_base_new();
+    struct rudp_base rudp;
+
+    (void)argc;
+
+    rudp_handler.mem_alloc = counting_alloc;
+    rudp_handler.mem_free = counting_free;
+    rudp_init(&rudp, base, &rudp_handler);
+    outstanding = 0;
+
+    test_arena(&rudp);
+    test_server(&rudp);
+
+    rudp_deinit(&rudp);
+    event_base_free(base);
+
+    printf("%s: %d failure(s)\n", argv[0], failures);
+    return failures != 0;
+}
@@ -0,0 +1,179 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Retransmission backoff.  While a message is lost, its
+  retransmission timeout doubles each time, shortened by no more than
+  the jitter range, and an acknowledge ends the backoff.  Past the
+  retry limit, the message is skipped and the next one goes through,
+  or the server is lost when skipping was not agreed on.
+ */
+
+#include <string.h>
+
+#include <rudp/packet.h>
+#include <rudp/peer.h>
+
+#include "loopback.h"
+
+#define MAX_RTO 4000
+#define JITTER 50
+#define LOST 3
+#define RETRIES 1
+
+enum command
+{
+    COMMAND_LOST = 1,
+    COMMAND_NEXT,
+};
+
+struct backoff_test
+{
+    /* Transmissions of the lost message to drop, -1 for all */
+    int drop;
+    unsigned int sent;
+    rudp_time_t rto[LOST + 1];
+    unsigned int backoff[LOST + 1];
+    unsigned int received[3];
+};
+
+static void connected(struct loopback *lb)
+{
+    check(rudp_client_send(&lb->client, 1, COMMAND_LOST, "lost", 4) == 0);
+    check(rudp_client_send(&lb->client, 1, COMMAND_NEXT, "next", 4) == 0);
+}
+
+static void server_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    struct backoff_test *t = lb->arg;
+
+    (void)data;
+    (void)len;
+
+    check(command == COMMAND_LOST || command == COMMAND_NEXT);
+    if (command != COMMAND_LOST && command != COMMAND_NEXT)
+        return;
+
+    t->received[command]++;
+    if (command == COMMAND_NEXT)
+        loopback_stop(lb);
+}
+
+/* Retransmission timeout in use when each transmission of the lost
+   message went out */
+static int relay(struct loopback *lb, int to_server,
+                 const uint8_t *data, size_t len)
+{
+    struct backoff_test *t = lb->arg;
+
+    (void)len;
+
+    if (!to_server || loopback_command(data) != RUDP_CMD_APP + COMMAND_LOST)
+        return 1;
+
+    if (t->sent <= LOST) {
+        t->rto[t->sent] = lb->client.peer.rto;
+        t->backoff[t->sent] = lb->client.peer.backoff;
+    }
+
+    return t->drop >= 0 && ++t->sent > (unsigned int)t->drop;
+}
+
+static const struct loopback_handler handler = {
+    .connected = connected,
+    .server_packet = server_packet,
+    .relay = relay,
+};
+
+static void loopback_setup(struct loopback *lb, struct backoff_test *t,
+                           int drop)
+{
+    memset(t, 0, sizeof(*t));
+    t->drop = drop;
+
+    loopback_init(lb, &handler, t);
+    lb->client_rudp.default_timeout.max_rto = MAX_RTO;
+}
+
+static void test_backoff(unsigned int jitter)
+{
+    struct backoff_test t;
+    struct loopback lb;
+    rudp_time_t rto;
+    unsigned int i;
+
+    loopback_setup(&lb, &t, LOST);
+    lb.client_rudp.default_timeout.jitter = jitter;
+
+    check(loopback_start(&lb) == 0);
+    check(loopback_run(&lb, 5000) == 0);
+    check(lb.lost == 0);
+    check(t.received[COMMAND_LOST] == 1);
+    check(t.received[COMMAND_NEXT] == 1);
+    check(t.sent == LOST + 1);
+
+    /* First transmission goes out before any backoff, timeouts then
+       double from there, shortened by jitter */
+    check(t.backoff[0] == 0);
+    check(t.backoff[LOST] >= 2);
+    for (i = 1; i <= LOST; i++) {
+        rto = t.rto[0] << t.backoff[i];
+        if (rto > MAX_RTO)
+            rto = MAX_RTO;
+        check(t.rto[i] <= rto);
+        check(t.rto[i] >= rto - rto * jitter / 100);
+    }
+
+    /* Acknowledge ended the backoff */
+    loopback_wait(&lb, 100);
+    check(lb.client.peer.backoff == 0);
+    check(lb.client.peer.rto < t.rto[LOST]);
+
+    loopback_deinit(&lb);
+}
+
+static void test_retries(uint32_t server_features)
+{
+    int skip = !!(server_features & RUDP_FEATURE_SKIP);
+    struct backoff_test t;
+    struct loopback lb;
+
+    loopback_setup(&lb, &t, -1);
+    lb.client_rudp.default_timeout.retries = RETRIES;
+    rudp_set_features(&lb.server_rudp, server_features);
+
+    check(loopback_start(&lb) == 0);
+    loopback_run(&lb, 4500);
+    check(t.received[COMMAND_LOST] == 0);
+
+    if (skip) {
+        check(lb.lost == 0);
+        check(t.received[COMMAND_NEXT] == 1);
+    } else {
+        check(lb.lost == 1);
+        check(t.received[COMMAND_NEXT] == 0);
+    }
+
+    loopback_deinit(&lb);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    test_backoff(0);
+    test_backoff(JITTER);
+    test_retries(RUDP_FEATURE_ALL);
+    test_retries(RUDP_FEATURE_ALL & ~RUDP_FEATURE_SKIP);
+
+    return loopback_report(argv[0]);
+}
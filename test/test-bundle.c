@@ -0,0 +1,149 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Bundling of small messages.  A burst of small messages goes out in
+  a few bundle packets, one per reliability, and each message is
+  delivered on its own, reliable ones in order even when a bundle is
+  lost.  Without the feature agreed on, each message has its packet.
+ */
+
+#include <string.h>
+
+#include <rudp/packet.h>
+#include <rudp/peer.h>
+
+#include "loopback.h"
+
+#define COUNT 10
+#define SIZE 50
+#define DELAY 20
+
+struct bundle_test
+{
+    unsigned int reliable_received;
+    unsigned int unreliable_received;
+    unsigned int bundles;
+    unsigned int packets;
+    int dropped;
+};
+
+static void connected(struct loopback *lb)
+{
+    uint8_t buffer[SIZE];
+    unsigned int i;
+
+    for (i = 0; i < COUNT; i++) {
+        memset(buffer, i, SIZE);
+        check(rudp_client_send(&lb->client, 1, 0, buffer, SIZE) == 0);
+    }
+
+    for (i = 0; i < COUNT; i++) {
+        memset(buffer, i, SIZE);
+        check(rudp_client_send(&lb->client, 0, 1, buffer, SIZE) == 0);
+    }
+}
+
+static void server_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    struct bundle_test *t = lb->arg;
+    const uint8_t *bytes = data;
+
+    check(len == SIZE);
+    if (len != SIZE)
+        return;
+    check(bytes[0] == bytes[SIZE - 1]);
+
+    if (command == 0) {
+        check(bytes[0] == t->reliable_received);
+        t->reliable_received++;
+    } else {
+        t->unreliable_received++;
+    }
+
+    if (t->reliable_received == COUNT && t->unreliable_received == COUNT)
+        loopback_stop(lb);
+}
+
+/* First transmission of the first reliable bundle is lost */
+static int relay(struct loopback *lb, int to_server,
+                 const uint8_t *data, size_t len)
+{
+    struct bundle_test *t = lb->arg;
+    uint8_t command = loopback_command(data);
+
+    (void)len;
+
+    if (!to_server)
+        return 1;
+
+    if (command >= RUDP_CMD_APP)
+        t->packets++;
+
+    if (command != RUDP_CMD_BUNDLE)
+        return 1;
+
+    t->bundles++;
+
+    if (t->dropped || !(loopback_opt(data) & RUDP_OPT_RELIABLE))
+        return 1;
+
+    t->dropped = 1;
+    return 0;
+}
+
+static const struct loopback_handler handler = {
+    .connected = connected,
+    .server_packet = server_packet,
+    .relay = relay,
+};
+
+static void run(uint32_t server_features)
+{
+    int bundle = !!(server_features & RUDP_FEATURE_BUNDLE);
+    struct bundle_test t;
+    struct loopback lb;
+
+    memset(&t, 0, sizeof(t));
+
+    loopback_init(&lb, &handler, &t);
+    rudp_set_features(&lb.server_rudp, server_features);
+    rudp_set_bundle_delay(&lb.client_rudp, DELAY);
+
+    check(loopback_start(&lb) == 0);
+    check(loopback_run(&lb, 5000) == 0);
+    check(lb.lost == 0);
+    check(t.reliable_received == COUNT);
+    check(t.unreliable_received == COUNT);
+
+    if (bundle) {
+        /* Both bundles, and the reliable one again */
+        check(t.bundles == 3);
+        check(t.packets == 0);
+        check(lb.dropped == 1);
+    } else {
+        check(t.bundles == 0);
+        check(t.packets == 2 * COUNT);
+    }
+
+    loopback_deinit(&lb);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    run(RUDP_FEATURE_ALL);
+    run(RUDP_FEATURE_ALL & ~RUDP_FEATURE_BUNDLE);
+
+    return loopback_report(argv[0]);
+}
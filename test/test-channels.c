@@ -0,0 +1,234 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Independent channels.  Connection uses the lowest channel count of
+  both sides, and refuses sending on others.  A message waiting for
+  the retransmission of a lost one only waits if it is on the same
+  channel: on another, it is delivered first.  A message on a channel
+  of higher priority goes out before a bulk transfer queued earlier
+  on another channel, and after it otherwise.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <rudp/packet.h>
+#include <rudp/peer.h>
+
+#include "loopback.h"
+
+#define SIZE 100
+#define BULK 20000
+
+struct channels_test
+{
+    unsigned int channels;
+    unsigned int second_channel;
+    unsigned int order[2];
+    unsigned int received;
+    int dropped;
+    int priority;
+    unsigned int bulk_sent;
+    unsigned int bulk_before;
+};
+
+static void connected(struct loopback *lb)
+{
+    struct channels_test *t = lb->arg;
+    uint8_t buffer[SIZE];
+
+    check(lb->client.peer.channel_count == t->channels);
+
+    memset(buffer, 0, SIZE);
+    check(rudp_client_send_channel(&lb->client, t->channels, 1, 0,
+                                   buffer, SIZE) == EINVAL);
+
+    check(rudp_client_send_channel(&lb->client, 0, 1, 0,
+                                   buffer, SIZE) == 0);
+    memset(buffer, 1, SIZE);
+    check(rudp_client_send_channel(&lb->client, t->second_channel, 1, 1,
+                                   buffer, SIZE) == 0);
+}
+
+static void server_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    struct channels_test *t = lb->arg;
+    uint8_t buffer[SIZE];
+
+    check(lb->server_peer->channel_count == t->channels);
+
+    memset(buffer, command, SIZE);
+    check(len == SIZE && !memcmp(data, buffer, len));
+
+    if (t->received < 2)
+        t->order[t->received] = command;
+    if (++t->received == 2)
+        loopback_stop(lb);
+}
+
+/* First transmission of the first message is lost */
+static int relay(struct loopback *lb, int to_server,
+                 const uint8_t *data, size_t len)
+{
+    struct channels_test *t = lb->arg;
+
+    (void)len;
+
+    if (!to_server || loopback_command(data) != RUDP_CMD_APP
+        || (loopback_opt(data) & RUDP_OPT_RETRANSMITTED) || t->dropped)
+        return 1;
+
+    t->dropped = 1;
+    return 0;
+}
+
+static const struct loopback_handler handler = {
+    .connected = connected,
+    .server_packet = server_packet,
+    .relay = relay,
+};
+
+static void run(unsigned int client_channels, unsigned int server_channels,
+                unsigned int second_channel)
+{
+    struct channels_test t;
+    struct loopback lb;
+
+    memset(&t, 0, sizeof(t));
+    t.channels = client_channels < server_channels
+        ? client_channels : server_channels;
+    t.second_channel = second_channel;
+
+    loopback_init(&lb, &handler, &t);
+    check(rudp_set_channels(&lb.client_rudp, 0) == EINVAL);
+    check(rudp_set_channels(&lb.client_rudp, client_channels) == 0);
+    check(rudp_set_channels(&lb.server_rudp, server_channels) == 0);
+
+    check(loopback_start(&lb) == 0);
+    check(loopback_run(&lb, 5000) == 0);
+    check(lb.lost == 0);
+    check(lb.dropped == 1);
+    check(t.received == 2);
+
+    /* Other channel does not wait for the retransmission */
+    if (second_channel != 0) {
+        check(t.order[0] == 1);
+        check(t.order[1] == 0);
+    } else {
+        check(t.order[0] == 0);
+        check(t.order[1] == 1);
+    }
+
+    loopback_deinit(&lb);
+}
+
+static void priority_connected(struct loopback *lb)
+{
+    struct channels_test *t = lb->arg;
+    static uint8_t bulk[BULK];
+    uint8_t buffer[SIZE];
+
+    check(rudp_client_set_channel_priority(&lb->client, 2, 1) == EINVAL);
+    if (t->priority)
+        check(rudp_client_set_channel_priority(&lb->client, 1, 1) == 0);
+
+    memset(bulk, 0, BULK);
+    check(rudp_client_send_channel(&lb->client, 0, 1, 0,
+                                   bulk, BULK) == 0);
+    memset(buffer, 1, SIZE);
+    check(rudp_client_send_channel(&lb->client, 1, 1, 1,
+                                   buffer, SIZE) == 0);
+}
+
+static void priority_server_packet(struct loopback *lb, int command,
+                                   const void *data, size_t len)
+{
+    struct channels_test *t = lb->arg;
+
+    (void)data;
+
+    check(len == (command ? SIZE : BULK));
+
+    if (t->received < 2)
+        t->order[t->received] = command;
+    if (++t->received == 2)
+        loopback_stop(lb);
+}
+
+/* Bulk segments sent before the other message */
+static int priority_relay(struct loopback *lb, int to_server,
+                          const uint8_t *data, size_t len)
+{
+    struct channels_test *t = lb->arg;
+
+    (void)len;
+
+    if (!to_server)
+        return 1;
+
+    if (loopback_command(data) == RUDP_CMD_APP)
+        t->bulk_sent++;
+    else if (loopback_command(data) == RUDP_CMD_APP + 1)
+        t->bulk_before = t->bulk_sent;
+
+    return 1;
+}
+
+static const struct loopback_handler priority_handler = {
+    .connected = priority_connected,
+    .server_packet = priority_server_packet,
+    .relay = priority_relay,
+};
+
+static void run_priority(int priority)
+{
+    struct channels_test t;
+    struct loopback lb;
+
+    memset(&t, 0, sizeof(t));
+    t.priority = priority;
+
+    loopback_init(&lb, &priority_handler, &t);
+    rudp_set_channels(&lb.client_rudp, 2);
+    rudp_set_channels(&lb.server_rudp, 2);
+
+    check(loopback_start(&lb) == 0);
+    check(loopback_run(&lb, 5000) == 0);
+    check(lb.lost == 0);
+    check(t.received == 2);
+    check(t.bulk_sent > 1);
+
+    if (priority) {
+        check(t.bulk_before == 0);
+        check(t.order[0] == 1);
+    } else {
+        check(t.bulk_before == t.bulk_sent);
+        check(t.order[0] == 0);
+    }
+
+    loopback_deinit(&lb);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    run(4, 4, 1);
+    run(4, 2, 1);
+    run(4, 4, 0);
+
+    run_priority(1);
+    run_priority(0);
+
+    return loopback_report(argv[0]);
+}
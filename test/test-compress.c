@@ -0,0 +1,230 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Block codec round trips, and blocks a peer could forge: the
+  decompressor must refuse them without reading or writing out of
+  bounds.  Then compressed messages between a client and a server,
+  with and without the server agreeing on compression.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rudp/packet.h>
+
+#include "rudp_compress.h"
+#include "loopback.h"
+
+#define SIZE 4096
+#define SMALL 100
+
+static void fill(uint8_t *data, size_t size)
+{
+    size_t i;
+
+    /* Repetitive enough to compress, with long runs and literals */
+    for (i = 0; i < size; i++)
+        data[i] = (i % 1000) < 300 ? 'a' : (uint8_t)(i * 7 / 13);
+}
+
+static void test_round_trip(void)
+{
+    uint8_t *data = malloc(SIZE);
+    uint8_t *block = malloc(2 * SIZE);
+    uint8_t *out = malloc(SIZE + 1);
+    size_t size, len;
+
+    fill(data, SIZE);
+
+    size = rudp_compress(data, SIZE, block, 2 * SIZE);
+    check(size != 0);
+    check(size < SIZE);
+
+    memset(out, 0, SIZE);
+    check(rudp_decompress(block, size, out, SIZE) == 0);
+    check(memcmp(out, data, SIZE) == 0);
+
+    /* Size must match exactly */
+    check(rudp_decompress(block, size, out, SIZE - 1) == -1);
+    check(rudp_decompress(block, size, out, SIZE + 1) == -1);
+
+    /* Truncated blocks fall short of the output size, but for a
+       trailing empty token, which adds nothing */
+    for (len = 0; len < size; len++) {
+        if (len == size - 1 && block[len] == 0)
+            check(rudp_decompress(block, len, out, SIZE) == 0);
+        else
+            check(rudp_decompress(block, len, out, SIZE) == -1);
+    }
+
+    /* Compressor gives up when output does not fit */
+    check(rudp_compress(data, SIZE, block, 16) == 0);
+
+    /* Incompressible data still round trips */
+    for (len = 0; len < 64; len++)
+        data[len] = (uint8_t)(len * 37 + 11);
+    size = rudp_compress(data, 64, block, 2 * SIZE);
+    check(size != 0);
+    check(rudp_decompress(block, size, out, 64) == 0);
+    check(memcmp(out, data, 64) == 0);
+
+    free(data);
+    free(block);
+    free(out);
+}
+
+static void test_malformed(void)
+{
+    uint8_t out[64];
+    uint8_t block[300];
+
+    memset(block, 0, sizeof(block));
+
+    /* Empty block is only valid for an empty message */
+    check(rudp_decompress(block, 0, out, 0) == 0);
+    check(rudp_decompress(block, 0, out, 1) == -1);
+
+    /* Two literals announced, one present */
+    block[0] = 0x20; block[1] = 'x';
+    check(rudp_decompress(block, 2, out, 2) == -1);
+
+    /* More literals than room in output */
+    block[0] = 0x40; memcpy(block + 1, "abcd", 4);
+    check(rudp_decompress(block, 5, out, 3) == -1);
+
+    /* Missing offset after literals, one of two bytes */
+    block[0] = 0x10; block[1] = 'x'; block[2] = 0x01;
+    check(rudp_decompress(block, 3, out, 5) == -1);
+
+    /* Zero offset */
+    block[0] = 0x10; block[1] = 'x'; block[2] = 0; block[3] = 0;
+    check(rudp_decompress(block, 4, out, 5) == -1);
+
+    /* Offset reaching before the start of output */
+    block[0] = 0x10; block[1] = 'x'; block[2] = 2; block[3] = 0;
+    check(rudp_decompress(block, 4, out, 5) == -1);
+
+    /* Match running past the end of output */
+    block[0] = 0x15; block[1] = 'x'; block[2] = 1; block[3] = 0;
+    check(rudp_decompress(block, 4, out, 5) == -1);
+
+    /* Same match, fitting output, overlapping copy */
+    check(rudp_decompress(block, 4, out, 10) == 0);
+    check(memcmp(out, "xxxxxxxxxx", 10) == 0);
+
+    /* Extended literal length cut in the middle */
+    block[0] = 0xf0; block[1] = 255; block[2] = 255;
+    check(rudp_decompress(block, 3, out, sizeof(out)) == -1);
+
+    /* Extended literal length far above what the block holds */
+    memset(block + 1, 255, 200);
+    block[201] = 0;
+    check(rudp_decompress(block, 202, out, sizeof(out)) == -1);
+
+    /* Extended match length cut in the middle */
+    block[0] = 0x1f; block[1] = 'x'; block[2] = 1; block[3] = 0;
+    block[4] = 255;
+    check(rudp_decompress(block, 5, out, sizeof(out)) == -1);
+
+    /* Extended match length larger than output */
+    block[4] = 200;
+    check(rudp_decompress(block, 5, out, sizeof(out)) == -1);
+}
+
+struct compress_test
+{
+    unsigned int received;
+    unsigned int compressed;
+};
+
+static void connected(struct loopback *lb)
+{
+    uint8_t data[SIZE];
+
+    fill(data, SIZE);
+    check(rudp_client_send(&lb->client, 1, 0, data, SIZE) == 0);
+    check(rudp_client_send(&lb->client, 1, 0, data, SMALL) == 0);
+}
+
+static void server_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    struct compress_test *t = lb->arg;
+    uint8_t buffer[SIZE];
+
+    (void)command;
+
+    /* Large message first, then one below the compression threshold */
+    fill(buffer, SIZE);
+    check(len == (t->received == 0 ? SIZE : SMALL));
+    check(len <= SIZE && !memcmp(data, buffer, len));
+
+    if (++t->received == 2)
+        loopback_stop(lb);
+}
+
+static int relay(struct loopback *lb, int to_server,
+                 const uint8_t *data, size_t len)
+{
+    struct compress_test *t = lb->arg;
+
+    (void)len;
+
+    if (to_server && loopback_command(data) >= RUDP_CMD_APP
+        && (loopback_opt(data) & RUDP_OPT_COMPRESSED))
+        t->compressed++;
+
+    return 1;
+}
+
+static const struct loopback_handler handler = {
+    .connected = connected,
+    .server_packet = server_packet,
+    .relay = relay,
+};
+
+static void test_link(uint32_t server_features)
+{
+    struct compress_test t = { 0, 0 };
+    struct loopback lb;
+
+    loopback_init(&lb, &handler, &t);
+    rudp_set_features(&lb.server_rudp, server_features);
+    rudp_set_compression(&lb.client_rudp, SMALL + 1);
+
+    check(loopback_start(&lb) == 0);
+    check(loopback_run(&lb, 5000) == 0);
+    check(t.received == 2);
+    check(lb.lost == 0);
+
+    /* Large message fits in fewer segments than uncompressed */
+    if (server_features & RUDP_FEATURE_COMPRESS)
+        check(t.compressed > 0 && t.compressed < SIZE / 1000);
+    else
+        check(t.compressed == 0);
+
+    loopback_deinit(&lb);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    test_round_trip();
+    test_malformed();
+    test_link(RUDP_FEATURE_ALL);
+    test_link(RUDP_FEATURE_ALL & ~RUDP_FEATURE_COMPRESS);
+
+    return loopback_report(argv[0]);
+}
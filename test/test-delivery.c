@@ -0,0 +1,184 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Unreliable delivery modes.  A reliable message is lost, two
+  unreliable ones follow and come in reverse order, then another
+  reliable one.  Ordered messages are dropped as a reliable one is
+  missing, sequenced ones only if older than the last one, unordered
+  ones never.  Without the feature agreed on, messages are ordered.
+  Reliable messages always come all, in order.
+
+  Fast lane is left out: its unreliable messages overtake the reliable
+  ones and only wait for acknowledged ones.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <rudp/packet.h>
+#include <rudp/peer.h>
+
+#include "loopback.h"
+
+#define SIZE 100
+#define FEATURES (RUDP_FEATURE_ALL & ~RUDP_FEATURE_FAST_LANE)
+
+/* Commands, in sending order */
+enum command
+{
+    COMMAND_LOST,
+    COMMAND_HELD,
+    COMMAND_PASSED,
+    COMMAND_LAST,
+    COMMAND_COUNT,
+};
+
+struct delivery_test
+{
+    enum rudp_delivery delivery;
+    unsigned int received[COMMAND_COUNT];
+    unsigned int reliable_received;
+    int lost_dropped;
+    uint8_t held[2048];
+    size_t held_len;
+};
+
+static void message_send(struct loopback *lb, int reliable,
+                         enum command command)
+{
+    uint8_t buffer[SIZE];
+
+    memset(buffer, command, SIZE);
+    check(rudp_client_send(&lb->client, reliable, command,
+                           buffer, SIZE) == 0);
+}
+
+static void connected(struct loopback *lb)
+{
+    struct delivery_test *t = lb->arg;
+
+    check(rudp_client_set_channel_delivery(&lb->client, 0, t->delivery) == 0);
+    check(rudp_client_set_channel_delivery(&lb->client, 1, t->delivery)
+          == EINVAL);
+
+    message_send(lb, 1, COMMAND_LOST);
+    message_send(lb, 0, COMMAND_HELD);
+    message_send(lb, 0, COMMAND_PASSED);
+    message_send(lb, 1, COMMAND_LAST);
+}
+
+static void server_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    struct delivery_test *t = lb->arg;
+    uint8_t buffer[SIZE];
+
+    check(command >= 0 && command < COMMAND_COUNT);
+    if (command < 0 || command >= COMMAND_COUNT)
+        return;
+
+    memset(buffer, command, SIZE);
+    check(len == SIZE && !memcmp(data, buffer, len));
+
+    t->received[command]++;
+
+    if (command == COMMAND_LOST || command == COMMAND_LAST) {
+        check(command == (t->reliable_received ? COMMAND_LAST
+                                               : COMMAND_LOST));
+        if (++t->reliable_received == 2)
+            loopback_stop(lb);
+    }
+}
+
+/*
+  First transmission of the first reliable message is lost, first
+  unreliable message is held until the last one is relayed.
+ */
+static int relay(struct loopback *lb, int to_server,
+                 const uint8_t *data, size_t len)
+{
+    struct delivery_test *t = lb->arg;
+
+    if (!to_server)
+        return 1;
+
+    switch (loopback_command(data)) {
+    case RUDP_CMD_APP + COMMAND_LOST:
+        if (t->lost_dropped)
+            return 1;
+        t->lost_dropped = 1;
+        return 0;
+
+    case RUDP_CMD_APP + COMMAND_HELD:
+        check(len <= sizeof(t->held));
+        if (len > sizeof(t->held))
+            return 0;
+        memcpy(t->held, data, len);
+        t->held_len = len;
+        return 0;
+
+    case RUDP_CMD_APP + COMMAND_LAST:
+        if (t->held_len != 0)
+            loopback_forward(lb, to_server, t->held, t->held_len);
+        t->held_len = 0;
+        return 1;
+    }
+
+    return 1;
+}
+
+static const struct loopback_handler handler = {
+    .connected = connected,
+    .server_packet = server_packet,
+    .relay = relay,
+};
+
+static void run(uint32_t server_features, enum rudp_delivery delivery,
+                unsigned int held, unsigned int passed)
+{
+    struct delivery_test t;
+    struct loopback lb;
+
+    memset(&t, 0, sizeof(t));
+    t.delivery = delivery;
+
+    loopback_init(&lb, &handler, &t);
+    rudp_set_features(&lb.client_rudp, FEATURES);
+    rudp_set_features(&lb.server_rudp, server_features);
+
+    check(loopback_start(&lb) == 0);
+    check(loopback_run(&lb, 5000) == 0);
+
+    /* Nothing else arrives */
+    loopback_wait(&lb, 200);
+    check(lb.lost == 0);
+    check(lb.dropped == 2);
+
+    check(t.received[COMMAND_LOST] == 1);
+    check(t.received[COMMAND_LAST] == 1);
+    check(t.received[COMMAND_HELD] == held);
+    check(t.received[COMMAND_PASSED] == passed);
+
+    loopback_deinit(&lb);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    run(FEATURES, RUDP_DELIVERY_ORDERED, 0, 0);
+    run(FEATURES, RUDP_DELIVERY_SEQUENCED, 0, 1);
+    run(FEATURES, RUDP_DELIVERY_UNORDERED, 1, 1);
+    run(FEATURES & ~RUDP_FEATURE_DELIVERY, RUDP_DELIVERY_UNORDERED, 0, 0);
+
+    return loopback_report(argv[0]);
+}
@@ -0,0 +1,151 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Forward error correction.  One segment of a message is lost: parity
+  rebuilds it, so that an unreliable message still arrives, and a
+  reliable one without retransmission.  Without the feature agreed
+  on, the unreliable message is lost and the reliable one is sent
+  again.
+ */
+
+#include <string.h>
+
+#include <rudp/packet.h>
+#include <rudp/peer.h>
+
+#include "loopback.h"
+
+#define SIZE 5000
+#define MIN_RTO 1500
+
+enum phase
+{
+    PHASE_UNRELIABLE = 1,
+    PHASE_RELIABLE,
+};
+
+struct fec_test
+{
+    enum phase phase;
+    unsigned int received[3];
+    unsigned int sent;
+    unsigned int retransmitted;
+};
+
+static void message_fill(uint8_t *data, enum phase phase)
+{
+    size_t i;
+
+    for (i = 0; i < SIZE; i++)
+        data[i] = (uint8_t)(i * 13 + phase);
+}
+
+static void message_send(struct loopback *lb, enum phase phase)
+{
+    struct fec_test *t = lb->arg;
+    uint8_t buffer[SIZE];
+
+    t->phase = phase;
+    t->sent = 0;
+    message_fill(buffer, phase);
+    check(rudp_client_send(&lb->client, phase == PHASE_RELIABLE, phase,
+                           buffer, SIZE) == 0);
+}
+
+static void connected(struct loopback *lb)
+{
+    loopback_stop(lb);
+}
+
+static void server_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    struct fec_test *t = lb->arg;
+    uint8_t buffer[SIZE];
+
+    check(command == (int)t->phase);
+    message_fill(buffer, t->phase);
+    check(len == SIZE && !memcmp(data, buffer, len));
+
+    t->received[t->phase]++;
+    loopback_stop(lb);
+}
+
+/* First transmission of the second segment is lost */
+static int relay(struct loopback *lb, int to_server,
+                 const uint8_t *data, size_t len)
+{
+    struct fec_test *t = lb->arg;
+
+    (void)len;
+
+    if (!to_server || loopback_command(data) < RUDP_CMD_APP)
+        return 1;
+
+    if (loopback_opt(data) & RUDP_OPT_RETRANSMITTED) {
+        t->retransmitted++;
+        return 1;
+    }
+
+    return ++t->sent != 2;
+}
+
+static const struct loopback_handler handler = {
+    .connected = connected,
+    .server_packet = server_packet,
+    .relay = relay,
+};
+
+static void run(uint32_t server_features)
+{
+    int fec = !!(server_features & RUDP_FEATURE_FEC);
+    struct fec_test t;
+    struct loopback lb;
+
+    memset(&t, 0, sizeof(t));
+
+    loopback_init(&lb, &handler, &t);
+    rudp_set_features(&lb.server_rudp, server_features);
+    rudp_set_fec(&lb.client_rudp, 4);
+    lb.client_rudp.default_timeout.min_rto = MIN_RTO;
+
+    check(loopback_start(&lb) == 0);
+    check(loopback_run(&lb, 5000) == 0);
+
+    message_send(&lb, PHASE_UNRELIABLE);
+    loopback_run(&lb, 500);
+    check(lb.dropped == 1);
+    check(t.received[PHASE_UNRELIABLE] == (unsigned int)fec);
+
+    message_send(&lb, PHASE_RELIABLE);
+    check(loopback_run(&lb, 5000) == 0);
+    check(lb.dropped == 2);
+    check(t.received[PHASE_RELIABLE] == 1);
+    if (fec)
+        check(t.retransmitted == 0);
+    else
+        check(t.retransmitted > 0);
+
+    check(lb.lost == 0);
+
+    loopback_deinit(&lb);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    run(RUDP_FEATURE_ALL);
+    run(RUDP_FEATURE_ALL & ~RUDP_FEATURE_FEC);
+
+    return loopback_report(argv[0]);
+}
@@ -0,0 +1,173 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Connection handshake with a server requiring cookies.  Checks that
+  features are the ones both sides offer, that a connection goes
+  through the cookie round trip, that a second one resumes with the
+  token the server gave, without a cookie, and that a client not
+  offering cookies is refused.
+ */
+
+#include <stdarg.h>
+#include <string.h>
+
+#include <rudp/packet.h>
+#include <rudp/peer.h>
+
+#include "loopback.h"
+
+#define CLIENT_FEATURES \
+    (RUDP_FEATURE_ALL & ~(RUDP_FEATURE_FEC | RUDP_FEATURE_PMTUD))
+
+/* Server log messages, the only trace of what the handshake went
+   through */
+static unsigned int cookies_sent, connections, refusals;
+
+static void server_log(struct rudp_base *rudp, enum rudp_log_level level,
+                       const char *fmt, va_list arg)
+{
+    (void)rudp;
+    (void)level;
+    (void)arg;
+
+    if (!strcmp(fmt, "Sending cookie\n"))
+        cookies_sent++;
+    else if (!strcmp(fmt, "New connection\n"))
+        connections++;
+    else if (!strcmp(fmt, "Connection without cookie refused\n"))
+        refusals++;
+}
+
+static uint32_t protocol_features(uint32_t features)
+{
+    return features & ~RUDP_FEATURE_CHANNELS_MASK;
+}
+
+static void connected(struct loopback *lb)
+{
+    uint32_t agreed = CLIENT_FEATURES & RUDP_FEATURE_ALL;
+
+    check(protocol_features(lb->client.peer.features) == agreed);
+    check(lb->server_peer != NULL);
+    if (lb->server_peer != NULL)
+        check(protocol_features(lb->server_peer->features) == agreed);
+
+    check(rudp_client_send(&lb->client, 1, 0, "hello", 5) == 0);
+}
+
+static void server_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    rudp_server_send(&lb->server, lb->server_peer, 1, command, data, len);
+}
+
+static void client_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    check(command == 0);
+    check(len == 5 && !memcmp(data, "hello", 5));
+    loopback_stop(lb);
+}
+
+static const struct loopback_handler handler = {
+    .connected = connected,
+    .server_packet = server_packet,
+    .client_packet = client_packet,
+};
+
+static void loopback_setup(struct loopback *lb, uint32_t client_features)
+{
+    cookies_sent = connections = refusals = 0;
+
+    loopback_init(lb, &handler, NULL);
+    lb->server_rudp.handler.log = server_log;
+    rudp_set_features(&lb->client_rudp, client_features);
+}
+
+static void test_cookie(void)
+{
+    struct loopback lb;
+
+    loopback_setup(&lb, CLIENT_FEATURES);
+
+    /* Connection request is only read once the loop runs */
+    check(loopback_start(&lb) == 0);
+    rudp_server_set_cookie_required(&lb.server, 1);
+    check(loopback_run(&lb, 5000) == 0);
+    check(lb.connected);
+    check(cookies_sent == 1);
+    check(connections == 1);
+    check(refusals == 0);
+
+    loopback_deinit(&lb);
+}
+
+static void test_resume(void)
+{
+    struct loopback lb;
+    unsigned int i;
+
+    loopback_setup(&lb, CLIENT_FEATURES);
+
+    check(loopback_start(&lb) == 0);
+    rudp_server_set_cookie_required(&lb.server, 1);
+    check(loopback_run(&lb, 5000) == 0);
+
+    /* Token comes along the connection, not necessarily before the
+       echo */
+    for (i = 0; i < 20 && !lb.client.peer.token_valid; i++)
+        loopback_wait(&lb, 50);
+    check(lb.client.peer.token_valid);
+
+    rudp_client_close(&lb.client);
+    check(lb.client.session.token_valid);
+
+    lb.connected = 0;
+    check(rudp_client_connect(&lb.client) == 0);
+    check(loopback_run(&lb, 5000) == 0);
+    check(lb.connected);
+
+    /* Token spared the cookie round trip */
+    check(cookies_sent == 1);
+    check(connections == 2);
+
+    loopback_deinit(&lb);
+}
+
+static void test_refused(void)
+{
+    struct loopback lb;
+
+    loopback_setup(&lb, RUDP_FEATURE_ALL & ~RUDP_FEATURE_COOKIE);
+    lb.client_rudp.default_timeout.drop = 1000;
+
+    check(loopback_start(&lb) == 0);
+    rudp_server_set_cookie_required(&lb.server, 1);
+    loopback_wait(&lb, 2000);
+    check(!lb.connected);
+    check(lb.lost == 1);
+    check(refusals > 0);
+    check(connections == 0);
+
+    loopback_deinit(&lb);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    test_cookie();
+    test_resume();
+    test_refused();
+
+    return loopback_report(argv[0]);
+}
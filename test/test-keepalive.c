@@ -0,0 +1,165 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Keepalives.  An idle link carries unreliable keepalives both ways,
+  at least once per keepalive interval, and no ping.  A peer that
+  falls silent is pinged, not before the drop timeout gets close, and
+  the link survives once it answers again.  Without a keepalive
+  interval, an idle link only carries the pings keeping it up.
+ */
+
+#include <string.h>
+
+#include <rudp/packet.h>
+#include <rudp/peer.h>
+#include <rudp/time.h>
+
+#include "loopback.h"
+
+#define KEEPALIVE 300
+#define DROP 4000
+#define IDLE 2000
+#define BLACKOUT (DROP - DROP / 5)
+
+struct keepalive_test
+{
+    /* Packets towards the client are lost */
+    int blackout;
+    rudp_time_t blackout_start;
+    rudp_time_t first_ping;
+    /* Keepalives, and acknowledges of the other side pings, which
+       are the only reliable packets of an idle link */
+    unsigned int noops[2];
+    unsigned int pings[2];
+    unsigned int reliable_noops;
+};
+
+static void connected(struct loopback *lb)
+{
+    loopback_stop(lb);
+}
+
+static int relay(struct loopback *lb, int to_server,
+                 const uint8_t *data, size_t len)
+{
+    struct keepalive_test *t = lb->arg;
+
+    (void)len;
+
+    switch (loopback_command(data)) {
+    case RUDP_CMD_NOOP:
+        t->noops[to_server]++;
+        if (loopback_opt(data) & RUDP_OPT_RELIABLE)
+            t->reliable_noops++;
+        break;
+
+    case RUDP_CMD_PING:
+        if (to_server && t->blackout && t->first_ping == 0)
+            t->first_ping = rudp_timestamp();
+        t->pings[to_server]++;
+        break;
+    }
+
+    return to_server || !t->blackout;
+}
+
+static const struct loopback_handler handler = {
+    .connected = connected,
+    .relay = relay,
+};
+
+static void loopback_setup(struct loopback *lb, struct keepalive_test *t,
+                           rudp_time_t keepalive)
+{
+    memset(t, 0, sizeof(*t));
+
+    loopback_init(lb, &handler, t);
+    lb->client_rudp.default_timeout.keepalive = keepalive;
+    lb->server_rudp.default_timeout.keepalive = keepalive;
+    lb->client_rudp.default_timeout.drop = DROP;
+    lb->server_rudp.default_timeout.drop = DROP;
+
+    check(loopback_start(lb) == 0);
+    check(loopback_run(lb, 5000) == 0);
+
+    /* Handshake traffic settles */
+    loopback_wait(lb, 200);
+    memset(t->noops, 0, sizeof(t->noops));
+    memset(t->pings, 0, sizeof(t->pings));
+}
+
+static void test_idle(rudp_time_t keepalive, rudp_time_t idle)
+{
+    struct keepalive_test t;
+    struct loopback lb;
+    unsigned int i;
+
+    loopback_setup(&lb, &t, keepalive);
+
+    loopback_wait(&lb, idle);
+    check(lb.lost == 0);
+    check(lb.connected);
+    check(t.reliable_noops == 0);
+
+    if (keepalive != 0) {
+        for (i = 0; i < 2; i++) {
+            check(t.noops[i] >= idle / keepalive);
+            check(t.pings[i] == 0);
+        }
+    } else {
+        check(t.pings[0] + t.pings[1] > 0);
+        check(t.noops[0] <= t.pings[1]);
+        check(t.noops[1] <= t.pings[0]);
+    }
+
+    loopback_deinit(&lb);
+}
+
+static void test_silent(void)
+{
+    struct keepalive_test t;
+    struct loopback lb;
+    rudp_time_t silence;
+
+    loopback_setup(&lb, &t, KEEPALIVE);
+
+    t.blackout = 1;
+    t.blackout_start = rudp_timestamp();
+    loopback_wait(&lb, BLACKOUT);
+    t.blackout = 0;
+
+    /* Ping comes as the drop timeout gets close, shortened by up to a
+       quarter.  Last keepalive came at most an interval before the
+       blackout. */
+    check(t.first_ping != 0);
+    silence = t.first_ping - t.blackout_start;
+    check(silence >= (DROP - DROP / 4) * 3 / 4 - KEEPALIVE);
+    check(silence <= DROP - DROP / 4);
+
+    /* Past the time the client would have been dropped at */
+    loopback_wait(&lb, DROP / 2);
+    check(lb.lost == 0);
+    check(lb.connected);
+
+    loopback_deinit(&lb);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    test_idle(KEEPALIVE, IDLE);
+    test_idle(0, DROP + DROP / 2);
+    test_silent();
+
+    return loopback_report(argv[0]);
+}
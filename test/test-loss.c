@@ -0,0 +1,176 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Loss recovery.  A lost last packet is sent again by the tail loss
+  probe, long before the retransmission timeout.  A burst keeps at
+  most the send window of bytes in flight, whether the window is
+  agreed on or not.
+ */
+
+#include <string.h>
+
+#include <rudp/packet.h>
+#include <rudp/peer.h>
+#include <rudp/time.h>
+
+#include "loopback.h"
+
+#define DELAY 10
+#define MIN_RTO 1500
+#define TAIL 5
+#define BURST 128
+#define MESSAGE_SIZE 1000
+#define WINDOW (64 * 1024)
+
+struct loss_test
+{
+    int burst;
+    unsigned int received;
+    unsigned int sent;
+    unsigned int retransmitted;
+    rudp_time_t start;
+    rudp_time_t end;
+    uint32_t max_flight;
+};
+
+static void message_fill(uint8_t *data, unsigned int i)
+{
+    memset(data, i, MESSAGE_SIZE);
+}
+
+static void burst_send(struct loopback *lb, unsigned int count)
+{
+    struct loss_test *t = lb->arg;
+    uint8_t buffer[MESSAGE_SIZE];
+    unsigned int i;
+
+    t->start = rudp_timestamp();
+    for (i = 0; i < count; i++) {
+        message_fill(buffer, i);
+        check(rudp_client_send(&lb->client, 1, 0, buffer,
+                               sizeof(buffer)) == 0);
+    }
+}
+
+static void connected(struct loopback *lb)
+{
+    struct loss_test *t = lb->arg;
+
+    /* Probe timeout is only short once the round trip is known */
+    if (t->burst)
+        burst_send(lb, BURST);
+    else
+        check(rudp_client_send(&lb->client, 1, 1, "ping", 4) == 0);
+}
+
+static void server_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    struct loss_test *t = lb->arg;
+    uint8_t buffer[MESSAGE_SIZE];
+
+    if (command == 1) {
+        rudp_server_send(&lb->server, lb->server_peer, 1, 1, data, len);
+        return;
+    }
+
+    message_fill(buffer, t->received);
+    check(len == sizeof(buffer) && !memcmp(data, buffer, len));
+
+    if (++t->received == (t->burst ? BURST : TAIL)) {
+        t->end = rudp_timestamp();
+        loopback_stop(lb);
+    }
+}
+
+static void client_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    (void)command;
+    (void)data;
+    (void)len;
+
+    burst_send(lb, TAIL);
+}
+
+/* First transmission of the last message of the tail is lost */
+static int relay(struct loopback *lb, int to_server,
+                 const uint8_t *data, size_t len)
+{
+    struct loss_test *t = lb->arg;
+
+    (void)len;
+
+    if (!to_server || loopback_command(data) != RUDP_CMD_APP)
+        return 1;
+
+    if (lb->client.peer.flight > t->max_flight)
+        t->max_flight = lb->client.peer.flight;
+
+    if (loopback_opt(data) & RUDP_OPT_RETRANSMITTED) {
+        t->retransmitted++;
+        return 1;
+    }
+
+    return t->burst || ++t->sent != TAIL;
+}
+
+static const struct loopback_handler handler = {
+    .connected = connected,
+    .server_packet = server_packet,
+    .client_packet = client_packet,
+    .relay = relay,
+};
+
+static void run(uint32_t features, int burst)
+{
+    struct loss_test t;
+    struct loopback lb;
+
+    memset(&t, 0, sizeof(t));
+    t.burst = burst;
+
+    loopback_init(&lb, &handler, &t);
+    rudp_set_features(&lb.server_rudp, features);
+    rudp_set_features(&lb.client_rudp, features);
+    lb.client_rudp.default_timeout.min_rto = MIN_RTO;
+    lb.delay = DELAY;
+
+    check(loopback_start(&lb) == 0);
+    check(loopback_run(&lb, 5000) == 0);
+    check(lb.lost == 0);
+
+    if (burst) {
+        check(t.received == BURST);
+        check(t.max_flight > 0);
+        check(t.max_flight <= WINDOW);
+    } else {
+        check(t.received == TAIL);
+        check(lb.dropped == 1);
+        check(t.retransmitted == 1);
+        check(t.end - t.start < MIN_RTO / 2);
+    }
+
+    loopback_deinit(&lb);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    run(RUDP_FEATURE_ALL, 0);
+    run(RUDP_FEATURE_ALL & ~RUDP_FEATURE_TIMESTAMP, 0);
+    run(RUDP_FEATURE_ALL, 1);
+    run(RUDP_FEATURE_ALL & ~RUDP_FEATURE_WINDOW, 1);
+
+    return loopback_report(argv[0]);
+}
@@ -0,0 +1,181 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Messages sent while out of memory.  Sending fails, and nothing of
+  the message is left queued: no buffer is leaked, and sequence
+  numbers are not used, so that following messages go through.
+  Broadcasts report the failure.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <rudp/packet.h>
+#include <rudp/peer.h>
+
+#include "rudp_list.h"
+#include "loopback.h"
+
+/* Several segments, more than the pool keeps after the handshake */
+#define LARGE 30000
+#define SMALL 3000
+
+struct nomem_test
+{
+    unsigned int received;
+};
+
+/* Allocations left before failing, -1 for no limit */
+static int allowed = -1;
+
+static void *failing_alloc(struct rudp_base *rudp, size_t size)
+{
+    if (allowed == 0)
+        return NULL;
+    if (allowed > 0)
+        allowed--;
+
+    return rudp_handler_default.mem_alloc(rudp, size);
+}
+
+static void message_fill(uint8_t *data, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        data[i] = (uint8_t)(i * 7);
+}
+
+static void connected(struct loopback *lb)
+{
+    loopback_stop(lb);
+}
+
+static void server_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    struct nomem_test *t = lb->arg;
+    uint8_t buffer[SMALL];
+
+    (void)command;
+
+    /* Only the message sent with memory available comes */
+    message_fill(buffer, SMALL);
+    check(len == SMALL && !memcmp(data, buffer, len));
+
+    t->received++;
+    loopback_stop(lb);
+}
+
+static const struct loopback_handler handler = {
+    .connected = connected,
+    .server_packet = server_packet,
+};
+
+static int peer_idle(struct rudp_peer *peer)
+{
+    unsigned int i;
+
+    for (i = 0; i < peer->channel_count; i++)
+        if (!rudp_list_empty(&peer->channels[i].sendq)
+            || !rudp_list_empty(&peer->channels[i].unreliable_sendq))
+            return 0;
+    return 1;
+}
+
+static void send_nomem(struct loopback *lb, int reliable)
+{
+    static uint8_t large[LARGE];
+    struct rudp_peer *peer = &lb->client.peer;
+    uint32_t seq_reliable = peer->channels[0].out_seq_reliable;
+    uint32_t seq_unreliable = peer->channels[0].out_seq_unreliable;
+    uint32_t in_use = lb->client_rudp.packet_stats.in_use;
+
+    allowed = 0;
+    check(rudp_client_send(&lb->client, reliable, 0, large,
+                           sizeof(large)) == ENOMEM);
+    allowed = -1;
+
+    check(peer_idle(peer));
+    check(peer->channels[0].out_seq_reliable == seq_reliable);
+    check(peer->channels[0].out_seq_unreliable == seq_unreliable);
+    check(lb->client_rudp.packet_stats.in_use == in_use);
+}
+
+static void send_all_nomem(struct loopback *lb)
+{
+    static uint8_t large[LARGE];
+    uint32_t in_use = lb->server_rudp.packet_stats.in_use;
+
+    /* Shared payload is allocated, not the packets to send it */
+    allowed = 1;
+    check(rudp_server_send_all(&lb->server, 1, 0, large,
+                               sizeof(large)) == ENOMEM);
+    allowed = -1;
+
+    check(peer_idle(lb->server_peer));
+    check(lb->server_rudp.packet_stats.in_use == in_use);
+}
+
+static void run(uint32_t features)
+{
+    struct nomem_test t = { 0 };
+    struct loopback lb;
+    uint8_t buffer[SMALL];
+    unsigned int i;
+
+    loopback_init(&lb, &handler, &t);
+    rudp_set_features(&lb.server_rudp, features);
+    rudp_set_features(&lb.client_rudp, features);
+    lb.client_rudp.handler.mem_alloc = failing_alloc;
+    lb.server_rudp.handler.mem_alloc = failing_alloc;
+
+    check(loopback_start(&lb) == 0);
+    check(loopback_run(&lb, 5000) == 0);
+    check(lb.server_peer != NULL);
+    if (lb.server_peer == NULL)
+        goto out;
+
+    for (i = 0; i < 20; i++) {
+        if (peer_idle(&lb.client.peer) && peer_idle(lb.server_peer))
+            break;
+        loopback_wait(&lb, 50);
+    }
+    check(i < 20);
+
+    send_nomem(&lb, 1);
+    send_nomem(&lb, 0);
+    send_all_nomem(&lb);
+
+    message_fill(buffer, SMALL);
+    check(rudp_client_send(&lb.client, 1, 0, buffer, SMALL) == 0);
+    check(loopback_run(&lb, 5000) == 0);
+    check(t.received == 1);
+
+    /* Nothing else arrives */
+    loopback_wait(&lb, 200);
+    check(t.received == 1);
+    check(lb.lost == 0);
+
+out:
+    loopback_deinit(&lb);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    run(RUDP_FEATURE_ALL);
+    run(RUDP_FEATURE_ALL & ~(RUDP_FEATURE_FEC | RUDP_FEATURE_FAST_LANE));
+
+    return loopback_report(argv[0]);
+}
@@ -0,0 +1,238 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Wire header encoding and decoding, for all the formats and all the
+  optional fields, and truncated or unknown headers.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <rudp/rudp.h>
+#include <rudp/packet.h>
+
+#include "rudp_packet.h"
+
+static int failures;
+
+#define check(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d %s failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while(0)
+
+/* Optional header fields, flags of the extras of info_init() */
+#define EXTRA_CONN_ID 1
+#define EXTRA_TIMESTAMP 2
+#define EXTRA_WINDOW 4
+#define EXTRA_ALL (EXTRA_CONN_ID | EXTRA_TIMESTAMP | EXTRA_WINDOW)
+
+static uint32_t truncate_seq(uint32_t value, unsigned int bits)
+{
+    return bits >= 32 ? value : value & (((uint32_t)1 << bits) - 1);
+}
+
+/*
+  Encodes info, decodes it back and compares, then makes sure every
+  shorter prefix of the header is refused.
+ */
+static void round_trip(const struct rudp_packet_info *info,
+                       size_t expected_size)
+{
+    uint8_t buffer[RUDP_PACKET_HEADER_MAX + 8];
+    struct rudp_packet_info out;
+    uint32_t reliable, ack;
+    size_t size, len;
+
+    memset(buffer, 0xa5, sizeof(buffer));
+    size = rudp_packet_header_encode(buffer, info);
+    check(size == expected_size);
+    check(size <= RUDP_PACKET_HEADER_MAX);
+
+    /* Trailing payload is not part of the header */
+    memset(&out, 0, sizeof(out));
+    check(rudp_packet_header_decode(&out, buffer, sizeof(buffer)) == size);
+
+    check(out.version == info->version);
+    check(out.command == info->command);
+    check(out.opt == info->opt);
+    check(out.channel == info->channel);
+    check(out.segments_size == info->segments_size);
+    check(out.segment_index == info->segment_index);
+    check(out.unreliable
+          == truncate_seq(info->unreliable, out.unreliable_bits));
+    check(out.conn_id == info->conn_id);
+    check(out.ts_val == info->ts_val);
+    check(out.ts_ecr == (info->ts_val ? info->ts_ecr : 0));
+    check(out.has_window == info->has_window);
+    check(out.window == (info->has_window ? info->window : 0));
+
+    /* Truncated numbers expand back to the sent ones around a close
+       reference, as receivers do */
+    reliable = rudp_seq_expand(out.reliable, out.reliable_bits,
+                               info->reliable - 5);
+    check(truncate_seq(reliable, out.seq_bits)
+          == truncate_seq(info->reliable, out.seq_bits));
+    if (info->opt & RUDP_OPT_ACK) {
+        ack = rudp_seq_expand(out.reliable_ack, out.ack_bits,
+                              info->reliable_ack + 3);
+        check(truncate_seq(ack, out.seq_bits)
+              == truncate_seq(info->reliable_ack, out.seq_bits));
+    }
+
+    check(rudp_packet_conn_id(buffer, size) == info->conn_id);
+
+    for (len = 0; len < size; len++) {
+        check(rudp_packet_header_decode(&out, buffer, len) == 0);
+        check(rudp_packet_conn_id(buffer, len) == 0);
+    }
+}
+
+static void info_init(struct rudp_packet_info *info, uint8_t version,
+                      unsigned int extras)
+{
+    memset(info, 0, sizeof(*info));
+    info->version = version;
+    info->command = RUDP_CMD_APP + 1;
+    info->opt = RUDP_OPT_RELIABLE | RUDP_OPT_ACK;
+    info->channel = 2;
+    info->reliable_ack = 0x12345678;
+    info->reliable = 0x9abcdef0;
+    info->unreliable = 0x0badcafe;
+    info->segments_size = 3;
+    info->segment_index = 1;
+    info->seq_bits = 32;
+    info->ack_bits = 32;
+    info->reliable_bits = 32;
+    info->unreliable_bits = 32;
+
+    if (extras & EXTRA_CONN_ID)
+        info->conn_id = 0xdeadbeef;
+    if (extras & EXTRA_TIMESTAMP) {
+        info->ts_val = 0x01020304;
+        info->ts_ecr = 0x05060708;
+    }
+    if (extras & EXTRA_WINDOW) {
+        info->has_window = 1;
+        info->window = 65536;
+    }
+}
+
+static size_t extras_size(unsigned int extras)
+{
+    return ((extras & EXTRA_CONN_ID) ? 4 : 0)
+        + ((extras & EXTRA_TIMESTAMP) ? 8 : 0)
+        + ((extras & EXTRA_WINDOW) ? 4 : 0);
+}
+
+static void test_fixed(void)
+{
+    struct rudp_packet_info info;
+    unsigned int extras;
+
+    for (extras = 0; extras <= EXTRA_ALL; extras++) {
+        info_init(&info, RUDP_VERSION, extras);
+        round_trip(&info, sizeof(struct rudp_packet_header)
+                   + extras_size(extras));
+
+        info_init(&info, RUDP_VERSION_SEQ32, extras);
+        round_trip(&info, sizeof(struct rudp_packet_header_seq32)
+                   + extras_size(extras));
+    }
+}
+
+static void test_compact(void)
+{
+    static const uint8_t bits[] = { 8, 16, 32 };
+    static const uint32_t unreliable[] = { 0, 0x12, 0x1234, 0x12345678 };
+    static const size_t unreliable_size[] = { 0, 1, 2, 4 };
+    struct rudp_packet_info info;
+    unsigned int extras, r, a, u;
+    size_t size;
+
+    for (extras = 0; extras <= EXTRA_ALL; extras++)
+    for (r = 0; r < sizeof(bits); r++)
+    for (a = 0; a < sizeof(bits); a++)
+    for (u = 0; u < 4; u++) {
+        info_init(&info, RUDP_VERSION_COMPACT, extras);
+        info.reliable_bits = bits[r];
+        info.ack_bits = bits[a];
+        info.unreliable = unreliable[u];
+
+        /* Fixed part, channel, acknowledge, reliable, unreliable,
+           segments */
+        size = 4 + 1 + (bits[a] > 16 ? 4 : 2) + bits[r] / 8
+            + unreliable_size[u] + 4 + extras_size(extras);
+        round_trip(&info, size);
+    }
+
+    /* Smallest header: no channel, no acknowledge, no unreliable
+       number, a single segment */
+    info_init(&info, RUDP_VERSION_COMPACT, 0);
+    info.opt = RUDP_OPT_RELIABLE;
+    info.channel = 0;
+    info.reliable_bits = 8;
+    info.unreliable = 0;
+    info.segments_size = 1;
+    info.segment_index = 0;
+    round_trip(&info, 5);
+}
+
+static void test_malformed(void)
+{
+    struct rudp_packet_info info;
+    uint8_t buffer[RUDP_PACKET_HEADER_MAX];
+    size_t size;
+
+    memset(buffer, 0, sizeof(buffer));
+
+    /* Unknown versions, with or without optional field flags */
+    buffer[0] = 0x00;
+    check(rudp_packet_header_decode(&info, buffer, sizeof(buffer)) == 0);
+    buffer[0] = 0x04;
+    check(rudp_packet_header_decode(&info, buffer, sizeof(buffer)) == 0);
+    buffer[0] = RUDP_VERSION_CONN_ID | 0x1f;
+    check(rudp_packet_header_decode(&info, buffer, sizeof(buffer)) == 0);
+    check(rudp_packet_conn_id(buffer, sizeof(buffer)) == 0);
+
+    /* Reserved compact reliable number size */
+    info_init(&info, RUDP_VERSION_COMPACT, 0);
+    size = rudp_packet_header_encode(buffer, &info);
+    check(size != 0);
+    buffer[3] |= 0x03;
+    check(rudp_packet_header_decode(&info, buffer, sizeof(buffer)) == 0);
+}
+
+static void test_seq_expand(void)
+{
+    check(rudp_seq_expand(0x02, 8, 0x1fe) == 0x202);
+    check(rudp_seq_expand(0xfe, 8, 0x202) == 0x1fe);
+    check(rudp_seq_expand(0x0001, 16, 0xffffff00) == 0x00000001);
+    check(rudp_seq_expand(0xff00, 16, 0x00000001) == 0xffffff00);
+    check(rudp_seq_expand(0x12345678, 32, 0) == 0x12345678);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    test_fixed();
+    test_compact();
+    test_malformed();
+    test_seq_expand();
+
+    printf("%s: %d failure(s)\n", argv[0], failures);
+    return failures != 0;
+}
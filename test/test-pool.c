@@ -0,0 +1,211 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Packet pool statistics.  Echoed messages reuse pooled buffers:
+  allocations are mostly hits, every buffer handed out comes back,
+  byte counts add up, and the free pool stays within its limit.
+  Lowering the limit gives buffers back at once.  With a packet
+  region, receive-sized buffers come from it and all go back to it,
+  and it can only be dropped once none is handed out.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <rudp/packet.h>
+#include <rudp/peer.h>
+
+#include "rudp_packet.h"
+#include "loopback.h"
+
+#define MESSAGES 200
+#define SIZE 500
+#define REGION (2 * 1024 * 1024)
+
+struct pool_test
+{
+    unsigned int received;
+};
+
+static void message_send(struct loopback *lb, unsigned int i)
+{
+    uint8_t buffer[SIZE];
+
+    memset(buffer, i, SIZE);
+    check(rudp_client_send(&lb->client, 1, 0, buffer, SIZE) == 0);
+}
+
+static void connected(struct loopback *lb)
+{
+    loopback_stop(lb);
+}
+
+static void server_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    rudp_server_send(&lb->server, lb->server_peer, 1, command, data, len);
+}
+
+static void client_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    struct pool_test *t = lb->arg;
+    uint8_t buffer[SIZE];
+
+    (void)command;
+
+    memset(buffer, t->received, SIZE);
+    check(len == SIZE && !memcmp(data, buffer, len));
+
+    if (++t->received == MESSAGES)
+        loopback_stop(lb);
+    else
+        message_send(lb, t->received);
+}
+
+static const struct loopback_handler handler = {
+    .connected = connected,
+    .server_packet = server_packet,
+    .client_packet = client_packet,
+};
+
+static void check_stats(struct rudp_base *rudp, uint32_t idle_in_use)
+{
+    struct rudp_packet_stats stats;
+    uint64_t hits = 0, misses = 0, bytes = 0;
+    uint32_t in_use = 0;
+    unsigned int i;
+
+    rudp_packet_stats_get(rudp, &stats);
+
+    for (i = 0; i < RUDP_PACKET_CLASS_COUNT; i++) {
+        const struct rudp_packet_class_stats *c = &stats.classes[i];
+
+        check(c->free <= c->max_free);
+        check(c->in_use <= c->peak_in_use);
+        hits += c->hits;
+        misses += c->misses;
+        bytes += c->bytes;
+        in_use += c->in_use;
+    }
+
+    check(stats.in_use == in_use);
+    check(stats.in_use == idle_in_use);
+    check(stats.bytes == bytes);
+    check(stats.in_use <= stats.peak_in_use);
+    check(stats.bytes <= stats.peak_bytes);
+
+    /* Each message takes a few buffers, most of them recycled */
+    check(hits + misses >= MESSAGES);
+    check(hits > misses);
+}
+
+static void check_trim(struct rudp_base *rudp)
+{
+    struct rudp_packet_class_stats *c;
+    uint64_t bytes = rudp->packet_stats.bytes;
+    uint32_t free_count;
+    unsigned int i;
+
+    check(rudp_packet_pool_set_max_free(rudp, 1, 4) == EINVAL);
+
+    for (i = 0; i < RUDP_PACKET_CLASS_COUNT; i++) {
+        c = &rudp->packet_stats.classes[i];
+        if (c->size == 0)
+            continue;
+
+        free_count = c->free;
+        check(rudp_packet_pool_set_max_free(rudp, c->size, 0) == 0);
+        check(c->free == 0);
+        check(c->max_free == 0);
+        bytes -= free_count * (uint64_t)(sizeof(struct rudp_packet_chain)
+                                         + c->size);
+    }
+
+    check(rudp->packet_stats.bytes == bytes);
+}
+
+static void check_region(struct rudp_base *rudp)
+{
+    struct rudp_packet_stats *stats = &rudp->packet_stats;
+    struct rudp_packet_chain *pc;
+
+    /* Receive-sized buffers never missed the region */
+    check(stats->classes[1].misses == 0);
+    check(stats->classes[1].hits > 0);
+    check(stats->region_free == stats->region_slots);
+
+    pc = rudp_packet_chain_alloc(rudp, SIZE);
+    check(pc != NULL);
+    if (pc == NULL)
+        return;
+    check(stats->region_free == stats->region_slots - 1);
+    check(rudp_packet_pool_set_region(rudp, 0) == EBUSY);
+
+    rudp_packet_chain_free(rudp, pc);
+    check(stats->region_free == stats->region_slots);
+    check(rudp_packet_pool_set_region(rudp, 0) == 0);
+    check(stats->region_slots == 0);
+    check(stats->region_bytes == 0);
+}
+
+static void run(uint32_t features, int region)
+{
+    struct pool_test t = { 0 };
+    struct loopback lb;
+    uint32_t client_in_use, server_in_use;
+
+    loopback_init(&lb, &handler, &t);
+    rudp_set_features(&lb.server_rudp, features);
+    rudp_set_features(&lb.client_rudp, features);
+
+    if (region) {
+        check(rudp_packet_pool_set_region(&lb.client_rudp, REGION) == 0);
+        check(lb.client_rudp.packet_stats.region_bytes >= REGION);
+        check(lb.client_rudp.packet_stats.region_slots > 0);
+    }
+
+    check(loopback_start(&lb) == 0);
+    check(loopback_run(&lb, 5000) == 0);
+
+    /* Handshake acks */
+    loopback_wait(&lb, 200);
+    client_in_use = lb.client_rudp.packet_stats.in_use;
+    server_in_use = lb.server_rudp.packet_stats.in_use;
+
+    message_send(&lb, 0);
+    check(loopback_run(&lb, 5000) == 0);
+    check(t.received == MESSAGES);
+    check(lb.lost == 0);
+
+    /* Last acks */
+    loopback_wait(&lb, 200);
+
+    check_stats(&lb.client_rudp, client_in_use);
+    check_stats(&lb.server_rudp, server_in_use);
+    check_trim(&lb.client_rudp);
+    if (region)
+        check_region(&lb.client_rudp);
+
+    loopback_deinit(&lb);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    run(RUDP_FEATURE_ALL, 0);
+    run(RUDP_FEATURE_ALL & ~(RUDP_FEATURE_BUNDLE | RUDP_FEATURE_COMPACT), 0);
+    run(RUDP_FEATURE_ALL, 1);
+
+    return loopback_report(argv[0]);
+}
@@ -0,0 +1,119 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Round-trip time estimate over a link delaying packets, with some
+  of them lost, with and without echoed timestamps.  Retransmitted
+  packets must not skew the estimate towards the retransmission
+  timeout.
+ */
+
+#include <string.h>
+
+#include <rudp/packet.h>
+#include <rudp/peer.h>
+
+#include "loopback.h"
+
+#define MESSAGES 24
+#define DELAY 30
+
+struct rtt_test
+{
+    unsigned int echoed;
+    unsigned int sent;
+};
+
+static void connected(struct loopback *lb)
+{
+    check(rudp_client_send(&lb->client, 1, 0, "ping", 4) == 0);
+}
+
+static void server_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    rudp_server_send(&lb->server, lb->server_peer, 1, command, data, len);
+}
+
+static void client_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    struct rtt_test *t = lb->arg;
+
+    (void)command;
+    (void)data;
+    (void)len;
+
+    if (++t->echoed == MESSAGES) {
+        loopback_stop(lb);
+        return;
+    }
+
+    check(rudp_client_send(&lb->client, 1, 0, "ping", 4) == 0);
+}
+
+/* First transmission of one message in six is lost */
+static int relay(struct loopback *lb, int to_server,
+                 const uint8_t *data, size_t len)
+{
+    struct rtt_test *t = lb->arg;
+
+    (void)len;
+
+    if (!to_server || loopback_command(data) < RUDP_CMD_APP
+        || (loopback_opt(data) & RUDP_OPT_RETRANSMITTED))
+        return 1;
+
+    return ++t->sent % 6 != 0;
+}
+
+static const struct loopback_handler handler = {
+    .connected = connected,
+    .server_packet = server_packet,
+    .client_packet = client_packet,
+    .relay = relay,
+};
+
+static void run(uint32_t features)
+{
+    struct rtt_test t = { 0, 0 };
+    struct loopback lb;
+
+    loopback_init(&lb, &handler, &t);
+    rudp_set_features(&lb.server_rudp, features);
+    rudp_set_features(&lb.client_rudp, features);
+    lb.delay = DELAY;
+
+    check(loopback_start(&lb) == 0);
+    check(loopback_run(&lb, 20000) == 0);
+    check(t.echoed == MESSAGES);
+    check(lb.dropped > 0);
+
+    /* Two relay delays, some scheduling slack, nowhere near the
+       100 ms minimum retransmission timeout added by a sample taken
+       on a retransmitted packet */
+    check(lb.client.peer.srtt >= 2 * DELAY);
+    check(lb.client.peer.srtt < 2 * DELAY + 25);
+    check(lb.client.peer.rttvar >= 0);
+    check(lb.lost == 0);
+
+    loopback_deinit(&lb);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    run(RUDP_FEATURE_ALL);
+    run(RUDP_FEATURE_ALL & ~RUDP_FEATURE_TIMESTAMP);
+
+    return loopback_report(argv[0]);
+}
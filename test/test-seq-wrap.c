@@ -0,0 +1,181 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Reliable messages, some of them segmented, across the 32-bit wrap
+  of sequence numbers, for every header format.  Connections start
+  from a random 16-bit number, so once the link is idle, counters of
+  both sides are moved right below the wrap.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <rudp/peer.h>
+
+#include "rudp_list.h"
+#include "loopback.h"
+
+#define MESSAGES 200
+#define WRAP_START 0xffffff80
+
+struct wrap_test
+{
+    unsigned int server_next;
+    unsigned int client_next;
+};
+
+static size_t message_size(unsigned int i)
+{
+    /* Every tenth message spans several segments */
+    return i % 10 == 9 ? 5000 : 1 + i % 100;
+}
+
+static void message_fill(uint8_t *data, unsigned int i, size_t size)
+{
+    size_t k;
+
+    for (k = 0; k < size; k++)
+        data[k] = (uint8_t)(i + k);
+}
+
+static int message_check(unsigned int i, const void *data, size_t len)
+{
+    uint8_t buffer[5000];
+
+    if (len != message_size(i))
+        return 0;
+    message_fill(buffer, i, len);
+    return !memcmp(buffer, data, len);
+}
+
+static void connected(struct loopback *lb)
+{
+    loopback_stop(lb);
+}
+
+static void server_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    struct wrap_test *t = lb->arg;
+
+    (void)command;
+
+    check(message_check(t->server_next, data, len));
+    t->server_next++;
+    rudp_server_send(&lb->server, lb->server_peer, 1, 0, data, len);
+}
+
+static void client_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    struct wrap_test *t = lb->arg;
+
+    (void)command;
+
+    check(message_check(t->client_next, data, len));
+    if (++t->client_next == MESSAGES)
+        loopback_stop(lb);
+}
+
+static const struct loopback_handler handler = {
+    .connected = connected,
+    .server_packet = server_packet,
+    .client_packet = client_packet,
+};
+
+static int peer_idle(struct rudp_peer *peer)
+{
+    unsigned int i;
+
+    for (i = 0; i < peer->channel_count; i++)
+        if (!rudp_list_empty(&peer->channels[i].sendq)
+            || peer->channels[i].out_seq_acked
+               != peer->channels[i].out_seq_reliable)
+            return 0;
+    return 1;
+}
+
+/*
+  Moves the reliable counters of the from to to direction to seq.
+  Nothing must be in flight.
+ */
+static void seq_move(struct rudp_peer *from, struct rudp_peer *to,
+                     uint32_t seq)
+{
+    unsigned int i;
+
+    for (i = 0; i < from->channel_count; i++) {
+        check(to->channels[i].in_seq_reliable
+              == from->channels[i].out_seq_reliable);
+        from->channels[i].out_seq_reliable = seq;
+        from->channels[i].out_seq_acked = seq;
+        to->channels[i].in_seq_reliable = seq;
+    }
+}
+
+static void run(uint32_t features)
+{
+    struct wrap_test t = { 0, 0 };
+    struct loopback lb;
+    uint8_t buffer[5000];
+    unsigned int i;
+
+    loopback_init(&lb, &handler, &t);
+    rudp_set_features(&lb.server_rudp, features);
+    rudp_set_features(&lb.client_rudp, features);
+
+    check(loopback_start(&lb) == 0);
+    check(loopback_run(&lb, 5000) == 0);
+    check(lb.server_peer != NULL);
+    if (lb.server_peer == NULL)
+        goto out;
+
+    for (i = 0; i < 20; i++) {
+        if (peer_idle(&lb.client.peer) && peer_idle(lb.server_peer))
+            break;
+        loopback_wait(&lb, 50);
+    }
+    check(i < 20);
+
+    seq_move(&lb.client.peer, lb.server_peer, WRAP_START);
+    seq_move(lb.server_peer, &lb.client.peer, WRAP_START + 0x40);
+
+    for (i = 0; i < MESSAGES; i++) {
+        message_fill(buffer, i, message_size(i));
+        check(rudp_client_send(&lb.client, 1, 0, buffer,
+                               message_size(i)) == 0);
+    }
+
+    check(loopback_run(&lb, 10000) == 0);
+    check(t.server_next == MESSAGES);
+    check(t.client_next == MESSAGES);
+
+    /* Both directions went past the wrap */
+    check(lb.client.peer.channels[0].out_seq_reliable < WRAP_START);
+    check(lb.server_peer->channels[0].out_seq_reliable < WRAP_START);
+    check(lb.lost == 0);
+
+out:
+    loopback_deinit(&lb);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    /* Compact, seq32 and original 16-bit headers */
+    run(RUDP_FEATURE_ALL);
+    run(RUDP_FEATURE_ALL & ~RUDP_FEATURE_COMPACT);
+    run(RUDP_FEATURE_ALL & ~(RUDP_FEATURE_COMPACT | RUDP_FEATURE_SEQ32));
+
+    return loopback_report(argv[0]);
+}
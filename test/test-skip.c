@@ -0,0 +1,163 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Partial reliability.  Every transmission of a partially reliable
+  message is lost: once it expires, by retransmission count or time to
+  live, the receiver is told to skip it and the message after it on
+  the channel is delivered.  Without the feature agreed on, the
+  message is retransmitted until it arrives, in order.
+ */
+
+#include <string.h>
+
+#include <rudp/packet.h>
+#include <rudp/peer.h>
+
+#include "loopback.h"
+
+#define SIZE 100
+#define MAX_RETRANSMITS 2
+#define TTL 300
+
+enum command
+{
+    COMMAND_PARTIAL = 1,
+    COMMAND_NEXT,
+};
+
+struct skip_test
+{
+    int skip;
+    rudp_time_t ttl;
+    unsigned int max_retransmits;
+    unsigned int received[3];
+    int order_ok;
+    unsigned int partial_sent;
+    unsigned int skips;
+};
+
+static void message_fill(uint8_t *data, enum command command)
+{
+    memset(data, command, SIZE);
+}
+
+static void connected(struct loopback *lb)
+{
+    struct skip_test *t = lb->arg;
+    uint8_t buffer[SIZE];
+
+    message_fill(buffer, COMMAND_PARTIAL);
+    check(rudp_client_send_partial(&lb->client, 0, COMMAND_PARTIAL,
+                                   buffer, SIZE, t->ttl,
+                                   t->max_retransmits) == 0);
+
+    message_fill(buffer, COMMAND_NEXT);
+    check(rudp_client_send(&lb->client, 1, COMMAND_NEXT,
+                           buffer, SIZE) == 0);
+}
+
+static void server_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    struct skip_test *t = lb->arg;
+    uint8_t buffer[SIZE];
+
+    check(command == COMMAND_PARTIAL || command == COMMAND_NEXT);
+    if (command != COMMAND_PARTIAL && command != COMMAND_NEXT)
+        return;
+
+    message_fill(buffer, command);
+    check(len == SIZE && !memcmp(data, buffer, len));
+
+    /* Partial message, when it comes, comes first */
+    if (command == COMMAND_NEXT) {
+        t->order_ok = t->skip || t->received[COMMAND_PARTIAL] == 1;
+        loopback_stop(lb);
+    }
+
+    t->received[command]++;
+}
+
+/* Partial message is lost, for good when it may be skipped, past its
+   retransmission limit otherwise */
+static int relay(struct loopback *lb, int to_server,
+                 const uint8_t *data, size_t len)
+{
+    struct skip_test *t = lb->arg;
+
+    (void)len;
+
+    if (!to_server)
+        return 1;
+
+    if (loopback_command(data) == RUDP_CMD_SKIP) {
+        t->skips++;
+        return 1;
+    }
+
+    if (loopback_command(data) != RUDP_CMD_APP + COMMAND_PARTIAL)
+        return 1;
+
+    return !t->skip && ++t->partial_sent > MAX_RETRANSMITS + 1;
+}
+
+static const struct loopback_handler handler = {
+    .connected = connected,
+    .server_packet = server_packet,
+    .relay = relay,
+};
+
+static void run(uint32_t features, rudp_time_t ttl,
+                unsigned int max_retransmits)
+{
+    struct skip_test t;
+    struct loopback lb;
+
+    memset(&t, 0, sizeof(t));
+    t.skip = !!(features & RUDP_FEATURE_SKIP);
+    t.ttl = ttl;
+    t.max_retransmits = max_retransmits;
+
+    loopback_init(&lb, &handler, &t);
+    rudp_set_features(&lb.server_rudp, features);
+
+    check(loopback_start(&lb) == 0);
+    check(loopback_run(&lb, 5000) == 0);
+    check(t.received[COMMAND_NEXT] == 1);
+    check(t.order_ok);
+
+    /* Nothing else arrives */
+    loopback_wait(&lb, 200);
+    check(t.received[COMMAND_NEXT] == 1);
+    check(lb.lost == 0);
+
+    if (t.skip) {
+        check(t.received[COMMAND_PARTIAL] == 0);
+        check(t.skips > 0);
+    } else {
+        check(t.received[COMMAND_PARTIAL] == 1);
+        check(t.skips == 0);
+    }
+
+    loopback_deinit(&lb);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    run(RUDP_FEATURE_ALL, 0, MAX_RETRANSMITS);
+    run(RUDP_FEATURE_ALL, TTL, 0);
+    run(RUDP_FEATURE_ALL & ~RUDP_FEATURE_SKIP, 0, MAX_RETRANSMITS);
+
+    return loopback_report(argv[0]);
+}
@@ -0,0 +1,133 @@
+/*
+  Librudp, a reliable UDP transport library.
+
+  This file is part of FOILS, the Freebox Open Interface
+  Libraries. This file is distributed under a 2-clause BSD license,
+  see LICENSE.TXT for details.
+
+  Copyright (c) 2011, Freebox SAS
+  See AUTHORS for details
+ */
+
+/*
+  Client pauses reading while the server sends it more than its
+  receive window.  Held messages must not grow past the window, with
+  or without the window feature, and all messages must be delivered
+  in order on resume.
+ */
+
+#include <string.h>
+
+#include <rudp/packet.h>
+#include <rudp/peer.h>
+
+#include "loopback.h"
+
+#define MESSAGES 64
+#define MESSAGE_SIZE 1000
+#define WINDOW 8192
+
+struct window_test
+{
+    unsigned int received;
+    unsigned int app_packets;
+};
+
+static void connected(struct loopback *lb)
+{
+    check(rudp_client_pause_reading(&lb->client, 1) == 0);
+    check(rudp_client_send(&lb->client, 1, 0, "go", 2) == 0);
+}
+
+static void server_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    uint8_t buffer[MESSAGE_SIZE];
+    unsigned int i;
+
+    (void)command;
+    (void)data;
+    (void)len;
+
+    for (i = 0; i < MESSAGES; i++) {
+        memset(buffer, i, sizeof(buffer));
+        check(rudp_server_send(&lb->server, lb->server_peer, 1, 0,
+                               buffer, sizeof(buffer)) == 0);
+    }
+}
+
+static void client_packet(struct loopback *lb, int command,
+                          const void *data, size_t len)
+{
+    struct window_test *t = lb->arg;
+    uint8_t buffer[MESSAGE_SIZE];
+
+    (void)command;
+
+    memset(buffer, t->received, sizeof(buffer));
+    check(len == sizeof(buffer) && !memcmp(data, buffer, len));
+
+    if (++t->received == MESSAGES)
+        loopback_stop(lb);
+}
+
+static int relay(struct loopback *lb, int to_server,
+                 const uint8_t *data, size_t len)
+{
+    struct window_test *t = lb->arg;
+
+    (void)len;
+
+    if (!to_server && loopback_command(data) >= RUDP_CMD_APP)
+        t->app_packets++;
+
+    return 1;
+}
+
+static const struct loopback_handler handler = {
+    .connected = connected,
+    .server_packet = server_packet,
+    .client_packet = client_packet,
+    .relay = relay,
+};
+
+static void run(uint32_t features)
+{
+    struct window_test t = { 0, 0 };
+    struct loopback lb;
+
+    loopback_init(&lb, &handler, &t);
+    rudp_set_features(&lb.server_rudp, features);
+    rudp_set_features(&lb.client_rudp, features);
+    rudp_set_receive_window(&lb.client_rudp, WINDOW);
+
+    check(loopback_start(&lb) == 0);
+    loopback_wait(&lb, 1000);
+
+    check(lb.connected);
+    check(t.received == 0);
+    check(lb.client.peer.held_size > 0);
+    check(lb.client.peer.held_size <= WINDOW + MESSAGE_SIZE);
+
+    /* Refused packets are sent again on the retransmission timer, not
+       on every refusal */
+    check(t.app_packets < 3 * MESSAGES);
+
+    check(rudp_client_pause_reading(&lb.client, 0) == 0);
+    check(loopback_run(&lb, 10000) == 0);
+    check(t.received == MESSAGES);
+    check(lb.client.peer.held_size == 0);
+    check(lb.lost == 0);
+
+    loopback_deinit(&lb);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    run(RUDP_FEATURE_ALL);
+    run(RUDP_FEATURE_ALL & ~RUDP_FEATURE_WINDOW);
+
+    return loopback_report(argv[0]);
+}